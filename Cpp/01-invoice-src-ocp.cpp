@@ -1,10 +1,32 @@
 // 01-invoice-srp-ocp.cpp
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <memory>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "admission.hpp"
+#include "alloc-profiler.hpp"
+#include "arena.hpp"
+#include "bench.hpp"
+#include "executor.hpp"
+#include "invoice-events.hpp"
+#include "io-reactor.hpp"
+#include "numa.hpp"
+#include "trace.hpp"
 using namespace std;
 
 struct LineItem
@@ -14,6 +36,17 @@ struct LineItem
     double unitPrice{0.0};
 };
 
+// Large batches keep their line items in a huge-page arena (arena.hpp);
+// otherwise this is an ordinary heap vector.
+using LineItems = vector<LineItem, arena::Allocator<LineItem>>;
+
+struct InvoiceJob
+{
+    LineItems items;
+    string email;
+    string number; // assigned by billing; identifies the invoice downstream
+};
+
 
 
 // ------------------ Discount Strategy -------------------------
@@ -74,7 +107,7 @@ public:
 class IInvoiceRenderer
 {
     public:
-    virtual string render(const vector<LineItem> &items,
+    virtual string render(const LineItems &items,
                           double subtotal,
                           double discounts,
                           double tax,
@@ -85,7 +118,7 @@ class IInvoiceRenderer
 class SimpleTextRenderer : public IInvoiceRenderer
 {
 public:
-    string render(const vector<LineItem> &items,
+    string render(const LineItems &items,
                   double subtotal,
                   double discount,
                   double tax,
@@ -110,19 +143,48 @@ public:
 class IEmailService
 {
 public:
-    virtual void send(const string &email, const string &content) = 0;
+    virtual void send(const string &invoiceNo, const string &email, const string &content) = 0;
     virtual ~IEmailService() = default;
 };
 
 class ConsoleEmailService : public IEmailService
 {
 public:
-    void send(const string &email, const string &) override
+    void send(const string &, const string &email, const string &) override
     {
+        TRACE_SPAN("ConsoleEmailService::send", "invoice");
+        ALLOC_SCOPE("invoice.email");
         cout << "[SMTP] Sending invoice to " << email << "...\n";
     }
 };
 
+class NullEmailService : public IEmailService
+{
+public:
+    void send(const string &, const string &, const string &) override {}
+};
+
+// Hands invoices to the notification service (03) as events instead of
+// mailing them here, so they share its batching, signing and rate limits.
+// Appends are buffered; the owner flushes the log once per billing run.
+// The event id comes from the invoice number, so one without a number
+// cannot be deduplicated and is not published.
+class NotificationPipelineEmailService : public IEmailService
+{
+    events::InvoiceEventLog *log;
+
+public:
+    NotificationPipelineEmailService(events::InvoiceEventLog *l) : log(l) {}
+
+    void send(const string &invoiceNo, const string &email, const string &content) override
+    {
+        TRACE_SPAN("NotificationPipelineEmailService::send", "invoice");
+        ALLOC_SCOPE("invoice.publish");
+        if (invoiceNo.empty() || !log->append({events::invoiceEventId(invoiceNo), email, content}))
+            cout << "[Events] invoice for " << email << " not published\n";
+    }
+};
+
 
 
 // ------------------ Logger -------------------------
@@ -142,6 +204,332 @@ public:
     }
 };
 
+class NullLogger : public ILogger
+{
+public:
+    void log(const string &) override {}
+};
+
+
+
+
+// ------------------ Price Catalog -------------------------
+// Immutable SKU -> price file, built offline (--build-catalog, or `make
+// catalog`) and mmapped read-only. A perfect hash (hash and displace: each
+// key's bucket stores the displacement that sends it to a slot of its
+// own) maps every SKU to exactly one entry, so a lookup is one hash, one
+// displacement and one entry probe, with no allocation. The table is 98%
+// full, so the last buckets placed still find a free slot quickly; unused
+// slots hold an empty SKU. Publishing a new catalog is a rename over the
+// old file plus PriceCatalogHandle::reload(); batches already priced from
+// the old mapping keep it alive until they finish.
+//
+// File: CatalogHeader | uint32 displacement[buckets] | CatalogEntry[slots]
+struct CatalogEntry
+{
+    char sku[16]; // NUL-padded; 15 chars fit LineItem::sku without allocating
+    double unitPrice;
+    uint64_t reserved;
+};
+
+struct CatalogHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t seed;
+    uint64_t count; // SKUs
+    uint64_t buckets;
+    uint64_t slots; // entries, a little over count
+    uint64_t checksum; // FNV-1a of everything after the header
+};
+
+// One "SKU,price" line of a --build-catalog CSV, whitespace around either
+// field ignored. False for a missing comma or SKU, or a price that is not
+// a whole finite, non-negative number.
+bool parsePriceLine(string_view line, pair<string, double> &out)
+{
+    auto trim = [](string_view v)
+    {
+        while (!v.empty() && isspace((unsigned char)v.front()))
+            v.remove_prefix(1);
+        while (!v.empty() && isspace((unsigned char)v.back()))
+            v.remove_suffix(1);
+        return v;
+    };
+    size_t comma = line.find(',');
+    if (comma == string_view::npos)
+        return false;
+    string_view sku = trim(line.substr(0, comma));
+    string price(trim(line.substr(comma + 1)));
+    if (sku.empty() || price.empty())
+        return false;
+    char *end = nullptr;
+    double value = strtod(price.c_str(), &end);
+    if (end != price.c_str() + price.size() || !isfinite(value) || value < 0)
+        return false;
+    out = {string(sku), value};
+    return true;
+}
+
+class PriceCatalog
+{
+    const char *base{nullptr};
+    size_t size{0};
+    const CatalogHeader *header{nullptr};
+    const uint32_t *displacement{nullptr};
+    const CatalogEntry *entries{nullptr};
+
+    static constexpr char kMagic[8] = {'P', 'R', 'I', 'C', 'E', 'C', 'A', 'T'};
+    static constexpr size_t kMaxSku = sizeof(CatalogEntry::sku) - 1;
+
+    static uint64_t hash(string_view sku, uint32_t seed)
+    {
+        uint64_t h = 1469598103934665603ULL ^ seed;
+        for (unsigned char c : sku)
+            h = (h ^ c) * 1099511628211ULL;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 33);
+    }
+
+    static uint64_t slotOf(uint64_t h, uint32_t d, uint64_t count)
+    {
+        uint64_t x = h + d * 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 31)) * 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 29;
+        return (uint64_t)(((unsigned __int128)x * count) >> 64); // x mod count, without the divide
+    }
+
+    static uint64_t checksum(const char *p, size_t n)
+    {
+        uint64_t h = 1469598103934665603ULL;
+        for (size_t i = 0; i < n; ++i)
+            h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+        return h;
+    }
+
+    static size_t tableBytes(uint64_t buckets) { return (buckets * 4 + 7) & ~size_t(7); }
+
+    PriceCatalog() = default;
+
+public:
+    ~PriceCatalog()
+    {
+        if (base)
+            munmap((void *)base, size);
+    }
+    PriceCatalog(const PriceCatalog &) = delete;
+    PriceCatalog &operator=(const PriceCatalog &) = delete;
+
+    // Writes `prices` as a catalog at `path` (via a temp file and rename,
+    // so readers see the old or the new file, never a partial one).
+    // Fails on duplicate, empty or over-long SKUs.
+    static bool build(const vector<pair<string, double>> &prices, const string &path)
+    {
+        const uint32_t kFree = UINT32_MAX;
+        uint64_t n = prices.size();
+        if (n >= kFree)
+            return false;
+        uint64_t nb = max<uint64_t>(1, n / 3);
+        uint64_t slots = n + n / 49; // load factor 0.98
+
+        // Duplicates: only keys with equal hashes need a string compare
+        vector<pair<uint64_t, uint32_t>> byHash(n);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            auto &sku = prices[i].first;
+            if (sku.empty() || sku.size() > kMaxSku)
+                return false;
+            byHash[i] = {hash(sku, 0), i};
+        }
+        sort(byHash.begin(), byHash.end());
+        for (size_t i = 1; i < byHash.size(); ++i)
+            for (size_t j = i; j-- > 0 && byHash[j].first == byHash[i].first;)
+                if (prices[byHash[j].second].first == prices[byHash[i].second].first)
+                    return false;
+        byHash = {};
+
+        // Keys grouped by bucket (bucket b owns keys[first[b]..first[b+1]))
+        // with each key hashed once per seed; buckets are placed largest
+        // first, each trying up to 2^16 displacements against an occupancy
+        // bitmap small enough to stay in cache.
+        vector<uint64_t> hashes(n), used((slots + 63) / 64);
+        vector<uint32_t> disp(nb, 0);
+        vector<uint32_t> keys(n), first(nb + 1), order(nb);
+        vector<uint64_t> taken;
+        uint32_t seed = 0;
+        bool placed = n == 0;
+        for (; !placed && seed < 64; ++seed)
+        {
+            fill(first.begin(), first.end(), 0);
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                hashes[i] = hash(prices[i].first, seed);
+                ++first[hashes[i] % nb + 1];
+            }
+            for (uint64_t b = 0; b < nb; ++b)
+                first[b + 1] += first[b];
+            vector<uint32_t> at(first.begin(), first.end() - 1);
+            for (uint32_t i = 0; i < n; ++i)
+                keys[at[hashes[i] % nb]++] = i;
+            for (uint32_t b = 0; b < nb; ++b)
+                order[b] = b;
+            stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+                        { return first[a + 1] - first[a] > first[b + 1] - first[b]; });
+
+            fill(used.begin(), used.end(), 0);
+            placed = true;
+            for (uint32_t b : order)
+            {
+                const uint32_t *lo = keys.data() + first[b], *hi = keys.data() + first[b + 1];
+                if (lo == hi)
+                    break;
+                bool ok = false;
+                for (uint32_t d = 0; d < (1u << 16) && !ok; ++d)
+                {
+                    taken.clear();
+                    ok = true;
+                    for (const uint32_t *k = lo; k != hi; ++k)
+                    {
+                        uint64_t s = slotOf(hashes[*k], d, slots);
+                        if ((used[s >> 6] >> (s & 63) & 1) || std::find(taken.begin(), taken.end(), s) != taken.end())
+                        {
+                            ok = false;
+                            break;
+                        }
+                        taken.push_back(s);
+                    }
+                    if (ok)
+                    {
+                        disp[b] = d;
+                        for (uint64_t t : taken)
+                            used[t >> 6] |= 1ull << (t & 63);
+                    }
+                }
+                if (!ok)
+                {
+                    placed = false; // unlucky seed: start over with the next
+                    break;
+                }
+            }
+            if (placed)
+                break;
+        }
+        if (!placed)
+            return false;
+        vector<uint32_t> slotKey(slots, kFree);
+        for (uint32_t i = 0; i < n; ++i)
+            slotKey[slotOf(hashes[i], disp[hashes[i] % nb], slots)] = i;
+
+        string body(tableBytes(nb) + slots * sizeof(CatalogEntry), '\0');
+        memcpy(&body[0], disp.data(), nb * 4);
+        CatalogEntry *out = (CatalogEntry *)&body[tableBytes(nb)];
+        for (uint64_t s = 0; s < slots; ++s)
+        {
+            if (slotKey[s] == kFree)
+                continue;
+            auto &p = prices[slotKey[s]];
+            memcpy(out[s].sku, p.first.data(), p.first.size());
+            out[s].unitPrice = p.second;
+        }
+
+        CatalogHeader h{};
+        memcpy(h.magic, kMagic, sizeof(kMagic));
+        h.version = 2;
+        h.seed = seed;
+        h.count = n;
+        h.buckets = nb;
+        h.slots = slots;
+        h.checksum = checksum(body.data(), body.size());
+
+        string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+                  write(fd, body.data(), body.size()) == (ssize_t)body.size() &&
+                  fsync(fd) == 0;
+        close(fd);
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    // nullptr if the file is missing, truncated or corrupt.
+    static shared_ptr<const PriceCatalog> open(const string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CatalogHeader))
+        {
+            if (fd >= 0)
+                close(fd);
+            return nullptr;
+        }
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return nullptr;
+
+        shared_ptr<PriceCatalog> c(new PriceCatalog());
+        c->base = (const char *)p;
+        c->size = st.st_size;
+        c->header = (const CatalogHeader *)p;
+        const CatalogHeader &h = *c->header;
+        size_t table = tableBytes(h.buckets);
+        if (memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 || h.version != 2 || h.buckets == 0 ||
+            h.slots < h.count || c->size != sizeof(h) + table + h.slots * sizeof(CatalogEntry) ||
+            checksum(c->base + sizeof(h), c->size - sizeof(h)) != h.checksum)
+            return nullptr;
+        c->displacement = (const uint32_t *)(c->base + sizeof(h));
+        c->entries = (const CatalogEntry *)(c->base + sizeof(h) + table);
+        madvise((void *)c->base, c->size, MADV_WILLNEED);
+        return c;
+    }
+
+    size_t count() const { return header->count; }
+
+    const CatalogEntry *find(string_view sku) const
+    {
+        if (header->count == 0 || sku.empty() || sku.size() > kMaxSku)
+            return nullptr;
+        uint64_t h = hash(sku, header->seed);
+        const CatalogEntry &e = entries[slotOf(h, displacement[h % header->buckets], header->slots)];
+        if (memcmp(e.sku, sku.data(), sku.size()) != 0 || e.sku[sku.size()] != '\0')
+            return nullptr; // not in the catalog
+        return &e;
+    }
+
+    // Fills `out` with the catalog price; false for unknown SKUs. Reusing
+    // `out` across lines never allocates (SKUs fit the string's SSO buffer).
+    bool price(string_view sku, int quantity, LineItem &out) const
+    {
+        const CatalogEntry *e = find(sku);
+        if (!e)
+            return false;
+        out.sku.assign(sku.data(), sku.size());
+        out.quantity = quantity;
+        out.unitPrice = e->unitPrice;
+        return true;
+    }
+};
+
+// The live catalog. reload() swaps in a new file atomically; readers take
+// a snapshot per batch with get().
+class PriceCatalogHandle
+{
+    shared_ptr<const PriceCatalog> current;
+
+public:
+    bool reload(const string &path)
+    {
+        auto next = PriceCatalog::open(path);
+        if (!next)
+            return false; // keep serving the old catalog
+        atomic_store(&current, next);
+        return true;
+    }
+
+    shared_ptr<const PriceCatalog> get() const { return atomic_load(&current); }
+};
 
 
 
@@ -152,17 +540,15 @@ class InvoiceService
     unique_ptr<IInvoiceRenderer> renderer;
     unique_ptr<IEmailService> emailer;
     unique_ptr<ILogger> logger;
+    admission::Controller *gate; // optional overload protection
 
-public:
-    InvoiceService(unique_ptr<ITaxRule> t,
-                   unique_ptr<IInvoiceRenderer> r,
-                   unique_ptr<IEmailService> e,
-                   unique_ptr<ILogger> l)
-        : taxRule(move(t)), renderer(move(r)), emailer(move(e)), logger(move(l)) {}
+    struct Totals
+    {
+        double subtotal, discount, tax, grand;
+    };
 
-    string process(const vector<LineItem> &items,
-                   const vector<unique_ptr<IDiscountStrategy>> &discounts,
-                   const string &email)
+    Totals totals(const LineItems &items,
+                  const vector<unique_ptr<IDiscountStrategy>> &discounts) const
     {
         double subtotal = 0.0;
         for (auto &it : items)
@@ -173,34 +559,474 @@ public:
             discount_total += d->compute(subtotal);
 
         double tax = taxRule->compute(subtotal - discount_total);
-        double grand = subtotal - discount_total + tax;
+        return {subtotal, discount_total, tax, subtotal - discount_total + tax};
+    }
+
+    string price(const LineItems &items,
+                 const vector<unique_ptr<IDiscountStrategy>> &discounts,
+                 double &grand) const
+    {
+        TRACE_SPAN("InvoiceService::price", "invoice");
+        ALLOC_SCOPE("invoice.render");
+        Totals t = totals(items, discounts);
+        grand = t.grand;
+        return renderer->render(items, t.subtotal, t.discount, t.tax, t.grand);
+    }
+
+    void deliver(const vector<InvoiceJob> &jobs, const vector<string> &contents,
+                 const vector<double> &totals)
+    {
+        for (size_t i = 0; i < jobs.size(); ++i)
+        {
+            if (!jobs[i].email.empty())
+                emailer->send(jobs[i].number, jobs[i].email, contents[i]);
+            logger->log("Invoice processed for " + jobs[i].email + " total=" + to_string(totals[i]));
+        }
+    }
+
+public:
+    InvoiceService(unique_ptr<ITaxRule> t,
+                   unique_ptr<IInvoiceRenderer> r,
+                   unique_ptr<IEmailService> e,
+                   unique_ptr<ILogger> l,
+                   admission::Controller *g = nullptr)
+        : taxRule(move(t)), renderer(move(r)), emailer(move(e)), logger(move(l)), gate(g) {}
+
+    // Grand total without rendering or delivery (checkout previews).
+    double quote(const LineItems &items,
+                 const vector<unique_ptr<IDiscountStrategy>> &discounts) const
+    {
+        return totals(items, discounts).grand;
+    }
 
-        string content = renderer->render(items, subtotal, discount_total, tax, grand);
+    // Invoices are Critical by default: they wait for a slot but are never
+    // shed. Reprints pass Low and get an empty string back when admission
+    // control sheds them under overload.
+    string process(const LineItems &items,
+                   const vector<unique_ptr<IDiscountStrategy>> &discounts,
+                   const string &email,
+                   const string &invoiceNo,
+                   admission::Priority prio = admission::Priority::Critical)
+    {
+        TRACE_SPAN("InvoiceService::process", "invoice");
+        ALLOC_SCOPE("invoice.process");
+        admission::Ticket ticket;
+        if (gate && !(ticket = gate->admit(prio)))
+        {
+            logger->log("Invoice shed for " + email);
+            return "";
+        }
+        double grand = 0.0;
+        string content = price(items, discounts, grand);
 
         if (!email.empty())
-            emailer->send(email, content);
+            emailer->send(invoiceNo, email, content);
         logger->log("Invoice processed for " + email + " total=" + to_string(grand));
 
         return content;
     }
+
+    // Pricing and rendering only read const strategies, so a batch renders
+    // on the shared executor; emails and log lines still go out in order.
+    // A batch is admitted as one request, Critical unless the caller passes
+    // a lower priority (and then may be shed, returning nothing).
+    vector<string> processBatch(const vector<InvoiceJob> &jobs,
+                                const vector<unique_ptr<IDiscountStrategy>> &discounts,
+                                exec::Executor &ex = exec::defaultExecutor(),
+                                admission::Priority prio = admission::Priority::Critical)
+    {
+        TRACE_SPAN("InvoiceService::processBatch", "invoice");
+        ALLOC_SCOPE("invoice.process");
+        admission::Ticket ticket;
+        if (gate && !(ticket = gate->admit(prio)))
+        {
+            logger->log("Invoice batch of " + to_string(jobs.size()) + " shed");
+            return {};
+        }
+        vector<string> contents(jobs.size());
+        vector<double> totals(jobs.size());
+        exec::parallel_for(ex, 0, jobs.size(), 64, [&](size_t lo, size_t hi)
+                           {
+            for (size_t i = lo; i < hi; ++i)
+                contents[i] = price(jobs[i].items, discounts, totals[i]); });
+
+        deliver(jobs, contents, totals);
+        return contents;
+    }
+
+    // NUMA batch mode: shard n (built on node n, e.g. by numa::scatter) is
+    // priced by node n's pinned workers into node-local output; emails and
+    // log lines then go out in shard order.
+    vector<string> processShards(const vector<vector<InvoiceJob>> &shards,
+                                 const vector<unique_ptr<IDiscountStrategy>> &discounts,
+                                 numa::NodeExecutors &nodes,
+                                 admission::Priority prio = admission::Priority::Critical)
+    {
+        TRACE_SPAN("InvoiceService::processShards", "invoice");
+        ALLOC_SCOPE("invoice.process");
+        size_t count = 0;
+        for (auto &s : shards)
+            count += s.size();
+        admission::Ticket ticket;
+        if (gate && !(ticket = gate->admit(prio)))
+        {
+            logger->log("Invoice batch of " + to_string(count) + " shed");
+            return {};
+        }
+        vector<vector<string>> contents(shards.size());
+        vector<vector<double>> totals(shards.size());
+        nodes.eachNode([&](size_t n)
+                       {
+            if (n >= shards.size())
+                return;
+            auto &jobs = shards[n];
+            contents[n].resize(jobs.size());
+            totals[n].resize(jobs.size());
+            exec::parallel_for(nodes.executor(n), 0, jobs.size(), 64, [&](size_t lo, size_t hi)
+                               {
+                for (size_t i = lo; i < hi; ++i)
+                    contents[n][i] = price(jobs[i].items, discounts, totals[n][i]); }); });
+
+        vector<string> all;
+        all.reserve(count);
+        for (size_t n = 0; n < shards.size(); ++n)
+        {
+            deliver(shards[n], contents[n], totals[n]);
+            for (auto &c : contents[n])
+                all.push_back(move(c));
+        }
+        return all;
+    }
 };
 
-int main()
+// ------------------ Workload Generator -------------------------
+// Billing-run shaped invoices for benchmarks and PGO training: a few SKUs
+// dominate (Zipf-like), most invoices have a handful of lines, a long
+// tail has dozens, and quantities are mostly 1-3.
+class InvoiceGenerator
 {
-    vector<LineItem> items = {
+    uint64_t state;
+    uint64_t issued{0};
+
+    uint64_t next()
+    {
+        state += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+public:
+    InvoiceGenerator(uint64_t seed) : state(seed) {}
+
+    // `mem` holds the line items when given (see LineItems).
+    InvoiceJob invoice(size_t customer, arena::HugePageArena *mem = nullptr)
+    {
+        InvoiceJob job{LineItems(arena::Allocator<LineItem>(mem)), "", ""};
+        job.email = "customer" + to_string(customer) + "@example.com";
+        job.number = "INV-" + to_string(++issued);
+        size_t lines = 1;
+        while (lines < 40 && uniform() < 0.75)
+            ++lines;
+        job.items.reserve(lines);
+        for (size_t k = 0; k < lines; ++k)
+        {
+            // 5000^(u*v) piles most lines onto the first few dozen SKUs
+            size_t sku = (size_t)(pow(5000.0, uniform() * uniform()));
+            int qty = uniform() < 0.8 ? 1 + (int)(uniform() * 3) : 1 + (int)(uniform() * 50);
+            double price = 0.99 + (sku * 7919 % 50000) / 100.0;
+            job.items.push_back({"SKU-" + to_string(sku), qty, price});
+        }
+        return job;
+    }
+
+    vector<InvoiceJob> batch(size_t n, arena::HugePageArena *mem = nullptr)
+    {
+        vector<InvoiceJob> jobs;
+        jobs.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+            jobs.push_back(invoice(next() % 1000000, mem));
+        return jobs;
+    }
+};
+
+// --train [N]: representative billing run for profile-guided builds
+void runTrainingWorkload(size_t invoices)
+{
+    admission::Controller gate;
+    InvoiceService svc(make_unique<GST18>(), make_unique<SimpleTextRenderer>(),
+                       make_unique<NullEmailService>(), make_unique<NullLogger>(), &gate);
+    vector<vector<unique_ptr<IDiscountStrategy>>> discountSets(3);
+    discountSets[1].push_back(make_unique<PercentOff>(10.0));
+    discountSets[2].push_back(make_unique<PercentOff>(5.0));
+    discountSets[2].push_back(make_unique<FlatOff>(20));
+
+    InvoiceGenerator gen(2024);
+    size_t done = 0;
+    for (size_t round = 0; done < invoices; ++round)
+    {
+        auto jobs = gen.batch(min<size_t>(500, invoices - done));
+        auto &discounts = discountSets[round % discountSets.size()];
+        if (round % 4 == 3)
+            for (auto &j : jobs) // reprints go through one at a time
+                svc.process(j.items, discounts, j.email, j.number, admission::Priority::Low);
+        else
+            svc.processBatch(jobs, discounts);
+        done += jobs.size();
+    }
+    cout << "Trained on " << done << " invoices\n";
+}
+
+// ------------------ Benchmarks -------------------------
+// --bench [--reps N] [--json F] [--filter S]; returns -1 for a normal run
+int runBenchmarks(int argc, char **argv)
+{
+    if (argc < 2 || string(argv[1]).rfind("--bench", 0) != 0)
+        return -1;
+
+    vector<InvoiceJob> jobs = InvoiceGenerator(7).batch(20000);
+    vector<unique_ptr<IDiscountStrategy>> discounts;
+    discounts.push_back(make_unique<PercentOff>(10.0));
+    discounts.push_back(make_unique<FlatOff>(5));
+    InvoiceService svc(make_unique<GST18>(), make_unique<SimpleTextRenderer>(),
+                       make_unique<NullEmailService>(), make_unique<NullLogger>());
+
+    bench::Suite suite("01-invoice");
+    suite.add("process", [&]
+              {
+        for (auto &j : jobs)
+            svc.process(j.items, discounts, j.email, j.number);
+        return (double)jobs.size(); });
+    suite.add("process_batch", [&]
+              {
+        svc.processBatch(jobs, discounts);
+        return (double)jobs.size(); });
+
+    // NUMA mode on the first socket, and on all of them when there are more.
+    // Node pools and shards are built on first use.
+    unique_ptr<numa::NodeExecutors> oneNode, allNodes;
+    vector<vector<InvoiceJob>> oneNodeShards, allNodeShards;
+    suite.add("process_numa_1node", [&]
+              {
+        svc.processShards(oneNodeShards, discounts, *oneNode);
+        return (double)jobs.size(); },
+              [&]
+              {
+        if (oneNode)
+            return;
+        oneNode = make_unique<numa::NodeExecutors>(1);
+        oneNodeShards = numa::scatter(*oneNode, jobs); });
+    size_t nodeCount = numa::topology().size();
+    if (nodeCount > 1)
+        suite.add("process_numa_" + to_string(nodeCount) + "node", [&]
+                  {
+            svc.processShards(allNodeShards, discounts, *allNodes);
+            return (double)jobs.size(); },
+                  [&]
+                  {
+            if (allNodes)
+                return;
+            allNodes = make_unique<numa::NodeExecutors>();
+            allNodeShards = numa::scatter(*allNodes, jobs); });
+
+    // Quoting 200k invoices whose line items sit on 4KB pages vs in a
+    // huge-page arena: same generator and layout, only the page size
+    // differs. Built on first use (the warm-up rep).
+    const size_t quoteJobs = 200000;
+    arena::HugePageArena smallPages(64u << 20, arena::Pages::Regular), hugePages;
+    vector<InvoiceJob> jobs4k, jobsHuge;
+    auto quoteAll = [&](vector<InvoiceJob> &js, arena::HugePageArena &mem)
+    {
+        if (js.empty())
+        {
+            js = InvoiceGenerator(11).batch(quoteJobs, &mem);
+            cout << "[bench] arena " << arena::backingName(mem.backing()) << ": "
+                 << (mem.bytesUsed() >> 20) << " MB of line items, "
+                 << (mem.hugeBytes() >> 20) << " MB on huge pages\n";
+        }
+        double sum = 0;
+        for (auto &j : js)
+            sum += svc.quote(j.items, discounts);
+        return sum > 0 ? (double)js.size() : 0.0;
+    };
+    suite.add("quote_4k_pages", [&]
+              { return quoteAll(jobs4k, smallPages); });
+    suite.add("quote_huge_pages", [&]
+              { return quoteAll(jobsHuge, hugePages); });
+
+    // SKU + quantity -> priced line: one probe into a mmapped 200k-SKU
+    // catalog vs a heap unordered_map of the same prices. Built on first use.
+    const size_t catalogSkus = 200000;
+    shared_ptr<const PriceCatalog> mapped;
+    unordered_map<string, double> heapPrices;
+    vector<string> lookups;
+    auto prepareCatalog = [&]
+    {
+        if (mapped)
+            return;
+        vector<pair<string, double>> prices;
+        for (size_t i = 0; i < catalogSkus; ++i)
+            prices.push_back({"SKU-" + to_string(i), 0.99 + (i * 7919 % 50000) / 100.0});
+        auto t0 = chrono::steady_clock::now();
+        PriceCatalog::build(prices, "bench-prices.catalog");
+        double buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        mapped = PriceCatalog::open("bench-prices.catalog");
+        remove("bench-prices.catalog"); // the mapping outlives the name
+        heapPrices.insert(prices.begin(), prices.end());
+        for (size_t i = 0; i < 1000000; ++i)
+            lookups.push_back("SKU-" + to_string(i * 2654435761u % catalogSkus));
+        cout << "[bench] catalog: " << catalogSkus << " SKUs built in " << buildMs << " ms\n";
+    };
+    suite.add("catalog_price", [&]
+              {
+        prepareCatalog();
+        LineItem line;
+        double sum = 0;
+        for (auto &sku : lookups)
+            if (mapped && mapped->price(sku, 1, line))
+                sum += line.unitPrice;
+        return sum > 0 ? (double)lookups.size() : 0.0; });
+    suite.add("catalog_map_baseline", [&]
+              {
+        prepareCatalog();
+        LineItem line;
+        double sum = 0;
+        for (auto &sku : lookups)
+        {
+            auto it = heapPrices.find(sku);
+            if (it == heapPrices.end())
+                continue;
+            line.sku.assign(sku);
+            line.quantity = 1;
+            line.unitPrice = it->second;
+            sum += line.unitPrice;
+        }
+        return sum > 0 ? (double)lookups.size() : 0.0; });
+
+    // Offline catalog build at 5M SKUs (the perfect hash search dominates).
+    // Prices are generated in setup on first use.
+    const size_t buildSkus = 5000000;
+    vector<pair<string, double>> buildPrices;
+    suite.add("catalog_build_5m", [&]
+              {
+        bool ok = PriceCatalog::build(buildPrices, "bench-build.catalog");
+        remove("bench-build.catalog");
+        return ok ? (double)buildPrices.size() : 0.0; },
+              [&]
+              {
+        if (!buildPrices.empty())
+            return;
+        buildPrices.reserve(buildSkus);
+        for (size_t i = 0; i < buildSkus; ++i)
+            buildPrices.push_back({"SKU-" + to_string(i), 0.99 + (i * 7919 % 50000) / 100.0});
+    });
+    return bench::main(suite, argc, argv);
+}
+
+int main(int argc, char **argv)
+{
+    // ALLOC_PROFILE_OUT=<file.json> in -DALLOC_PROFILE builds, any mode
+    alloc::Session allocProfile(getenv("ALLOC_PROFILE_OUT"));
+
+    if (argc > 1 && string(argv[1]) == "--train")
+    {
+        runTrainingWorkload(argc > 2 ? strtoull(argv[2], nullptr, 10) : 50000);
+        return 0;
+    }
+    if (argc > 3 && string(argv[1]) == "--build-catalog")
+    {
+        // --build-catalog <prices.csv> <out.catalog>: one "SKU,price" per line
+        // blank lines are skipped, any other malformed line fails the build
+        ifstream in(argv[2]);
+        vector<pair<string, double>> prices;
+        string line;
+        for (size_t lineNo = 1; getline(in, line); ++lineNo)
+        {
+            if (line.find_first_not_of(" \t\r") == string::npos)
+                continue;
+            pair<string, double> price;
+            if (!parsePriceLine(line, price))
+            {
+                cerr << argv[2] << ":" << lineNo << ": expected \"SKU,price\", got \"" << line << "\"\n";
+                return 1;
+            }
+            prices.push_back(move(price));
+        }
+        if (!in.eof() || !PriceCatalog::build(prices, argv[3]))
+        {
+            cerr << "cannot build catalog " << argv[3] << " from " << argv[2] << "\n";
+            return 1;
+        }
+        cout << "[Catalog] " << prices.size() << " SKUs -> " << argv[3] << "\n";
+        return 0;
+    }
+    int benchResult = runBenchmarks(argc, argv);
+    if (benchResult >= 0)
+        return benchResult;
+
+    // TRACE_OUT=<file.json> records spans for the run
+    trace::Session tracing(getenv("TRACE_OUT"));
+
+    LineItems items = {
         {"ITEM-001", 3, 100.0},
         {"ITEM-002", 1, 250.0}};
 
     vector<unique_ptr<IDiscountStrategy>> discounts;
     discounts.push_back(make_unique<PercentOff>(10.0));
 
+    // Invoice emails are delivered by the notification service
+    // (./03-notify-dip-ocp --invoice-events invoice-events.spool); the
+    // spool is written through the shared I/O reactor
+    auto reactor = io::makeReactor();
+    events::InvoiceEventLog invoiceEvents("invoice-events.spool", reactor.get());
+
+    // Sheds reprints when queue delay stays above 5ms for 100ms; invoices wait
+    admission::Controller gate({16, chrono::milliseconds(5), chrono::milliseconds(100), 1024});
+
     InvoiceService svc(
         make_unique<GST18>(),
         make_unique<SimpleTextRenderer>(),
-        make_unique<ConsoleEmailService>(),
-        make_unique<ConsoleLogger>());
+        make_unique<NotificationPipelineEmailService>(&invoiceEvents),
+        make_unique<ConsoleLogger>(),
+        &gate);
+
+    cout << svc.process(items, discounts, "customer@example.com", "INV-1001");
+
+    vector<InvoiceJob> batch = {
+        {items, "alice@example.com", "INV-1002"},
+        {{{"ITEM-003", 2, 75.0}}, "bob@example.com", "INV-1003"},
+        {{{"ITEM-001", 10, 100.0}, {"ITEM-004", 1, 999.0}}, "carol@example.com", "INV-1004"}};
+    auto rendered = svc.processBatch(batch, discounts);
+    cout << "Batch: " << rendered.size() << " invoices rendered on "
+         << exec::defaultExecutor().size() << " worker(s)\n";
+
+    // Catalog-priced order: SKU + quantity in, priced line items out
+    PriceCatalog::build({{"ITEM-001", 100.0}, {"ITEM-002", 250.0}, {"ITEM-003", 75.0}, {"ITEM-004", 999.0}},
+                        "prices.catalog");
+    PriceCatalogHandle catalog;
+    if (catalog.reload("prices.catalog"))
+    {
+        auto prices = catalog.get();
+        LineItems order(2);
+        if (prices->price("ITEM-003", 4, order[0]) && prices->price("ITEM-004", 1, order[1]))
+            svc.process(order, discounts, "dave@example.com", "INV-1005");
+        cout << "[Catalog] " << prices->count() << " SKUs, ITEM-999 "
+             << (prices->find("ITEM-999") ? "found" : "unknown") << "\n";
+    }
+
+    admission::Stats gateStats = gate.stats();
+    cout << "[Admission] admitted=" << gateStats.admittedTotal()
+         << " shed=" << gateStats.shedTotal()
+         << " maxQueueDelayMs=" << gateStats.maxQueueDelayMs << "\n";
 
-    cout << svc.process(items, discounts, "customer@example.com");
+    if (invoiceEvents.flush())
+        cout << "[Events] " << invoiceEvents.appendedCount()
+             << " invoice events published to invoice-events.spool\n";
+    else
+        cout << "[Events] failed to publish invoice events\n";
 
     return 0;
 }
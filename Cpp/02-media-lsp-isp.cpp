@@ -1,8 +1,18 @@
 // 02-media-lsp-isp-perfect-10-10.cpp
 // Final SOLID-Compliant Version (Perfect 10/10)
 
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "alloc-profiler.hpp"
+#include "bench.hpp"
+#include "executor.hpp"
+#include "io-reactor.hpp"
+#include "trace.hpp"
 using namespace std;
 
 // -------------------------------------------------------------
@@ -54,8 +64,14 @@ public:
 
 class AudioPlayer : public IPlayable, public IPausable, public IDownloadable {
     bool playing{false};
+    io::IoReactor *reactor{nullptr};  // optional: real downloads
+    size_t downloaded{0};
+    bool downloadFailed{false};
 
 public:
+    AudioPlayer() = default;
+    explicit AudioPlayer(io::IoReactor *r) : reactor(r) {}
+
     void play(const string &src) override {
         (void)src;
         playing = true;
@@ -66,7 +82,78 @@ public:
     }
 
     void download(const string &url) override {
-        (void)url; // simulate download
+        TRACE_SPAN("AudioPlayer::download", "media");
+        ALLOC_SCOPE("media.download");
+        downloaded = 0;
+        downloadFailed = false;
+        if (!reactor) {
+            (void)url; // simulate download
+            return;
+        }
+
+        // file:// media store: chunked reads into the reactor's registered
+        // buffers, up to 4 in flight. A short read re-issues the rest of
+        // its chunk, so the file arrives without gaps or not at all.
+        string path = url.rfind("file://", 0) == 0 ? url.substr(7) : url;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0)
+                close(fd);
+            downloadFailed = true;
+            return;
+        }
+
+        int64_t next = 0;
+        vector<pair<int64_t, size_t>> rest;  // unread tails of short reads
+        int inflight = 0;
+        bool failed = false;
+        function<void()> issue = [&]() {
+            while (inflight < 4 && (!rest.empty() || next < st.st_size) && !failed) {
+                io::FixedBuffer b;
+                if (!reactor->acquire(b)) {
+                    failed = inflight == 0;  // nothing will free one
+                    break;
+                }
+                int64_t offset;
+                size_t len;
+                if (!rest.empty()) {
+                    offset = rest.back().first;
+                    len = rest.back().second;  // fits: it was part of one chunk
+                    rest.pop_back();
+                } else {
+                    offset = next;
+                    len = min<size_t>(b.size, st.st_size - next);
+                    next += len;
+                }
+                ++inflight;
+                reactor->readFixed(fd, b, len, offset, [&, b, offset, len](int r) {
+                    --inflight;
+                    reactor->release(b);
+                    if (r <= 0) {
+                        failed = true;  // error, or EOF before st_size
+                    } else {
+                        downloaded += r;
+                        if ((size_t)r < len)
+                            rest.push_back({offset + r, len - r});
+                    }
+                    issue();
+                });
+            }
+        };
+        issue();
+        reactor->runUntil([&] { return inflight == 0; });
+        close(fd);
+        downloadFailed = failed || downloaded != (size_t)st.st_size;
+    }
+
+    size_t downloadedBytes() const {
+        return downloaded;
+    }
+
+    // Last download() could not read the whole file.
+    bool lastDownloadFailed() const {
+        return downloadFailed;
     }
 
     bool isPlaying() const override {
@@ -156,16 +243,185 @@ public:
     }
 };
 
+// -------------------------------------------------------------
+// Media Jobs
+// Offline analysis that runs on the shared executor, e.g. the
+// loudness pass before a track is published.
+// -------------------------------------------------------------
+
+struct Loudness {
+    int peak{0};
+    double sumSquares{0.0};
+    size_t samples{0};
+
+    double rmsDbfs() const {
+        if (samples == 0 || sumSquares == 0.0)
+            return -INFINITY;
+        return 20.0 * log10(sqrt(sumSquares / samples) / 32768.0);
+    }
+};
+
+Loudness measureLoudness(const vector<int16_t> &pcm,
+                         exec::Executor &ex = exec::defaultExecutor()) {
+    return exec::parallel_reduce(
+        ex, 0, pcm.size(), 1 << 16, Loudness{},
+        [&](size_t lo, size_t hi) {
+            TRACE_SPAN("measureLoudness::chunk", "media");
+            ALLOC_SCOPE("media.loudness");
+            Loudness l;
+            for (size_t i = lo; i < hi; ++i) {
+                int s = pcm[i];
+                l.peak = max(l.peak, s < 0 ? -s : s);
+                l.sumSquares += (double)s * s;
+            }
+            l.samples = hi - lo;
+            return l;
+        },
+        [](const Loudness &a, const Loudness &b) {
+            return Loudness{max(a.peak, b.peak), a.sumSquares + b.sumSquares,
+                            a.samples + b.samples};
+        });
+}
+
+// -------------------------------------------------------------
+// Workload Generator
+// Music-like PCM for benchmarks and PGO training: a few partials under
+// a slow envelope plus noise, with occasional clipped peaks, at the
+// lengths and layouts a catalog actually holds.
+// -------------------------------------------------------------
+
+class StreamGenerator {
+    uint32_t state;
+
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    double uniform() { return next() * (1.0 / 4294967296.0); }
+
+public:
+    explicit StreamGenerator(uint32_t seed) : state(seed ? seed : 1) {}
+
+    vector<int16_t> stream(double seconds, int rate = 48000, int channels = 2) {
+        static vector<float> wave = [] {
+            vector<float> w(4096);
+            for (size_t i = 0; i < w.size(); ++i)
+                w[i] = (float)sin(2 * M_PI * i / w.size());
+            return w;
+        }();
+        auto osc = [&](double cycles) { return wave[(size_t)(cycles * 4096) & 4095]; };
+
+        size_t frames = (size_t)(seconds * rate);
+        vector<int16_t> pcm(frames * channels);
+        double f0 = 80 + uniform() * 800, gain = 0.1 + uniform() * 0.8;
+        for (size_t i = 0; i < frames; ++i) {
+            double t = (double)i / rate;
+            double env = 0.5 + 0.5 * osc(0.25 * t);
+            double v = osc(f0 * t) + 0.5 * osc(2 * f0 * t) + 0.25 * osc(3 * f0 * t) +
+                       0.1 * (uniform() - 0.5);
+            double sample = v * env * gain * 32767 / 1.85;
+            for (int c = 0; c < channels; ++c)
+                pcm[i * channels + c] = (int16_t)max(-32768.0, min(32767.0, sample * (c ? 0.9 : 1.0)));
+        }
+        return pcm;
+    }
+
+    // Mostly 2-5 minute tracks, some short clips, occasional mono.
+    vector<int16_t> track() {
+        double r = uniform();
+        double seconds = r < 0.2 ? 5 + uniform() * 25 : 120 + uniform() * 180;
+        return stream(seconds, uniform() < 0.8 ? 48000 : 44100, uniform() < 0.9 ? 2 : 1);
+    }
+};
+
+// --train [N]: publish-pipeline shaped run for profile-guided builds
+void runTrainingWorkload(size_t tracks) {
+    auto reactor = io::makeReactor();
+    StreamGenerator gen(2024);
+    double loudest = -INFINITY;
+    for (size_t i = 0; i < tracks; ++i) {
+        AudioPlayer ap(reactor.get());
+        ap.download("file:///proc/self/exe");
+        ap.play("track.mp3");
+        Loudness l = measureLoudness(gen.track());
+        loudest = max(loudest, l.rmsDbfs());
+        ap.pause();
+
+        LiveStreamPlayer cam;
+        cam.play("rtsp://cam");
+        cam.pause();
+        cam.play("rtsp://cam");
+    }
+    cout << "Trained on " << tracks << " tracks (loudest " << loudest << " dBFS)\n";
+}
+
+// -------------------------------------------------------------
+// Benchmarks
+// --bench [--reps N] [--json F] [--filter S]; -1 for a normal run
+// -------------------------------------------------------------
+
+int runBenchmarks(int argc, char **argv) {
+    if (argc < 2 || string(argv[1]).rfind("--bench", 0) != 0)
+        return -1;
+
+    vector<int16_t> pcm = StreamGenerator(7).stream(60);
+    auto reactor = io::makeReactor();
+
+    bench::Suite suite("02-media");
+    suite.add("loudness", [&] {
+        Loudness l = measureLoudness(pcm);
+        return (double)l.samples;
+    });
+    suite.add("download", [&] {
+        AudioPlayer ap(reactor.get());
+        ap.download("file:///proc/self/exe");
+        return ap.lastDownloadFailed() ? 0.0 : (double)ap.downloadedBytes();
+    });
+    return bench::main(suite, argc, argv);
+}
+
 // -------------------------------------------------------------
 // Demo
 // -------------------------------------------------------------
 
-int main() {
-    AudioPlayer ap;
+int main(int argc, char **argv) {
+    // ALLOC_PROFILE_OUT=<file.json> in -DALLOC_PROFILE builds, any mode
+    alloc::Session allocProfile(getenv("ALLOC_PROFILE_OUT"));
+
+    if (argc > 1 && string(argv[1]) == "--train") {
+        runTrainingWorkload(argc > 2 ? strtoull(argv[2], nullptr, 10) : 20);
+        return 0;
+    }
+    int benchResult = runBenchmarks(argc, argv);
+    if (benchResult >= 0)
+        return benchResult;
+
+    // TRACE_OUT=<file.json> records spans for the run
+    trace::Session tracing(getenv("TRACE_OUT"));
+
+    auto reactor = io::makeReactor();
+    AudioPlayer ap(reactor.get());
     ap.play("song.mp3");
     cout << "Audio playing: " << ap.isPlaying() << "\n";
     ap.pause();
 
+    ap.download("file:///proc/self/exe");
+    if (ap.lastDownloadFailed())
+        cout << "Download failed after " << ap.downloadedBytes() << " bytes\n";
+    else
+        cout << "Downloaded " << ap.downloadedBytes() << " bytes via "
+             << reactor->backend() << " (" << reactor->syscalls() << " syscalls)\n";
+
+    // 10s of a half-scale 440Hz tone at 48kHz
+    vector<int16_t> pcm(480000);
+    for (size_t i = 0; i < pcm.size(); ++i)
+        pcm[i] = (int16_t)(16384 * sin(2 * M_PI * 440 * i / 48000.0));
+    Loudness l = measureLoudness(pcm);
+    cout << "Loudness: peak=" << l.peak << " rms=" << l.rmsDbfs() << " dBFS\n";
+
     LiveStreamPlayer cam;
 
     // PERFECT LSP:
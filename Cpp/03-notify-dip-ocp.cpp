@@ -1,143 +1,6039 @@
 // 03-notify-dip-ocp.cpp
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "admission.hpp"
+#include "alloc-profiler.hpp"
+#include "arena.hpp"
+#include "bench.hpp"
+#include "executor.hpp"
+#include "invoice-events.hpp"
+#include "io-reactor.hpp"
+#include "numa.hpp"
+#include "trace.hpp"
 using namespace std;
 
+// ------------------------ Phone Numbers (E.164) ------------------------
+
+// National dialling rules of a country calling code: the trunk prefix
+// national-format numbers carry, the international (IDD) prefix, and the
+// length range of the national significant number (NSN, the digits after
+// the country code).
+struct DialPlan {
+    const char* cc;
+    const char* trunk;  // "" when the country has none (IT, ES, DK, ...)
+    const char* idd;
+    uint8_t minNsn, maxNsn;
+};
+
+static const DialPlan dialPlans[] = {
+    {"1", "1", "011", 10, 10},  {"7", "8", "810", 10, 10},   {"20", "0", "00", 8, 10},
+    {"27", "0", "00", 9, 9},    {"30", "", "00", 10, 10},    {"31", "0", "00", 9, 9},
+    {"32", "0", "00", 8, 9},    {"33", "0", "00", 9, 9},     {"34", "", "00", 9, 9},
+    {"36", "06", "00", 8, 9},   {"39", "", "00", 6, 11},     {"40", "0", "00", 9, 9},
+    {"41", "0", "00", 9, 9},    {"43", "0", "00", 4, 13},    {"44", "0", "00", 7, 10},
+    {"45", "", "00", 8, 8},     {"46", "0", "00", 7, 13},    {"47", "", "00", 5, 8},
+    {"48", "", "00", 9, 9},     {"49", "0", "00", 5, 13},    {"51", "0", "00", 8, 9},
+    {"52", "", "00", 10, 10},   {"54", "0", "00", 10, 11},   {"55", "0", "00", 10, 11},
+    {"56", "", "00", 9, 9},     {"57", "", "00", 8, 10},     {"60", "0", "00", 8, 10},
+    {"61", "0", "0011", 5, 9},  {"62", "0", "001", 7, 12},   {"63", "0", "00", 8, 10},
+    {"64", "0", "00", 8, 10},   {"65", "", "000", 8, 8},     {"66", "0", "001", 8, 9},
+    {"81", "0", "010", 9, 10},  {"82", "0", "001", 8, 11},   {"84", "0", "00", 9, 10},
+    {"86", "0", "00", 9, 12},   {"90", "0", "00", 10, 10},   {"91", "0", "00", 10, 10},
+    {"92", "0", "00", 8, 11},   {"98", "0", "00", 10, 10},   {"212", "0", "00", 9, 9},
+    {"234", "0", "009", 8, 10}, {"254", "0", "000", 9, 9},   {"290", "", "00", 4, 5},
+    {"351", "", "00", 9, 9},    {"352", "", "00", 4, 11},    {"353", "0", "00", 7, 9},
+    {"358", "0", "00", 5, 12},  {"380", "0", "00", 9, 9},    {"420", "", "00", 9, 9},
+    {"683", "", "00", 4, 4},    {"852", "", "001", 8, 8},    {"880", "0", "00", 8, 10},
+    {"886", "0", "002", 8, 9},  {"966", "0", "00", 9, 9},    {"971", "0", "00", 8, 9},
+    {"972", "0", "00", 8, 9},
+};
+
+// Countries without an entry: trunk "0", IDD "00", NSN of 4 digits or more.
+static const DialPlan defaultDialPlan{"", "0", "00", 4, 14};
+
+// Plan for the country code `d` starts with (longest match), or nullptr.
+// Indexed by the first three digits, so the lookup is one array read.
+const DialPlan* dialPlanFor(const char* d, size_t n) {
+    static const vector<int16_t> byPrefix = [] {
+        vector<int16_t> t(1000, -1);
+        vector<uint8_t> len(1000, 0);
+        for (size_t k = 0; k < size(dialPlans); ++k) {
+            string cc = dialPlans[k].cc;
+            size_t span = cc.size() == 1 ? 100 : cc.size() == 2 ? 10 : 1;
+            size_t lo = stoul(cc) * span;
+            for (size_t p = lo; p < lo + span; ++p)
+                if (cc.size() > len[p]) {
+                    t[p] = (int16_t)k;
+                    len[p] = (uint8_t)cc.size();
+                }
+        }
+        return t;
+    }();
+    if (n < 3)
+        return nullptr;
+    int16_t k = byPrefix[(d[0] - '0') * 100 + (d[1] - '0') * 10 + (d[2] - '0')];
+    return k < 0 ? nullptr : &dialPlans[k];
+}
+
+const DialPlan* dialPlanOf(const string& cc) {
+    char padded[3] = {'0', '0', '0'};
+    for (size_t i = 0; i < cc.size() && i < 3; ++i)
+        padded[i] = cc[i];
+    const DialPlan* p = dialPlanFor(padded, 3);
+    return p && cc == p->cc ? p : nullptr;
+}
+
+// Normalizes a free-form phone string to E.164 ("+<cc><subscriber>").
+// Accepts "+", the IDD prefix of defaultCc's country ("00", "011", ...)
+// or a national number, whose trunk prefix is dropped when that country
+// has one. Spaces, dashes, dots and parentheses are ignored. The NSN
+// length is checked against the country's plan.
+bool normalizeE164(const string& raw, const string& defaultCc, string& out) {
+    out.clear();
+    out.reserve(16);
+    out.push_back('+');
+
+    size_t i = 0;
+    while (i < raw.size() && raw[i] == ' ')
+        ++i;
+    bool international = false;
+    if (i < raw.size() && raw[i] == '+') {
+        international = true;
+        ++i;
+    }
+
+    char digits[24];
+    size_t n = 0;
+    for (; i < raw.size(); ++i) {
+        char c = raw[i];
+        if (c >= '0' && c <= '9') {
+            if (n == sizeof(digits))
+                return false;
+            digits[n++] = c;
+        } else if (c != ' ' && c != '-' && c != '.' && c != '(' && c != ')') {
+            return false;
+        }
+    }
+
+    const char* d = digits;
+    const DialPlan* plan = nullptr;
+    size_t ccLen = 0;
+    if (!international) {
+        const DialPlan* home = dialPlanOf(defaultCc);
+        const DialPlan& rules = home ? *home : defaultDialPlan;
+        size_t idd = strlen(rules.idd);
+        if (n > idd && memcmp(d, rules.idd, idd) == 0) {
+            international = true;
+            d += idd;
+            n -= idd;
+        } else {
+            // Dropped only when what remains is still a valid NSN, so a
+            // number that merely starts with the trunk digit survives.
+            size_t trunk = strlen(rules.trunk);
+            if (trunk && n >= trunk + rules.minNsn && memcmp(d, rules.trunk, trunk) == 0) {
+                d += trunk;
+                n -= trunk;
+            }
+            out += defaultCc;
+            plan = &rules;
+            ccLen = defaultCc.size();
+        }
+    }
+    if (international) {
+        plan = dialPlanFor(d, n);
+        ccLen = plan ? strlen(plan->cc) : 0;
+    }
+    out.append(d, n);
+
+    // E.164 allows at most 15 digits; country code never starts with 0.
+    size_t total = out.size() - 1;
+    if (total > 15 || total < 2 || out[1] == '0')
+        return false;
+    if (!plan)  // unknown country code: its length is unknown too
+        return total >= 7;
+    size_t nsn = total - ccLen;
+    return nsn >= plan->minNsn && nsn <= plan->maxNsn;
+}
+
+struct PhoneRoute {
+    string region;   // ISO 3166 alpha-2
+    string carrier;  // empty when only the country is known
+};
+
+// Longest-prefix router over the ITU numbering plan. Digits index a flat
+// 10-ary trie (no pointers, no allocation on lookup), so classifying a
+// number is at most 15 array hops.
+class PhoneRouter {
+private:
+    struct Node {
+        int32_t child[10];
+        int32_t route;
+    };
+    vector<Node> nodes;
+    vector<PhoneRoute> routes;
+
+    int32_t newNode() {
+        Node n;
+        for (auto& c : n.child)
+            c = -1;
+        n.route = -1;
+        nodes.push_back(n);
+        return (int32_t)nodes.size() - 1;
+    }
+
+public:
+    PhoneRouter() { newNode(); }
+
+    // prefix is digits only, without the leading '+'.
+    void addRoute(const string& prefix, const string& region,
+                  const string& carrier = "") {
+        int32_t cur = 0;
+        for (char c : prefix) {
+            int d = c - '0';
+            if (nodes[cur].child[d] < 0) {
+                int32_t n = newNode();
+                nodes[cur].child[d] = n;
+            }
+            cur = nodes[cur].child[d];
+        }
+        routes.push_back({region, carrier});
+        nodes[cur].route = (int32_t)routes.size() - 1;
+    }
+
+    // e164 must come from normalizeE164. Returns nullptr when unrouted.
+    const PhoneRoute* route(const string& e164) const {
+        int32_t cur = 0;
+        int32_t best = -1;
+        for (size_t i = 1; i < e164.size(); ++i) {
+            cur = nodes[cur].child[e164[i] - '0'];
+            if (cur < 0)
+                break;
+            if (nodes[cur].route >= 0)
+                best = nodes[cur].route;
+        }
+        return best < 0 ? nullptr : &routes[best];
+    }
+
+    // Country calling codes (ITU-T E.164 assignments), territories sharing
+    // another country's code, Canadian and Caribbean NANP area codes, and
+    // the mobile ranges we price separately.
+    static PhoneRouter withNumberingPlan() {
+        static const char* const plan[][2] = {
+            {"1", "US"}, {"7", "RU"}, {"76", "KZ"}, {"77", "KZ"},
+            {"20", "EG"}, {"27", "ZA"}, {"30", "GR"}, {"31", "NL"}, {"32", "BE"},
+            {"33", "FR"}, {"34", "ES"}, {"36", "HU"}, {"39", "IT"}, {"40", "RO"},
+            {"41", "CH"}, {"43", "AT"}, {"44", "GB"}, {"45", "DK"}, {"46", "SE"},
+            {"47", "NO"}, {"48", "PL"}, {"49", "DE"}, {"51", "PE"}, {"52", "MX"},
+            {"53", "CU"}, {"54", "AR"}, {"55", "BR"}, {"56", "CL"}, {"57", "CO"},
+            {"58", "VE"}, {"60", "MY"}, {"61", "AU"}, {"62", "ID"}, {"63", "PH"},
+            {"64", "NZ"}, {"65", "SG"}, {"66", "TH"}, {"81", "JP"}, {"82", "KR"},
+            {"84", "VN"}, {"86", "CN"}, {"90", "TR"}, {"91", "IN"}, {"92", "PK"},
+            {"93", "AF"}, {"94", "LK"}, {"95", "MM"}, {"98", "IR"},
+            {"211", "SS"}, {"212", "MA"}, {"213", "DZ"}, {"216", "TN"}, {"218", "LY"},
+            {"220", "GM"}, {"221", "SN"}, {"222", "MR"}, {"223", "ML"}, {"224", "GN"},
+            {"225", "CI"}, {"226", "BF"}, {"227", "NE"}, {"228", "TG"}, {"229", "BJ"},
+            {"230", "MU"}, {"231", "LR"}, {"232", "SL"}, {"233", "GH"}, {"234", "NG"},
+            {"235", "TD"}, {"236", "CF"}, {"237", "CM"}, {"238", "CV"}, {"239", "ST"},
+            {"240", "GQ"}, {"241", "GA"}, {"242", "CG"}, {"243", "CD"}, {"244", "AO"},
+            {"245", "GW"}, {"246", "IO"}, {"248", "SC"}, {"249", "SD"}, {"250", "RW"},
+            {"251", "ET"}, {"252", "SO"}, {"253", "DJ"}, {"254", "KE"}, {"255", "TZ"},
+            {"256", "UG"}, {"257", "BI"}, {"258", "MZ"}, {"260", "ZM"}, {"261", "MG"},
+            {"262", "RE"}, {"263", "ZW"}, {"264", "NA"}, {"265", "MW"}, {"266", "LS"},
+            {"267", "BW"}, {"268", "SZ"}, {"269", "KM"}, {"290", "SH"}, {"291", "ER"},
+            {"297", "AW"}, {"298", "FO"}, {"299", "GL"}, {"350", "GI"}, {"351", "PT"},
+            {"352", "LU"}, {"353", "IE"}, {"354", "IS"}, {"355", "AL"}, {"356", "MT"},
+            {"357", "CY"}, {"358", "FI"}, {"359", "BG"}, {"370", "LT"}, {"371", "LV"},
+            {"372", "EE"}, {"373", "MD"}, {"374", "AM"}, {"375", "BY"}, {"376", "AD"},
+            {"377", "MC"}, {"378", "SM"}, {"379", "VA"}, {"380", "UA"}, {"381", "RS"},
+            {"382", "ME"}, {"383", "XK"}, {"385", "HR"}, {"386", "SI"}, {"387", "BA"},
+            {"389", "MK"}, {"420", "CZ"}, {"421", "SK"}, {"423", "LI"}, {"500", "FK"},
+            {"501", "BZ"}, {"502", "GT"}, {"503", "SV"}, {"504", "HN"}, {"505", "NI"},
+            {"506", "CR"}, {"507", "PA"}, {"508", "PM"}, {"509", "HT"}, {"590", "GP"},
+            {"591", "BO"}, {"592", "GY"}, {"593", "EC"}, {"594", "GF"}, {"595", "PY"},
+            {"596", "MQ"}, {"597", "SR"}, {"598", "UY"}, {"599", "CW"}, {"670", "TL"},
+            {"672", "NF"}, {"673", "BN"}, {"674", "NR"}, {"675", "PG"}, {"676", "TO"},
+            {"677", "SB"}, {"678", "VU"}, {"679", "FJ"}, {"680", "PW"}, {"681", "WF"},
+            {"682", "CK"}, {"683", "NU"}, {"685", "WS"}, {"686", "KI"}, {"687", "NC"},
+            {"688", "TV"}, {"689", "PF"}, {"690", "TK"}, {"691", "FM"}, {"692", "MH"},
+            {"850", "KP"}, {"852", "HK"}, {"853", "MO"}, {"855", "KH"}, {"856", "LA"},
+            {"880", "BD"}, {"886", "TW"}, {"960", "MV"}, {"961", "LB"}, {"962", "JO"},
+            {"963", "SY"}, {"964", "IQ"}, {"965", "KW"}, {"966", "SA"}, {"967", "YE"},
+            {"968", "OM"}, {"970", "PS"}, {"971", "AE"}, {"972", "IL"}, {"973", "BH"},
+            {"974", "QA"}, {"975", "BT"}, {"976", "MN"}, {"977", "NP"}, {"992", "TJ"},
+            {"993", "TM"}, {"994", "AZ"}, {"995", "GE"}, {"996", "KG"}, {"998", "UZ"},
+            {"247", "AC"}, {"3906698", "VA"}, {"262269", "YT"}, {"262639", "YT"},
+            {"441481", "GG"}, {"441534", "JE"}, {"441624", "IM"}, {"4779", "SJ"},
+            {"5993", "BQ"}, {"5994", "BQ"}, {"5997", "BQ"},
+            // Non-geographic codes (freephone, satellite, international
+            // networks, premium rate), region "001" as in libphonenumber
+            {"800", "001"}, {"808", "001"}, {"870", "001"}, {"878", "001"},
+            {"881", "001"}, {"882", "001"}, {"883", "001"}, {"888", "001"},
+            {"979", "001"},
+            // NANP: "1" alone is the US; Canada by area code
+            {"1204", "CA"}, {"1226", "CA"}, {"1236", "CA"}, {"1249", "CA"},
+            {"1250", "CA"}, {"1257", "CA"}, {"1263", "CA"}, {"1289", "CA"},
+            {"1306", "CA"}, {"1343", "CA"}, {"1354", "CA"}, {"1365", "CA"},
+            {"1367", "CA"}, {"1368", "CA"}, {"1382", "CA"}, {"1403", "CA"},
+            {"1416", "CA"}, {"1418", "CA"}, {"1428", "CA"}, {"1431", "CA"},
+            {"1437", "CA"}, {"1438", "CA"}, {"1450", "CA"}, {"1460", "CA"},
+            {"1468", "CA"}, {"1474", "CA"}, {"1506", "CA"}, {"1514", "CA"},
+            {"1519", "CA"}, {"1548", "CA"}, {"1579", "CA"}, {"1581", "CA"},
+            {"1584", "CA"}, {"1587", "CA"}, {"1604", "CA"}, {"1613", "CA"},
+            {"1639", "CA"}, {"1647", "CA"}, {"1672", "CA"}, {"1683", "CA"},
+            {"1705", "CA"}, {"1709", "CA"}, {"1742", "CA"}, {"1753", "CA"},
+            {"1778", "CA"}, {"1780", "CA"}, {"1782", "CA"}, {"1807", "CA"},
+            {"1819", "CA"}, {"1825", "CA"}, {"1867", "CA"}, {"1873", "CA"},
+            {"1879", "CA"}, {"1902", "CA"}, {"1905", "CA"}, {"1942", "CA"},
+            // NANP members outside US/CA
+            {"1242", "BS"}, {"1246", "BB"}, {"1264", "AI"}, {"1268", "AG"},
+            {"1284", "VG"}, {"1340", "VI"}, {"1345", "KY"}, {"1441", "BM"},
+            {"1473", "GD"}, {"1649", "TC"}, {"1658", "JM"}, {"1664", "MS"},
+            {"1670", "MP"}, {"1671", "GU"}, {"1684", "AS"}, {"1721", "SX"},
+            {"1758", "LC"}, {"1767", "DM"}, {"1784", "VC"}, {"1787", "PR"},
+            {"1809", "DO"}, {"1829", "DO"}, {"1849", "DO"}, {"1868", "TT"},
+            {"1869", "KN"}, {"1876", "JM"}, {"1939", "PR"},
+        };
+        static const char* const mobile[][2] = {
+            {"447", "GB"}, {"336", "FR"}, {"337", "FR"}, {"4915", "DE"},
+            {"4916", "DE"}, {"4917", "DE"}, {"916", "IN"}, {"917", "IN"},
+            {"918", "IN"}, {"919", "IN"},
+        };
+
+        PhoneRouter r;
+        for (auto& e : plan)
+            r.addRoute(e[0], e[1]);
+        for (auto& e : mobile)
+            r.addRoute(e[0], e[1], "mobile");
+        return r;
+    }
+};
+
+// ------------------------ Email Addresses ------------------------
+
+// Byte classes for the pragmatic RFC 5321 subset we accept:
+// printable ASCII without whitespace, quotes, brackets or separators.
+struct EmailCharTable {
+    bool ok[256];
+    EmailCharTable() {
+        for (int c = 0; c < 256; ++c)
+            ok[c] = c > 0x20 && c < 0x7F;
+        for (char c : string("()<>[]\\,;:\""))
+            ok[(unsigned char)c] = false;
+    }
+};
+
+static const EmailCharTable emailChars;
+
+// Validates the address and returns its domain part in `domain`.
+// The byte scan (forbidden characters, '@' count and position) runs 16
+// bytes at a time with SSE2; the structural checks only touch the dots.
+bool validateEmail(string_view e, string_view& domain) {
+    size_t n = e.size();
+    if (n < 3 || n > 254)
+        return false;
+
+    size_t i = 0;
+    size_t atCount = 0;
+    size_t at = 0;
+#if defined(__SSE2__)
+    const __m128i low = _mm_set1_epi8(0x21);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i atv = _mm_set1_epi8('@');
+    const char specials[] = "()<>[]\\,;:\"";
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(e.data() + i));
+        // signed compare: bytes >= 0x80 are negative, so they fail too
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, low),
+                                   _mm_cmpeq_epi8(v, del));
+        for (size_t k = 0; k + 1 < sizeof(specials); ++k)
+            bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(specials[k])));
+        if (_mm_movemask_epi8(bad))
+            return false;
+
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, atv));
+        if (m) {
+            if (atCount == 0)
+                at = i + __builtin_ctz(m);
+            atCount += __builtin_popcount(m);
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        unsigned char c = (unsigned char)e[i];
+        if (!emailChars.ok[c])
+            return false;
+        if (c == '@' && atCount++ == 0)
+            at = i;
+    }
+
+    if (atCount != 1 || at == 0 || at > 64 || at + 1 == n)
+        return false;
+
+    string_view local = e.substr(0, at);
+    domain = e.substr(at + 1);
+    if (local.front() == '.' || local.back() == '.' ||
+        local.find("..") != string_view::npos)
+        return false;
+
+    // Domain: dot-separated labels of [A-Za-z0-9-], no leading/trailing '-'.
+    size_t labelStart = 0;
+    bool dotted = false;
+    for (size_t j = 0; j <= domain.size(); ++j) {
+        if (j == domain.size() || domain[j] == '.') {
+            size_t len = j - labelStart;
+            if (len == 0 || len > 63 || domain[labelStart] == '-' ||
+                domain[j - 1] == '-')
+                return false;
+            dotted |= j != domain.size();
+            labelStart = j + 1;
+            continue;
+        }
+        char c = domain[j];
+        bool alnum = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                     (c >= '0' && c <= '9');
+        if (!alnum && c != '-')
+            return false;
+    }
+    return dotted;
+}
+
+bool isValidEmail(const string& e) {
+    string_view domain;
+    return validateEmail(e, domain);
+}
+
+// Recipients for one SMTP session: every address shares the domain, so
+// a mailer can deliver the whole batch over a single MX connection.
+struct DomainBatch {
+    string domain;  // lower-cased
+    vector<uint32_t> recipients;  // indices into the input list
+};
+
+// Groups addresses by recipient domain. Invalid entries are skipped and
+// counted in `rejected`.
+vector<DomainBatch> groupByDomain(const vector<string>& emails,
+                                  size_t* rejected = nullptr) {
+    vector<DomainBatch> batches;
+    unordered_map<string, uint32_t> slot;
+    string key;
+    size_t bad = 0;
+
+    for (uint32_t i = 0; i < emails.size(); ++i) {
+        string_view domain;
+        if (!validateEmail(emails[i], domain)) {
+            ++bad;
+            continue;
+        }
+        key.assign(domain.data(), domain.size());
+        for (auto& c : key)
+            if (c >= 'A' && c <= 'Z')
+                c = char(c - 'A' + 'a');
+
+        auto it = slot.find(key);
+        if (it == slot.end()) {
+            it = slot.emplace(key, (uint32_t)batches.size()).first;
+            batches.push_back({key, {}});
+        }
+        batches[it->second].recipients.push_back(i);
+    }
+
+    if (rejected)
+        *rejected = bad;
+    return batches;
+}
+
+// ------------------------ SMS Encoding ------------------------
+
+enum class SmsEncoding { Gsm7, Ucs2 };
+
+struct EncodedSms {
+    SmsEncoding encoding;
+    size_t units;             // septets (GSM-7) or UTF-16 code units (UCS-2)
+    vector<string> segments;  // user data per segment, UDH included
+};
+
+namespace sms {
+
+const uint8_t ESC = 0x1B;
+
+// GSM 03.38 for ASCII: basic-table code, 0x100 | code for the escape
+// (extension) table, -1 when unrepresentable.
+struct AsciiGsmTable {
+    int16_t code[128];
+    AsciiGsmTable() {
+        for (int c = 0; c < 128; ++c)
+            code[c] = -1;
+        for (int c = 0x20; c < 0x7F; ++c)
+            code[c] = (int16_t)c;
+        code['\n'] = 0x0A;
+        code['\r'] = 0x0D;
+        code['$'] = 0x02;
+        code['@'] = 0x00;
+        code['_'] = 0x11;
+        code['`'] = -1;
+        const char ext[][2] = {{'^', 0x14}, {'{', 0x28}, {'}', 0x29}, {'\\', 0x2F},
+                               {'[', 0x3C}, {'~', 0x3D}, {']', 0x3E}, {'|', 0x40}};
+        for (auto& e : ext)
+            code[(int)e[0]] = int16_t(0x100 | e[1]);
+    }
+};
+
+static const AsciiGsmTable asciiGsm;
+
+int gsmCode(uint32_t cp) {
+    if (cp < 128)
+        return asciiGsm.code[cp];
+    static const uint32_t basic[][2] = {
+        {0x00A3, 0x01}, {0x00A5, 0x03}, {0x00E8, 0x04}, {0x00E9, 0x05},
+        {0x00F9, 0x06}, {0x00EC, 0x07}, {0x00F2, 0x08}, {0x00C7, 0x09},
+        {0x00D8, 0x0B}, {0x00F8, 0x0C}, {0x00C5, 0x0E}, {0x00E5, 0x0F},
+        {0x0394, 0x10}, {0x03A6, 0x12}, {0x0393, 0x13}, {0x039B, 0x14},
+        {0x03A9, 0x15}, {0x03A0, 0x16}, {0x03A8, 0x17}, {0x03A3, 0x18},
+        {0x0398, 0x19}, {0x039E, 0x1A}, {0x00C6, 0x1C}, {0x00E6, 0x1D},
+        {0x00DF, 0x1E}, {0x00C9, 0x1F}, {0x00A4, 0x24}, {0x00A1, 0x40},
+        {0x00C4, 0x5B}, {0x00D6, 0x5C}, {0x00D1, 0x5D}, {0x00DC, 0x5E},
+        {0x00A7, 0x5F}, {0x00BF, 0x60}, {0x00E4, 0x7B}, {0x00F6, 0x7C},
+        {0x00F1, 0x7D}, {0x00FC, 0x7E}, {0x00E0, 0x7F},
+    };
+    for (auto& b : basic)
+        if (b[0] == cp)
+            return (int)b[1];
+    if (cp == 0x20AC)  // euro sign
+        return 0x100 | 0x65;
+    return -1;
+}
+
+// Look-alikes that keep a message in GSM-7 (and so at 160 chars/segment
+// instead of 70).
+const char* transliterate(uint32_t cp) {
+    switch (cp) {
+    case 0x0060: case 0x2018: case 0x2019: case 0x201A: case 0x2032: return "'";
+    case 0x201C: case 0x201D: case 0x201E: case 0x2033: return "\"";
+    case 0x2013: case 0x2014: case 0x2212: return "-";
+    case 0x2026: return "...";
+    case 0x00A0: case 0x2009: case 0x200A: return " ";
+    case 0x00E1: case 0x00E2: case 0x00E3: return "a";
+    case 0x00C1: case 0x00C2: case 0x00C3: case 0x00C0: return "A";
+    case 0x00EA: case 0x00EB: return "e";
+    case 0x00C8: case 0x00CA: case 0x00CB: return "E";
+    case 0x00ED: case 0x00EE: case 0x00EF: return "i";
+    case 0x00CD: case 0x00CE: case 0x00CF: case 0x00CC: return "I";
+    case 0x00F3: case 0x00F4: case 0x00F5: return "o";
+    case 0x00D3: case 0x00D4: case 0x00D5: case 0x00D2: return "O";
+    case 0x00FA: case 0x00FB: return "u";
+    case 0x00DA: case 0x00DB: case 0x00D9: return "U";
+    case 0x00E7: return "\xC3\x87";  // c-cedilla -> C-cedilla (in GSM-7)
+    default: return nullptr;
+    }
+}
+
+// True when every byte is ASCII that maps to the GSM-7 basic table or to
+// its escape table, checked 16 bytes at a time.
+bool asciiGsmFastPath(const string& m) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i tick = _mm_set1_epi8('`');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (; i + 16 <= m.size(); i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(m.data() + i));
+        // signed: < 0x20 covers both controls and non-ASCII (>= 0x80)
+        __m128i low = _mm_cmplt_epi8(v, space);
+        low = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lf),
+                                            _mm_cmpeq_epi8(v, cr)), low);
+        __m128i bad = _mm_or_si128(low, _mm_or_si128(_mm_cmpeq_epi8(v, del),
+                                                     _mm_cmpeq_epi8(v, tick)));
+        if (_mm_movemask_epi8(bad))
+            return false;
+    }
+#endif
+    for (; i < m.size(); ++i) {
+        unsigned char c = (unsigned char)m[i];
+        if (c >= 0x80 || asciiGsm.code[c] < 0)
+            return false;
+    }
+    return true;
+}
+
+// Decodes one UTF-8 sequence; invalid bytes (lead bytes 0xF8 and up,
+// overlong forms, surrogates, anything past U+10FFFF) decode as U+FFFD.
+uint32_t nextCodePoint(const string& m, size_t& i) {
+    static const uint32_t minCp[] = {0, 0x80, 0x800, 0x10000};
+    unsigned char c = (unsigned char)m[i++];
+    if (c < 0x80)
+        return c;
+    int extra = c >= 0xF8 ? -1 : c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : -1;
+    if (extra < 0 || i + extra > m.size())
+        return 0xFFFD;
+    uint32_t cp = c & (0x3F >> extra);
+    for (int k = 0; k < extra; ++k) {
+        unsigned char cc = (unsigned char)m[i];
+        if ((cc & 0xC0) != 0x80)
+            return 0xFFFD;
+        cp = cp << 6 | (cc & 0x3F);
+        ++i;
+    }
+    if (cp < minCp[extra] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        return 0xFFFD;
+    return cp;
+}
+
+void pushGsm(vector<uint8_t>& septets, int code) {
+    if (code & 0x100)
+        septets.push_back(ESC);
+    septets.push_back(uint8_t(code & 0x7F));
+}
+
+// Packs septets LSB-first after `fillBits` zero bits (UDH alignment).
+void packSeptets(const uint8_t* s, size_t n, int fillBits, string& out) {
+    uint32_t acc = 0;
+    int bits = fillBits;
+    for (size_t i = 0; i < n; ++i) {
+        acc |= uint32_t(s[i] & 0x7F) << bits;
+        bits += 7;
+        while (bits >= 8) {
+            out.push_back(char(acc & 0xFF));
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    if (bits > 0)
+        out.push_back(char(acc & 0xFF));
+}
+
+// The concatenation UDH numbers parts in one octet.
+const size_t MAX_SEGMENTS = 255;
+
+string udh(uint8_t ref, uint8_t total, uint8_t seq) {
+    return string{0x05, 0x00, 0x03, char(ref), char(total), char(seq)};
+}
+
+}  // namespace sms
+
+// Picks GSM-7 when every character (after optional transliteration) is
+// representable, UCS-2 otherwise, and splits into concatenated segments
+// (153 septets / 67 UTF-16 units each, UDH reference `ref`) without
+// breaking escape sequences or surrogate pairs. A message that would need
+// more than sms::MAX_SEGMENTS parts comes back with no segments.
+EncodedSms encodeSms(const string& message, bool transliterate = true,
+                     uint8_t ref = 0) {
+    vector<uint8_t> septets;
+    septets.reserve(message.size() + 8);
+    bool gsm = true;
+
+    if (sms::asciiGsmFastPath(message)) {
+        for (unsigned char c : message)
+            sms::pushGsm(septets, sms::asciiGsm.code[c]);
+    } else {
+        for (size_t i = 0; i < message.size() && gsm;) {
+            uint32_t cp = sms::nextCodePoint(message, i);
+            int code = sms::gsmCode(cp);
+            if (code >= 0) {
+                sms::pushGsm(septets, code);
+                continue;
+            }
+            const char* alt = transliterate ? sms::transliterate(cp) : nullptr;
+            if (!alt) {
+                gsm = false;
+                break;
+            }
+            string a(alt);
+            for (size_t k = 0; k < a.size();)
+                sms::pushGsm(septets, sms::gsmCode(sms::nextCodePoint(a, k)));
+        }
+    }
+
+    EncodedSms out;
+    if (gsm) {
+        out.encoding = SmsEncoding::Gsm7;
+        out.units = septets.size();
+        if (septets.size() <= 160) {
+            out.segments.emplace_back();
+            sms::packSeptets(septets.data(), septets.size(), 0, out.segments.back());
+            return out;
+        }
+        vector<pair<size_t, size_t>> parts;
+        for (size_t at = 0; at < septets.size();) {
+            size_t n = min<size_t>(153, septets.size() - at);
+            if (at + n < septets.size() && septets[at + n - 1] == sms::ESC)
+                --n;
+            parts.push_back({at, n});
+            at += n;
+        }
+        if (parts.size() > sms::MAX_SEGMENTS)
+            return out;
+        for (size_t k = 0; k < parts.size(); ++k) {
+            string seg = sms::udh(ref, uint8_t(parts.size()), uint8_t(k + 1));
+            // 6 UDH octets = 48 bits; 1 fill bit aligns to a septet boundary
+            sms::packSeptets(&septets[parts[k].first], parts[k].second, 1, seg);
+            out.segments.push_back(move(seg));
+        }
+        return out;
+    }
+
+    vector<uint16_t> units;
+    units.reserve(message.size());
+    for (size_t i = 0; i < message.size();) {
+        uint32_t cp = sms::nextCodePoint(message, i);
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            units.push_back(uint16_t(0xD800 | (cp >> 10)));
+            units.push_back(uint16_t(0xDC00 | (cp & 0x3FF)));
+        } else {
+            units.push_back(uint16_t(cp));
+        }
+    }
+    out.encoding = SmsEncoding::Ucs2;
+    out.units = units.size();
+    auto append = [&](string& seg, size_t at, size_t n) {
+        for (size_t k = at; k < at + n; ++k) {
+            seg.push_back(char(units[k] >> 8));
+            seg.push_back(char(units[k] & 0xFF));
+        }
+    };
+    if (units.size() <= 70) {
+        out.segments.emplace_back();
+        append(out.segments.back(), 0, units.size());
+        return out;
+    }
+    vector<pair<size_t, size_t>> parts;
+    for (size_t at = 0; at < units.size();) {
+        size_t n = min<size_t>(67, units.size() - at);
+        if (at + n < units.size() && (units[at + n - 1] & 0xFC00) == 0xD800)
+            --n;
+        parts.push_back({at, n});
+        at += n;
+    }
+    if (parts.size() > sms::MAX_SEGMENTS)
+        return out;
+    for (size_t k = 0; k < parts.size(); ++k) {
+        string seg = sms::udh(ref, uint8_t(parts.size()), uint8_t(k + 1));
+        append(seg, parts[k].first, parts[k].second);
+        out.segments.push_back(move(seg));
+    }
+    return out;
+}
+
 // ------------------------ Low-level Services ------------------------
 
+struct MailMessage {
+    string from;
+    string to;
+    string subject;
+    string body;
+    vector<pair<string, string>> headers;  // extra, e.g. DKIM-Signature
+};
+
 class IEmailService {
 public:
     virtual void sendEmail(const string& templ,
                            const string& to,
                            const string& body) = 0;
+
+    // A complete message; its extra headers must go out with it.
+    virtual void sendMessage(const MailMessage& m) = 0;
+
+    // Several complete messages. Mailers that can reuse a connection
+    // override this; the default sends one by one.
+    virtual void sendMessages(const vector<MailMessage>& msgs) {
+        for (auto& m : msgs)
+            sendMessage(m);
+    }
+
+    // Same message to many recipients on one domain. Mailers that can
+    // reuse a connection override this; the default sends one by one.
+    virtual void sendEmailBatch(const string& templ,
+                                const vector<string>& to,
+                                const string& body) {
+        for (auto& r : to)
+            sendEmail(templ, r, body);
+    }
+
+    // Waits until everything sent so far is answered and returns the
+    // recipients refused since the last call, once per refused message.
+    // Mailers that hand messages off synchronously refuse nothing.
+    virtual vector<string> settle() { return {}; }
     virtual ~IEmailService() = default;
 };
 
 class ISmsService {
 public:
-    virtual void sendSMS(const string& phone,
+    // False when the message was refused before submission (bad number,
+    // too long); queued sends report their reply later.
+    virtual bool sendSMS(const string& phone,
                          const string& message) = 0;
     virtual ~ISmsService() = default;
 };
 
+// Sends through an SMTP relay on the shared I/O reactor when given a
+// channel (with Framing::Smtp), and logs to the console otherwise. On the
+// wire it reads the 220 greeting and sends EHLO before the first MAIL.
+// Commands are pipelined when the relay advertises PIPELINING and sent one
+// reply at a time otherwise; DATA always waits for its 354 before the
+// body. Sends only queue; drain() runs the reactor until every reply is in.
 class SmtpMailer : public IEmailService {
+private:
+    using OnReply = function<void(const string&)>;
+
+    struct Command {
+        vector<string> lines;  // sent ahead of `line`, no reply of their own
+        string line;
+        OnReply onReply;
+        bool awaitReply;  // nothing after it goes out before its reply
+    };
+
+    enum class Session { Greeting, Ready, Failed };
+
+    string account;  // provider credential; empty = shared default
+    io::IoReactor* reactor{nullptr};
+    io::LineChannel* chan{nullptr};
+    string from;
+    Session session{Session::Greeting};
+    bool pipelining{false};
+    deque<Command> queued;
+    size_t inFlight{0};
+    bool barrier{false};
+    size_t accepted{0};
+    size_t rejected{0};
+    vector<string> refused;  // since the last settle()
+
+    static bool replyIs(const string& reply, const char* code) {
+        return reply.compare(0, 3, code) == 0;
+    }
+
+    // Console output is built whole and written once, so concurrent
+    // fan-out doesn't interleave lines.
+    string prefix() const { return account.empty() ? "[SMTP]" : "[SMTP] account=" + account; }
+
+    string consoleLine(const string& templ, const string& to, const string& body) const {
+        return prefix() + " template=" + templ + " to=" + to + " body=" + body + "\n";
+    }
+
+    void issue(Command c) {
+        queued.push_back(move(c));
+        pump();
+    }
+
+    void pump() {
+        if (session == Session::Failed) {
+            while (!queued.empty()) {
+                Command c = move(queued.front());
+                queued.pop_front();
+                c.onReply("");
+            }
+            return;
+        }
+        while (session == Session::Ready && !queued.empty() && !barrier &&
+               (pipelining || inFlight == 0)) {
+            Command c = move(queued.front());
+            queued.pop_front();
+            for (auto& l : c.lines)
+                chan->send(l);
+            ++inFlight;
+            barrier = c.awaitReply;
+            chan->request(c.line, [this, cb = move(c.onReply),
+                                   gate = c.awaitReply](const string& reply) {
+                --inFlight;
+                if (gate)
+                    barrier = false;
+                if (reply.empty())  // connection lost
+                    session = Session::Failed;
+                cb(reply);
+                pump();
+            });
+        }
+    }
+
+    void start() {
+        chan->expect([this](const string& greeting) {
+            if (!replyIs(greeting, "220")) {
+                session = Session::Failed;
+                return pump();
+            }
+            size_t at = from.find('@');
+            string host = at == string::npos ? "localhost" : from.substr(at + 1);
+            chan->request("EHLO " + host, [this](const string& reply) {
+                if (!replyIs(reply, "250")) {
+                    session = Session::Failed;
+                    return pump();
+                }
+                // "250-KEYWORD" / "250 KEYWORD" lines; a bare "250" is legal
+                for (size_t start = 0; start < reply.size();) {
+                    size_t nl = reply.find('\n', start);
+                    if (nl == string::npos)
+                        nl = reply.size();
+                    size_t end = nl;
+                    while (end > start && isspace((unsigned char)reply[end - 1]))
+                        --end;
+                    if (end - start == 4 + strlen("PIPELINING") &&
+                        strncasecmp(reply.c_str() + start + 4, "PIPELINING", end - start - 4) == 0)
+                        pipelining = true;
+                    start = nl + 1;
+                }
+                session = Session::Ready;
+                pump();
+            });
+        });
+    }
+
+    void transaction(const MailMessage& m, const vector<string>& to) {
+        auto rcptOk = make_shared<vector<string>>();
+        auto ignore = [](const string&) {};
+        issue({{}, "MAIL FROM:<" + from + ">", ignore, false});
+        for (auto& r : to)
+            issue({{}, "RCPT TO:<" + r + ">", [this, rcptOk, r](const string& reply) {
+                       if (replyIs(reply, "250"))
+                           rcptOk->push_back(r);
+                       else {
+                           ++rejected;
+                           refused.push_back(r);
+                       }
+                   }, false});
+
+        vector<string> body;
+        for (auto& h : m.headers)
+            body.push_back(h.first + ": " + h.second);
+        body.push_back("From: " + m.from);
+        if (!m.to.empty())
+            body.push_back("To: " + m.to);
+        body.push_back("Subject: " + m.subject);
+        body.push_back("");
+        size_t start = 0;
+        for (size_t nl; start <= m.body.size(); start = nl + 1) {
+            nl = m.body.find('\n', start);
+            if (nl == string::npos)
+                nl = m.body.size();
+            string line = m.body.substr(start, nl - start);
+            body.push_back(line.compare(0, 1, ".") == 0 ? "." + line : line);  // dot-stuffing
+        }
+
+        auto content = make_shared<vector<string>>(move(body));
+        auto refuse = [this, rcptOk] {
+            rejected += rcptOk->size();
+            refused.insert(refused.end(), rcptOk->begin(), rcptOk->end());
+        };
+        issue({{}, "DATA", [this, rcptOk, content, refuse](const string& reply) {
+                   if (!replyIs(reply, "354")) {
+                       refuse();
+                       if (session == Session::Ready)
+                           queued.push_front({{}, "RSET", [](const string&) {}, false});
+                       return;
+                   }
+                   // Ahead of anything queued behind DATA.
+                   queued.push_front({move(*content), ".", [this, rcptOk, refuse](const string& end) {
+                                          if (replyIs(end, "250"))
+                                              accepted += rcptOk->size();
+                                          else
+                                              refuse();
+                                      }, false});
+               }, true});
+    }
+
 public:
+    SmtpMailer(const string& acct = "") : account(acct) {}
+
+    SmtpMailer(io::IoReactor* r, io::LineChannel* c, const string& sender,
+               const string& acct = "")
+        : account(acct), reactor(r), chan(c), from(sender) {
+        start();
+    }
+
     void sendEmail(const string& templ,
                    const string& to,
                    const string& body) override {
-        cout << "[SMTP] template=" << templ
-             << " to=" << to
-             << " body=" << body << "\n";
+        TRACE_SPAN("SmtpMailer::sendEmail", "provider");
+        ALLOC_SCOPE("notify.provider.email");
+        if (chan)
+            return transaction({from, to, templ, body, {}}, {to});
+        cout << consoleLine(templ, to, body);
+    }
+
+    // One transaction for all recipients, so the message carries no To.
+    void sendEmailBatch(const string& templ,
+                        const vector<string>& to,
+                        const string& body) override {
+        TRACE_SPAN("SmtpMailer::sendEmailBatch", "provider");
+        ALLOC_SCOPE("notify.provider.email");
+        if (to.empty())
+            return;
+        if (chan)
+            return transaction({from, "", templ, body, {}}, to);
+        string_view domain;
+        validateEmail(to.front(), domain);
+        cout << prefix() + " session domain=" + string(domain) + " template=" + templ +
+                    " rcpt=" + to_string(to.size()) + " body=" + body + "\n";
+    }
+
+    void sendMessage(const MailMessage& m) override {
+        TRACE_SPAN("SmtpMailer::sendMessage", "provider");
+        ALLOC_SCOPE("notify.provider.email");
+        if (chan)
+            return transaction(m, {m.to});
+        string out = consoleLine(m.subject, m.to, m.body);
+        for (auto& h : m.headers)
+            out += "  " + h.first + ": " + h.second + "\n";
+        cout << out;
     }
+
+    void sendMessages(const vector<MailMessage>& msgs) override {
+        TRACE_SPAN("SmtpMailer::sendMessages", "provider");
+        ALLOC_SCOPE("notify.provider.email");
+        if (msgs.empty())
+            return;
+        if (chan) {
+            for (auto& m : msgs)
+                transaction(m, {m.to});
+            return;
+        }
+        string_view domain;
+        validateEmail(msgs.front().to, domain);
+        string out = prefix() + " session domain=" + string(domain) +
+                     " messages=" + to_string(msgs.size()) + "\n";
+        for (auto& m : msgs) {
+            out += "  template=" + m.subject + " to=" + m.to + " body=" + m.body + "\n";
+            for (auto& h : m.headers)
+                out += "    " + h.first + ": " + h.second + "\n";
+        }
+        cout << out;
+    }
+
+    void drain() {
+        TRACE_SPAN("SmtpMailer::drain", "provider");
+        ALLOC_SCOPE("notify.provider.email");
+        if (reactor)
+            reactor->runUntil([this] { return queued.empty() && inFlight == 0 && chan->idle(); });
+    }
+
+    vector<string> settle() override {
+        drain();
+        vector<string> out;
+        out.swap(refused);
+        return out;
+    }
+
+    // Relay replies; wire mode only.
+    size_t acceptedCount() const { return accepted; }
+    size_t rejectedCount() const { return rejected; }
 };
 
+// Submits through an SMS gateway on the shared I/O reactor when given a
+// channel ("SMS <e164> dcs=<dcs> ud=<hex>" per segment, "OK ..." back),
+// and logs to the console otherwise.
 class TwilioClient : public ISmsService {
+private:
+    const PhoneRouter* router;
+    string defaultCc;
+    string account;
+    atomic<uint8_t> nextRef{0};  // concatenation reference, per sender
+    io::IoReactor* reactor{nullptr};
+    io::LineChannel* chan{nullptr};
+    size_t accepted{0};
+    size_t rejected{0};
+
+    static string hexOf(const string& bytes) {
+        static const char hex[] = "0123456789abcdef";
+        string out;
+        for (unsigned char c : bytes) {
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 0xF]);
+        }
+        return out;
+    }
+
+    // Counts the message once every segment has its reply.
+    void submit(const string& e164, const EncodedSms& enc) {
+        struct Outcome {
+            size_t left;
+            bool ok{true};
+        };
+        auto msg = make_shared<Outcome>(Outcome{enc.segments.size()});
+        const char* dcs = enc.encoding == SmsEncoding::Gsm7 ? "0x00" : "0x08";
+        for (auto& seg : enc.segments)
+            chan->request("SMS " + e164 + " dcs=" + dcs + " ud=" + hexOf(seg),
+                          [this, msg](const string& reply) {
+                              msg->ok = msg->ok && reply.compare(0, 2, "OK") == 0;
+                              if (--msg->left == 0)
+                                  ++(msg->ok ? accepted : rejected);
+                          });
+    }
+
 public:
-    void sendSMS(const string& phone,
+    TwilioClient(const PhoneRouter* r = nullptr, const string& cc = "1",
+                 const string& acct = "")
+        : router(r), defaultCc(cc), account(acct) {}
+
+    TwilioClient(io::IoReactor* re, io::LineChannel* c, const PhoneRouter* r = nullptr,
+                 const string& cc = "1", const string& acct = "")
+        : router(r), defaultCc(cc), account(acct), reactor(re), chan(c) {}
+
+    // Submits the encoded segments, each with its data coding scheme and
+    // user data (UDH included when concatenated), not the raw text.
+    bool sendSMS(const string& phone,
                  const string& message) override {
-        cout << "[Twilio] OTP " << message
-             << " -> " << phone << "\n";
+        TRACE_SPAN("TwilioClient::sendSMS", "provider");
+        ALLOC_SCOPE("notify.provider.sms");
+        string e164;
+        if (!normalizeE164(phone, defaultCc, e164)) {
+            if (chan)
+                ++rejected;
+            else
+                cout << "[Twilio] rejected invalid number " << phone << "\n";
+            return false;
+        }
+        EncodedSms enc = encodeSms(message, true, nextRef.fetch_add(1, memory_order_relaxed));
+        if (enc.segments.empty()) {
+            if (chan)
+                ++rejected;
+            else
+                cout << "[Twilio] rejected message to " << e164 << ": more than "
+                     << sms::MAX_SEGMENTS << " segments\n";
+            return false;
+        }
+        if (chan) {
+            submit(e164, enc);
+            return true;
+        }
+
+        // Built whole and written once, so concurrent fan-out doesn't
+        // interleave lines.
+        string out = "[Twilio]";
+        if (!account.empty())
+            out += " account=" + account;
+        out += " OTP " + message + " -> " + e164;
+        if (router) {
+            const PhoneRoute* r = router->route(e164);
+            out += " (" + (r ? r->region : string("??"));
+            if (r && !r->carrier.empty())
+                out += " " + r->carrier;
+            out += ")";
+        }
+        if (enc.encoding == SmsEncoding::Ucs2 || enc.segments.size() > 1)
+            out += string(" [") + (enc.encoding == SmsEncoding::Gsm7 ? "GSM-7" : "UCS-2") +
+                   " " + to_string(enc.units) + " units, " +
+                   to_string(enc.segments.size()) + " segments]";
+        out += "\n";
+
+        bool concatenated = enc.segments.size() > 1;
+        for (size_t k = 0; k < enc.segments.size(); ++k)
+            out += "  segment " + to_string(k + 1) + "/" + to_string(enc.segments.size()) +
+                   " dcs=" + (enc.encoding == SmsEncoding::Gsm7 ? "0x00" : "0x08") +
+                   " udhi=" + to_string(concatenated) + " ud=" + hexOf(enc.segments[k]) + "\n";
+        cout << out;
+        return true;
     }
+
+    void drain() {
+        TRACE_SPAN("TwilioClient::drain", "provider");
+        ALLOC_SCOPE("notify.provider.sms");
+        if (reactor)
+            reactor->runUntil([this] { return chan->idle(); });
+    }
+
+    // Gateway replies; wire mode only.
+    size_t acceptedCount() const { return accepted; }
+    size_t rejectedCount() const { return rejected; }
 };
 
-// ------------------------ User Model ------------------------
+// Stand-in replies for local runs of the two line protocols.
+const char* const smtpStandInGreeting = "220 relay.local ESMTP";
 
-struct User {
-    string email;
-    string phone;
-    User(const string& e, const string& p)
-        : email(e), phone(p) {}
+function<string(const string&)> smtpStandIn() {
+    auto inData = make_shared<bool>(false);
+    return [inData](const string& line) -> string {
+        if (*inData) {
+            if (line != ".")
+                return "";
+            *inData = false;
+            return "250 queued";
+        }
+        if (line.compare(0, 5, "EHLO ") == 0)
+            return "250-relay.local\r\n250-PIPELINING\r\n250 8BITMIME";
+        if (line == "DATA") {
+            *inData = true;
+            return "354 end with .";
+        }
+        return "250 OK";
+    };
+}
+
+function<string(const string&)> smsGatewayStandIn() {
+    auto ids = make_shared<uint64_t>(0);
+    return [ids](const string& line) -> string {
+        return line.compare(0, 4, "SMS ") == 0 ? "OK " + to_string(++*ids) : "ERR";
+    };
+}
+
+// ------------------------ Audit Log ------------------------
+
+enum class AuditChannel : uint8_t { Email = 0, Sms = 1 };
+enum class AuditOutcome : uint8_t { Sent = 0, Rejected = 1 };
+
+struct AuditRecord {
+    int64_t tsMs;
+    uint32_t userId;
+    AuditChannel channel;
+    string recipient;
+    string content;
+    AuditOutcome outcome;
 };
 
-// ------------------------ Notification Abstraction ------------------------
+namespace audit {
 
-class INotifier {
-public:
-    virtual void notify(const User& u) = 0;
-    virtual ~INotifier() = default;
+const uint32_t MAGIC_V1 = 0x31445541;  // "AUD1", no outcome column
+const uint32_t MAGIC = 0x32445541;     // "AUD2"
+
+// Zone map written in front of every block; a reader decides from these
+// 40 bytes whether the block can hold matching records.
+struct BlockHeader {
+    uint32_t magic;
+    uint32_t payloadBytes;
+    uint32_t count;
+    uint32_t minUser;
+    uint32_t maxUser;
+    uint32_t reserved;
+    int64_t minTs;
+    int64_t maxTs;
 };
 
-// ------------------------ Concrete Notifiers ------------------------
+void putVarint(string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(char(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
 
-class WelcomeEmailNotifier : public INotifier {
+bool getVarint(const string& in, size_t& i, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; i < in.size() && shift < 64; shift += 7) {
+        unsigned char c = (unsigned char)in[i++];
+        v |= uint64_t(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+uint64_t zigzag(int64_t v) { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+int64_t unzigzag(uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+// Dictionary column: distinct strings once, then one varint per record.
+void putDictColumn(string& out, const vector<AuditRecord>& recs,
+                   const string AuditRecord::*field) {
+    unordered_map<string, uint32_t> dict;
+    vector<const string*> order;
+    string ids;
+    for (auto& r : recs) {
+        auto it = dict.emplace(r.*field, (uint32_t)order.size());
+        if (it.second)
+            order.push_back(&it.first->first);
+        putVarint(ids, it.first->second);
+    }
+    putVarint(out, order.size());
+    for (auto* str : order) {
+        putVarint(out, str->size());
+        out += *str;
+    }
+    out += ids;
+}
+
+bool getDictColumn(const string& in, size_t& i, vector<AuditRecord>& recs,
+                   string AuditRecord::*field) {
+    uint64_t n;
+    if (!getVarint(in, i, n))
+        return false;
+    vector<string> dict(n);
+    for (auto& d : dict) {
+        uint64_t len;
+        if (!getVarint(in, i, len) || i + len > in.size())
+            return false;
+        d.assign(in, i, len);
+        i += len;
+    }
+    for (auto& r : recs) {
+        uint64_t id;
+        if (!getVarint(in, i, id) || id >= dict.size())
+            return false;
+        r.*field = dict[id];
+    }
+    return true;
+}
+
+}  // namespace audit
+
+// Buffers records into per-user-range partitions and writes each full
+// partition as one columnar block: delta/varint timestamps and user ids,
+// channel and outcome byte columns, and dictionary-coded recipient and
+// content. Partitioning keeps each block's user-id range narrow, so zone
+// maps can prune on user as well as on time. A flusher thread writes out
+// partial partitions and fdatasyncs every `maxDelayMs`, so a crash loses
+// at most that much of the log.
+class AuditLogWriter {
 private:
-    IEmailService* email;
+    FILE* out;
+    size_t blockRecords;
+    int userShift;
+    chrono::milliseconds maxDelay;
+    mutex mu;
+    condition_variable wake;
+    unordered_map<uint32_t, vector<AuditRecord>> partitions;
+    bool dirty{false};  // records or bytes not yet on disk
+    bool stopping{false};
+    uint64_t blocks{0};
+    thread flusher;
+
+    void writeBlock(vector<AuditRecord>& recs) {
+        if (recs.empty() || !out)
+            return;
+        audit::BlockHeader h{audit::MAGIC, 0, (uint32_t)recs.size(),
+                             UINT32_MAX, 0, 0, INT64_MAX, INT64_MIN};
+        string payload;
+        int64_t prevTs = 0;
+        int64_t prevUser = 0;
+        for (auto& r : recs) {
+            h.minTs = min(h.minTs, r.tsMs);
+            h.maxTs = max(h.maxTs, r.tsMs);
+            h.minUser = min(h.minUser, r.userId);
+            h.maxUser = max(h.maxUser, r.userId);
+            audit::putVarint(payload, audit::zigzag(r.tsMs - prevTs));
+            prevTs = r.tsMs;
+        }
+        for (auto& r : recs) {
+            audit::putVarint(payload, audit::zigzag((int64_t)r.userId - prevUser));
+            prevUser = r.userId;
+        }
+        for (auto& r : recs)
+            payload.push_back(char(r.channel));
+        for (auto& r : recs)
+            payload.push_back(char(r.outcome));
+        audit::putDictColumn(payload, recs, &AuditRecord::recipient);
+        audit::putDictColumn(payload, recs, &AuditRecord::content);
+
+        h.payloadBytes = (uint32_t)payload.size();
+        fwrite(&h, sizeof(h), 1, out);
+        fwrite(payload.data(), 1, payload.size(), out);
+        ++blocks;
+        recs.clear();
+    }
+
+    // Caller holds mu.
+    void flushLocked() {
+        for (auto& kv : partitions)
+            writeBlock(kv.second);
+        if (out && dirty) {
+            fflush(out);
+            fdatasync(fileno(out));
+        }
+        dirty = false;
+    }
+
+    void flusherLoop() {
+        unique_lock<mutex> lk(mu);
+        while (!stopping) {
+            wake.wait_for(lk, maxDelay, [&] { return stopping; });
+            flushLocked();
+        }
+    }
+
 public:
-    WelcomeEmailNotifier(IEmailService* svc) : email(svc) {}
+    AuditLogWriter(const string& path, size_t recordsPerBlock = 4096,
+                   int userRangeBits = 12, int64_t maxDelayMs = 1000)
+        : out(fopen(path.c_str(), "ab")), blockRecords(recordsPerBlock),
+          userShift(userRangeBits), maxDelay(max<int64_t>(1, maxDelayMs)) {
+        flusher = thread([this] { flusherLoop(); });
+    }
 
-    void notify(const User& u) override {
-        email->sendEmail("welcome", u.email, "Welcome!");
+    ~AuditLogWriter() {
+        {
+            lock_guard<mutex> g(mu);
+            stopping = true;
+        }
+        wake.notify_all();
+        flusher.join();
+        flush();
+        if (out)
+            fclose(out);
+    }
+
+    void append(AuditRecord r) {
+        lock_guard<mutex> g(mu);
+        auto& part = partitions[r.userId >> userShift];
+        part.push_back(move(r));
+        dirty = true;
+        if (part.size() >= blockRecords)
+            writeBlock(part);
+    }
+
+    void flush() {
+        lock_guard<mutex> g(mu);
+        flushLocked();
+    }
+
+    uint64_t blockCount() {
+        lock_guard<mutex> g(mu);
+        return blocks;
     }
 };
 
-class OTPNotifier : public INotifier {
+struct AuditQueryStats {
+    uint64_t blocksTotal{0};
+    uint64_t blocksRead{0};
+    uint64_t bytesRead{0};
+    uint64_t matches{0};
+};
+
+// Reads only block headers until a zone map overlaps the query; only
+// those blocks' payloads are fetched and decoded.
+class AuditLogReader {
 private:
-    ISmsService* sms;
+    string path;
 public:
-    OTPNotifier(ISmsService* svc) : sms(svc) {}
+    AuditLogReader(const string& file) : path(file) {}
 
-    void notify(const User& u) override {
-        sms->sendSMS(u.phone, "123456");
+    AuditQueryStats query(uint32_t userId, int64_t fromMs, int64_t toMs,
+                          const function<void(const AuditRecord&)>& fn) const {
+        AuditQueryStats st;
+        FILE* in = fopen(path.c_str(), "rb");
+        if (!in)
+            return st;
+        audit::BlockHeader h;
+        string payload;
+        vector<AuditRecord> recs;
+        while (fread(&h, sizeof(h), 1, in) == 1 &&
+               (h.magic == audit::MAGIC || h.magic == audit::MAGIC_V1)) {
+            ++st.blocksTotal;
+            st.bytesRead += sizeof(h);
+            if (userId < h.minUser || userId > h.maxUser ||
+                toMs < h.minTs || fromMs > h.maxTs) {
+                fseek(in, h.payloadBytes, SEEK_CUR);
+                continue;
+            }
+            ++st.blocksRead;
+            st.bytesRead += h.payloadBytes;
+            payload.resize(h.payloadBytes);
+            if (fread(&payload[0], 1, h.payloadBytes, in) != h.payloadBytes)
+                break;
+
+            recs.assign(h.count, AuditRecord{});
+            size_t i = 0;
+            int64_t ts = 0, user = 0;
+            bool ok = true;
+            for (auto& r : recs) {
+                uint64_t v = 0;
+                ok = ok && audit::getVarint(payload, i, v);
+                r.tsMs = ts += audit::unzigzag(v);
+            }
+            for (auto& r : recs) {
+                uint64_t v = 0;
+                ok = ok && audit::getVarint(payload, i, v);
+                r.userId = uint32_t(user += audit::unzigzag(v));
+            }
+            for (auto& r : recs)
+                r.channel = AuditChannel(i < payload.size() ? payload[i++] : 0);
+            if (h.magic == audit::MAGIC)
+                for (auto& r : recs)
+                    r.outcome = AuditOutcome(i < payload.size() ? payload[i++] : 0);
+            ok = ok && audit::getDictColumn(payload, i, recs, &AuditRecord::recipient) &&
+                 audit::getDictColumn(payload, i, recs, &AuditRecord::content);
+            if (!ok)
+                break;
+
+            for (auto& r : recs)
+                if (r.userId == userId && r.tsMs >= fromMs && r.tsMs <= toMs) {
+                    ++st.matches;
+                    fn(r);
+                }
+        }
+        fclose(in);
+        return st;
     }
 };
 
-// ------------------------ Composite Notifier (OCP) ------------------------
+// Provider decorators that record every message they pass on. The
+// resolver maps a recipient to its user id (0 when unknown).
+using UserIdResolver = function<uint32_t(const string&)>;
 
-class CompositeNotifier : public INotifier {
+int64_t wallClockMs() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+class AuditedEmailService : public IEmailService {
 private:
-    vector<INotifier*> notifiers;
+    IEmailService* inner;
+    AuditLogWriter* log;
+    UserIdResolver resolve;
 public:
-    void add(INotifier* notifier) {
-        notifiers.push_back(notifier);
+    AuditedEmailService(IEmailService* svc, AuditLogWriter* l, UserIdResolver r)
+        : inner(svc), log(l), resolve(move(r)) {}
+
+    void sendEmail(const string& templ, const string& to,
+                   const string& body) override {
+        inner->sendEmail(templ, to, body);
+        log->append({wallClockMs(), resolve(to), AuditChannel::Email, to,
+                     templ + ": " + body, AuditOutcome::Sent});
     }
 
-    void notify(const User& u) override {
-        for (auto n : notifiers)
-            n->notify(u);
+    void sendEmailBatch(const string& templ, const vector<string>& to,
+                        const string& body) override {
+        inner->sendEmailBatch(templ, to, body);
+        int64_t now = wallClockMs();
+        for (auto& r : to)
+            log->append({now, resolve(r), AuditChannel::Email, r, templ + ": " + body,
+                         AuditOutcome::Sent});
     }
-};
 
-// ------------------------ High-level SignUp Service ------------------------
+    void sendMessage(const MailMessage& m) override {
+        inner->sendMessage(m);
+        log->append({wallClockMs(), resolve(m.to), AuditChannel::Email, m.to,
+                     m.subject + ": " + m.body, AuditOutcome::Sent});
+    }
 
-class SignUpService {
-private:
-    INotifier* notifier;  // ONLY ONE DEPENDENCY (DIP)
-public:
-    SignUpService(INotifier* n) : notifier(n) {}
+    void sendMessages(const vector<MailMessage>& msgs) override {
+        inner->sendMessages(msgs);
+        int64_t now = wallClockMs();
+        for (auto& m : msgs)
+            log->append({now, resolve(m.to), AuditChannel::Email, m.to,
+                         m.subject + ": " + m.body, AuditOutcome::Sent});
+    }
 
-    bool signUp(const User& u) {
-        if (u.email.empty())
-            return false;
+    // Sends are recorded when handed off; a later refusal is recorded too.
+    vector<string> settle() override {
+        vector<string> refused = inner->settle();
+        int64_t now = wallClockMs();
+        for (auto& r : refused)
+            log->append({now, resolve(r), AuditChannel::Email, r, "refused by relay",
+                         AuditOutcome::Rejected});
+        return refused;
+    }
+};
 
-        // Imagine DB save logic here...
+class AuditedSmsService : public ISmsService {
+private:
+    ISmsService* inner;
+    AuditLogWriter* log;
+    UserIdResolver resolve;
+public:
+    AuditedSmsService(ISmsService* svc, AuditLogWriter* l, UserIdResolver r)
+        : inner(svc), log(l), resolve(move(r)) {}
 
-        notifier->notify(u);  // triggers all notifications
-        return true;
+    bool sendSMS(const string& phone, const string& message) override {
+        bool ok = inner->sendSMS(phone, message);
+        log->append({wallClockMs(), resolve(phone), AuditChannel::Sms, phone, message,
+                     ok ? AuditOutcome::Sent : AuditOutcome::Rejected});
+        return ok;
     }
 };
 
-// ------------------------ MAIN: Composition Root ------------------------
+// ------------------------ DKIM Signing ------------------------
 
-int main() {
-    // Concrete dependencies
-    SmtpMailer smtp;
-    TwilioClient twilio;
+namespace dkim {
 
-    // Individual notifiers
-    WelcomeEmailNotifier welcomeEmail(&smtp);
+bool isWsp(char c) { return c == ' ' || c == '\t'; }
+
+// RFC 6376 3.4.4 relaxed body: collapse WSP runs, drop trailing WSP on
+// each line and trailing empty lines, CRLF line endings.
+string canonBody(const string& body) {
+    string out;
+    out.reserve(body.size() + 16);
+    string line;
+    size_t emptyRun = 0;
+    auto flushLine = [&]() {
+        while (!line.empty() && line.back() == ' ')
+            line.pop_back();
+        if (line.empty()) {
+            ++emptyRun;
+            return;
+        }
+        for (; emptyRun > 0; --emptyRun)
+            out += "\r\n";
+        out += line;
+        out += "\r\n";
+        line.clear();
+    };
+    for (size_t i = 0; i < body.size(); ++i) {
+        char c = body[i];
+        if (c == '\n') {
+            flushLine();
+        } else if (c == '\r') {
+            continue;
+        } else if (isWsp(c)) {
+            if (line.empty() || line.back() != ' ')
+                line.push_back(' ');
+        } else {
+            line.push_back(c);
+        }
+    }
+    if (!line.empty())
+        flushLine();
+    return out;
+}
+
+// RFC 6376 3.4.2 relaxed header: lower-case name, unfold, collapse WSP,
+// no WSP around the colon or at the end.
+string canonHeader(const string& name, const string& value) {
+    string out;
+    for (char c : name)
+        out.push_back((c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c);
+    out.push_back(':');
+    size_t start = out.size();
+    for (char c : value) {
+        if (c == '\r' || c == '\n')
+            continue;
+        if (isWsp(c)) {
+            if (out.size() > start && out.back() != ' ')
+                out.push_back(' ');
+        } else {
+            out.push_back(c);
+        }
+    }
+    while (out.size() > start && out.back() == ' ')
+        out.pop_back();
+    return out;
+}
+
+string base64(const unsigned char* data, size_t n) {
+    string out(4 * ((n + 2) / 3), '\0');
+    int len = EVP_EncodeBlock((unsigned char*)&out[0], data, (int)n);
+    out.resize(len < 0 ? 0 : len);
+    return out;
+}
+
+bool sha256(const string& data, unsigned char out[32]) {
+    unsigned int len = 0;
+    return EVP_Digest(data.data(), data.size(), out, &len, EVP_sha256(), nullptr) == 1;
+}
+
+}  // namespace dkim
+
+// Signing keys per domain, loaded once and shared read-only by all
+// workers (EVP_PKEY is safe for concurrent signing).
+class DkimKeyring {
+private:
+    struct Key {
+        string selector;
+        EVP_PKEY* pkey;
+        bool ed25519;
+    };
+    unordered_map<string, Key> keys;
+
+public:
+    ~DkimKeyring() {
+        for (auto& kv : keys)
+            EVP_PKEY_free(kv.second.pkey);
+    }
+
+    // Takes ownership of `pkey` (Ed25519 or RSA). False, and the key is
+    // not used, when it is null (a failed load or generate()) or of
+    // another type.
+    bool add(const string& domain, const string& selector, EVP_PKEY* pkey) {
+        if (!pkey)
+            return false;
+        int type = EVP_PKEY_get_id(pkey);
+        if (type != EVP_PKEY_ED25519 && type != EVP_PKEY_RSA) {
+            EVP_PKEY_free(pkey);
+            return false;
+        }
+        auto it = keys.find(domain);
+        if (it != keys.end())
+            EVP_PKEY_free(it->second.pkey);
+        keys[domain] = {selector, pkey, type == EVP_PKEY_ED25519};
+        return true;
+    }
+
+    // Fresh key for local runs; production loads PEM keys instead.
+    static EVP_PKEY* generate(bool ed25519) {
+        return ed25519 ? EVP_PKEY_Q_keygen(nullptr, nullptr, "ED25519")
+                       : EVP_PKEY_Q_keygen(nullptr, nullptr, "RSA", (size_t)2048);
+    }
+
+    // Builds the DKIM-Signature header value (h=from:to:subject), or ""
+    // when the sender's domain has no key. `ctx` is the caller's reusable
+    // digest context.
+    string sign(const MailMessage& m, EVP_MD_CTX* ctx) const {
+        size_t at = m.from.rfind('@');
+        auto it = keys.find(at == string::npos ? "" : m.from.substr(at + 1));
+        if (it == keys.end())
+            return "";
+        const Key& k = it->second;
+
+        unsigned char bh[32];
+        if (!dkim::sha256(dkim::canonBody(m.body), bh))
+            return "";
+        string value = string("v=1; a=") + (k.ed25519 ? "ed25519-sha256" : "rsa-sha256") +
+                       "; c=relaxed/relaxed; d=" + it->first + "; s=" + k.selector +
+                       "; h=from:to:subject; bh=" + dkim::base64(bh, 32) + "; b=";
+
+        string input = dkim::canonHeader("From", m.from) + "\r\n" +
+                       dkim::canonHeader("To", m.to) + "\r\n" +
+                       dkim::canonHeader("Subject", m.subject) + "\r\n" +
+                       dkim::canonHeader("DKIM-Signature", value);
+
+        unsigned char sig[512];
+        size_t sigLen = sizeof(sig);
+        EVP_MD_CTX_reset(ctx);
+        bool ok;
+        if (k.ed25519) {
+            // RFC 8463: Ed25519 over the SHA-256 of the header data.
+            unsigned char digest[32];
+            ok = dkim::sha256(input, digest) &&
+                 EVP_DigestSignInit(ctx, nullptr, nullptr, nullptr, k.pkey) == 1 &&
+                 EVP_DigestSign(ctx, sig, &sigLen, digest, 32) == 1;
+        } else {
+            ok = EVP_DigestSignInit(ctx, nullptr, EVP_sha256(), nullptr, k.pkey) == 1 &&
+                 EVP_DigestSign(ctx, sig, &sigLen, (const unsigned char*)input.data(),
+                                input.size()) == 1;
+        }
+        return ok ? value + dkim::base64(sig, sigLen) : "";
+    }
+};
+
+// Signs on the shared executor so SMTP delivery isn't capped by one
+// core's signing rate. Each task signs up to `batch` messages, and every
+// thread keeps its own digest context.
+class DkimSigningPool {
+private:
+    const DkimKeyring* keyring;
+    exec::Executor& ex;
+    size_t batch;
+
+    static EVP_MD_CTX* threadContext() {
+        static thread_local unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX*)> ctx(
+            EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        return ctx.get();
+    }
+
+public:
+    DkimSigningPool(const DkimKeyring* k, exec::Executor& e = exec::defaultExecutor(),
+                    size_t jobsPerBatch = 32)
+        : keyring(k), ex(e), batch(jobsPerBatch) {}
+
+    size_t workers() const { return ex.size(); }
+
+    // Runs on a pool worker at High priority, so threads sending one
+    // message at a time share the pool's cores instead of adding their
+    // own and don't queue behind a campaign's chunks.
+    string sign(const MailMessage& m) const {
+        if (ex.currentWorker() >= 0)
+            return keyring->sign(m, threadContext());
+        string sig;
+        bool done = false;
+        mutex mu;
+        condition_variable signedCv;
+        ex.spawn([&] {
+            string s = keyring->sign(m, threadContext());
+            lock_guard<mutex> g(mu);
+            sig = move(s);
+            done = true;
+            signedCv.notify_one();
+        }, exec::Priority::High);
+        unique_lock<mutex> g(mu);
+        signedCv.wait(g, [&] { return done; });
+        return sig;
+    }
+
+    vector<string> signAll(const vector<MailMessage>& msgs) {
+        TRACE_SPAN("DkimSigningPool::signAll", "provider");
+        ALLOC_SCOPE("notify.dkim");
+        vector<string> sigs(msgs.size());
+        exec::parallel_for(ex, 0, msgs.size(), batch, [&](size_t lo, size_t hi) {
+            TRACE_SPAN("DkimSigningPool::signChunk", "provider");
+            ALLOC_SCOPE("notify.dkim");
+            EVP_MD_CTX* ctx = threadContext();
+            for (size_t i = lo; i < hi; ++i)
+                sigs[i] = keyring->sign(msgs[i], ctx);
+        });
+        return sigs;
+    }
+};
+
+// IEmailService decorator: signs, then hands the message with its
+// DKIM-Signature header to the real mailer. To is a signed header, so a
+// batch becomes one message per recipient; they are signed on the pool
+// in parallel and sent with sendMessages (one session where the mailer
+// supports it). Mail from a domain without a key goes out unsigned.
+class DkimSigningMailer : public IEmailService {
+private:
+    IEmailService* inner;
+    DkimSigningPool* pool;
+    string from;
+
+    static void attach(MailMessage& m, string sig) {
+        if (!sig.empty())
+            m.headers.insert(m.headers.begin(), {"DKIM-Signature", move(sig)});
+    }
+
+public:
+    DkimSigningMailer(IEmailService* mailer, DkimSigningPool* p, const string& sender)
+        : inner(mailer), pool(p), from(sender) {}
+
+    void sendEmail(const string& templ, const string& to, const string& body) override {
+        sendMessage({from, to, templ, body, {}});
+    }
+
+    void sendEmailBatch(const string& templ, const vector<string>& to,
+                        const string& body) override {
+        vector<MailMessage> msgs;
+        for (auto& r : to)
+            msgs.push_back({from, r, templ, body, {}});
+        sendMessages(msgs);
+    }
+
+    void sendMessage(const MailMessage& m) override {
+        MailMessage out = m;
+        attach(out, pool->sign(m));
+        inner->sendMessage(out);
+    }
+
+    void sendMessages(const vector<MailMessage>& msgs) override {
+        vector<MailMessage> out = msgs;
+        vector<string> sigs = pool->signAll(msgs);
+        for (size_t i = 0; i < out.size(); ++i)
+            attach(out[i], move(sigs[i]));
+        inner->sendMessages(out);
+    }
+
+    vector<string> settle() override { return inner->settle(); }
+};
+
+// ------------------------ HTTP/2 Client ------------------------
+
+// Byte transport under an HTTP/2 connection (TLS socket in production,
+// LoopbackHttp2Server locally).
+class IByteStream {
+public:
+    virtual void write(const string& bytes) = 0;
+    virtual void read(string& out) = 0;  // appends whatever is available
+    virtual ~IByteStream() = default;
+};
+
+namespace h2 {
+
+enum : uint8_t {
+    DATA = 0x0, HEADERS = 0x1, RST_STREAM = 0x3, SETTINGS = 0x4,
+    PING = 0x6, GOAWAY = 0x7, WINDOW_UPDATE = 0x8, CONTINUATION = 0x9
+};
+enum : uint8_t { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY = 0x20 };
+const uint16_t SETTINGS_HEADER_TABLE_SIZE = 0x1;
+const uint16_t SETTINGS_ENABLE_PUSH = 0x2;
+const uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+const uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+const uint16_t SETTINGS_MAX_FRAME_SIZE = 0x5;
+const uint32_t DEFAULT_WINDOW = 65535;
+const uint32_t DEFAULT_MAX_FRAME = 16384;
+const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+struct Frame {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream;
+    string payload;
+};
+
+void writeFrame(string& out, uint8_t type, uint8_t flags, uint32_t stream,
+                string_view payload) {
+    uint32_t len = (uint32_t)payload.size();
+    char hdr[9] = {char(len >> 16), char(len >> 8), char(len), char(type),
+                   char(flags), char((stream >> 24) & 0x7F), char(stream >> 16),
+                   char(stream >> 8), char(stream)};
+    out.append(hdr, 9);
+    out.append(payload.data(), payload.size());
+}
+
+string u32(uint32_t v) {
+    return {char(v >> 24), char(v >> 16), char(v >> 8), char(v)};
+}
+
+uint32_t readU32(const string& s, size_t i) {
+    auto b = [&](size_t k) { return (uint32_t)(unsigned char)s[i + k]; };
+    return b(0) << 24 | b(1) << 16 | b(2) << 8 | b(3);
+}
+
+// Pops one complete frame off the front of `buf`.
+bool readFrame(string& buf, Frame& f) {
+    if (buf.size() < 9)
+        return false;
+    auto b = [&](size_t i) { return (uint32_t)(unsigned char)buf[i]; };
+    uint32_t len = b(0) << 16 | b(1) << 8 | b(2);
+    if (buf.size() < 9 + len)
+        return false;
+    f.type = (uint8_t)b(3);
+    f.flags = (uint8_t)b(4);
+    f.stream = (b(5) & 0x7F) << 24 | b(6) << 16 | b(7) << 8 | b(8);
+    f.payload.assign(buf, 9, len);
+    buf.erase(0, 9 + len);
+    return true;
+}
+
+// Drops the pad length, padding and (HEADERS) priority fields.
+bool unpad(Frame& f) {
+    size_t lo = 0, pad = 0;
+    if (f.flags & PADDED) {
+        if (f.payload.empty())
+            return false;
+        pad = (unsigned char)f.payload[0];
+        lo = 1;
+    }
+    if (f.type == HEADERS && (f.flags & PRIORITY))
+        lo += 5;
+    if (lo + pad > f.payload.size())
+        return false;
+    f.payload = f.payload.substr(lo, f.payload.size() - lo - pad);
+    return true;
+}
+
+// HPACK (RFC 7541). We emit "literal without indexing, new name" with raw
+// strings and decode everything a peer may send: static and dynamic table
+// references, incremental indexing, table size updates and Huffman strings.
+void hpackInt(string& out, uint8_t prefixBits, uint8_t first, uint64_t v) {
+    uint64_t max = (1u << prefixBits) - 1;
+    if (v < max) {
+        out.push_back(char(first | v));
+        return;
+    }
+    out.push_back(char(first | max));
+    for (v -= max; v >= 128; v >>= 7)
+        out.push_back(char(0x80 | (v & 0x7F)));
+    out.push_back(char(v));
+}
+
+bool hpackReadInt(const string& in, size_t& i, uint8_t prefixBits, uint64_t& v) {
+    uint64_t max = (1u << prefixBits) - 1;
+    v = (unsigned char)in[i++] & max;
+    if (v < max)
+        return true;
+    for (int shift = 0; i < in.size() && shift < 56; shift += 7) {
+        unsigned char c = (unsigned char)in[i++];
+        v += uint64_t(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void hpackLiteral(string& out, const string& name, const string& value) {
+    out.push_back(0x00);
+    hpackInt(out, 7, 0, name.size());
+    out += name;
+    hpackInt(out, 7, 0, value.size());
+    out += value;
+}
+
+// RFC 7541 Appendix A.
+const pair<const char*, const char*> kStaticTable[61] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+    {"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""}, {"content-disposition", ""},
+    {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""},
+    {"max-forwards", ""}, {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+    {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""}
+};
+
+// RFC 7541 Appendix B code lengths, symbols 0-255 then EOS. The code is
+// canonical, so the lengths alone define it.
+const uint8_t kHuffmanLength[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+// False on EOS in the data, or padding that is over 7 bits or not all ones.
+bool huffmanDecode(const char* p, size_t n, string& out) {
+    struct Canonical {
+        uint16_t count[31] = {};  // codes of each length
+        uint16_t symbols[257];    // ordered by (length, symbol)
+        Canonical() {
+            size_t k = 0;
+            for (int len = 1; len <= 30; ++len)
+                for (int s = 0; s < 257; ++s)
+                    if (kHuffmanLength[s] == len) {
+                        ++count[len];
+                        symbols[k++] = (uint16_t)s;
+                    }
+        }
+    };
+    static const Canonical canon;
+
+    uint32_t code = 0, first = 0, tail = 0;
+    int len = 0, index = 0;
+    for (size_t i = 0; i < n; ++i)
+        for (int bit = 7; bit >= 0; --bit) {
+            uint32_t b = ((unsigned char)p[i] >> bit) & 1;
+            code |= b;
+            tail = tail << 1 | b;
+            if (++len > 30)
+                return false;
+            uint32_t count = canon.count[len];
+            if (code < first + count) {
+                uint16_t sym = canon.symbols[index + code - first];
+                if (sym == 256)
+                    return false;
+                out.push_back(char(sym));
+                code = first = tail = 0;
+                len = index = 0;
+            } else {
+                index += count;
+                first = (first + count) << 1;
+                code <<= 1;
+            }
+        }
+    return len <= 7 && tail == (1u << len) - 1;
+}
+
+// One per connection direction: the dynamic table is shared by every
+// header block the peer sends, in order. We advertise a table size of 0,
+// but the peer may index into the default 4096 bytes until it has seen
+// our SETTINGS, so the table is kept anyway.
+class HpackDecoder {
+private:
+    static const size_t kMaxTable = 4096;
+    deque<pair<string, string>> table;  // newest first
+    size_t tableSize{0};
+    size_t maxSize{kMaxTable};
+
+    static size_t entrySize(const pair<string, string>& e) {
+        return e.first.size() + e.second.size() + 32;
+    }
+
+    void evict(size_t limit) {
+        while (tableSize > limit) {
+            tableSize -= entrySize(table.back());
+            table.pop_back();
+        }
+    }
+
+    void insert(const pair<string, string>& e) {
+        size_t n = entrySize(e);
+        evict(n > maxSize ? 0 : maxSize - n);
+        if (n > maxSize)
+            return;
+        table.push_front(e);
+        tableSize += n;
+    }
+
+    bool entry(uint64_t idx, pair<string, string>& out) const {
+        if (idx == 0)
+            return false;
+        if (idx <= 61) {
+            out = {kStaticTable[idx - 1].first, kStaticTable[idx - 1].second};
+            return true;
+        }
+        if (idx - 62 >= table.size())
+            return false;
+        out = table[idx - 62];
+        return true;
+    }
+
+    static bool readString(const string& in, size_t& i, string& out) {
+        uint64_t len;
+        if (i >= in.size())
+            return false;
+        bool huffman = in[i] & 0x80;
+        if (!hpackReadInt(in, i, 7, len) || len > in.size() - i)
+            return false;
+        out.clear();
+        if (huffman && !huffmanDecode(in.data() + i, len, out))
+            return false;
+        if (!huffman)
+            out.assign(in, i, len);
+        i += len;
+        return true;
+    }
+
+public:
+    // Appends the block's fields to `headers`. On a malformed block the
+    // fields before the error are kept and false is returned; the dynamic
+    // table is then out of step with the peer's.
+    bool decode(const string& in, vector<pair<string, string>>& headers) {
+        size_t i = 0;
+        while (i < in.size()) {
+            unsigned char c = (unsigned char)in[i];
+            uint64_t idx;
+            pair<string, string> field;
+            if (c & 0x80) {  // indexed field
+                if (!hpackReadInt(in, i, 7, idx) || !entry(idx, field))
+                    return false;
+                headers.push_back(move(field));
+                continue;
+            }
+            if ((c & 0xE0) == 0x20) {  // dynamic table size update
+                if (!hpackReadInt(in, i, 5, idx) || idx > kMaxTable)
+                    return false;
+                maxSize = idx;
+                evict(maxSize);
+                continue;
+            }
+            // literal: with incremental indexing, without, or never indexed
+            bool indexing = c & 0x40;
+            if (!hpackReadInt(in, i, indexing ? 6 : 4, idx))
+                return false;
+            if (idx ? !entry(idx, field) : !readString(in, i, field.first))
+                return false;
+            if (!readString(in, i, field.second))
+                return false;
+            if (indexing)
+                insert(field);
+            headers.push_back(move(field));
+        }
+        return true;
+    }
+};
+
+}  // namespace h2
+
+struct Http2Request {
+    string authority;
+    string path;
+    vector<pair<string, string>> headers;
+    string body;
+};
+
+// One long-lived connection carrying many concurrent streams, bounded by
+// the peer's SETTINGS_MAX_CONCURRENT_STREAMS. Request bodies are sent
+// within the peer's connection and stream flow-control windows, split at
+// its SETTINGS_MAX_FRAME_SIZE. A stream completes with its :status when
+// the response ends (END_STREAM on HEADERS or DATA), or with status 0
+// when the peer resets it or goes away before processing it.
+class Http2Connection {
+private:
+    struct Stream {
+        function<void(int)> done;
+        string body;  // request body, sent as windows open
+        size_t sent{0};
+        int64_t window{0};  // what the peer lets us send on this stream
+        int status{0};
+    };
+
+    IByteStream* sock;
+    uint32_t nextStream{1};
+    size_t peerMaxStreams{100};  // RFC 9113 suggested floor until SETTINGS
+    size_t peerMaxFrame{h2::DEFAULT_MAX_FRAME};
+    int64_t peerInitialWindow{h2::DEFAULT_WINDOW};
+    int64_t connWindow{h2::DEFAULT_WINDOW};
+    bool goingAway{false};
+    unordered_map<uint32_t, Stream> inflight;
+    vector<uint32_t> sending;  // streams with body left, in submission order
+    uint32_t headerStream{0};  // header block being continued, if any
+    bool headerEndStream{false};
+    string headerBlock;
+    h2::HpackDecoder hpack;
+    string rx;
+    string tx;
+
+    void finish(uint32_t id, int status, size_t& finished) {
+        auto it = inflight.find(id);
+        if (it == inflight.end())
+            return;
+        auto cb = move(it->second.done);
+        inflight.erase(it);
+        cb(status);
+        ++finished;
+    }
+
+    void flushData() {
+        for (size_t k = 0; k < sending.size();) {
+            auto it = inflight.find(sending[k]);
+            if (it == inflight.end()) {
+                sending.erase(sending.begin() + k);
+                continue;
+            }
+            Stream& s = it->second;
+            while (s.sent < s.body.size() && connWindow > 0 && s.window > 0) {
+                size_t n = min<size_t>({s.body.size() - s.sent, peerMaxFrame,
+                                        (size_t)connWindow, (size_t)s.window});
+                bool last = s.sent + n == s.body.size();
+                h2::writeFrame(tx, h2::DATA, last ? h2::END_STREAM : 0, it->first,
+                               string_view(s.body).substr(s.sent, n));
+                s.sent += n;
+                s.window -= n;
+                connWindow -= n;
+            }
+            if (s.sent < s.body.size()) {
+                ++k;
+                continue;
+            }
+            string().swap(s.body);
+            sending.erase(sending.begin() + k);
+        }
+    }
+
+    void onHeaders(uint32_t id, bool endStream, size_t& finished) {
+        // Every block goes through the decoder, even for streams we no
+        // longer track, to keep its dynamic table in step with the peer's.
+        vector<pair<string, string>> hs;
+        bool decoded = hpack.decode(headerBlock, hs);
+        if (!decoded)
+            goingAway = true;  // compression state lost: no new streams here
+        auto it = inflight.find(id);
+        if (it == inflight.end())
+            return;
+        for (auto& h : hs)
+            if (h.first == ":status") {
+                int status = atoi(h.second.c_str());
+                if (status >= 200)  // 1xx are interim
+                    it->second.status = status;
+            }
+        if (endStream)
+            finish(id, it->second.status, finished);
+    }
+
+    void applySettings(const string& payload) {
+        for (size_t i = 0; i + 6 <= payload.size(); i += 6) {
+            uint16_t id = uint16_t((unsigned char)payload[i] << 8 | (unsigned char)payload[i + 1]);
+            uint32_t val = h2::readU32(payload, i + 2);
+            if (id == h2::SETTINGS_MAX_CONCURRENT_STREAMS) {
+                peerMaxStreams = val;
+            } else if (id == h2::SETTINGS_INITIAL_WINDOW_SIZE && val <= 0x7FFFFFFF) {
+                // Applies retroactively to every open stream (RFC 9113 6.9.2).
+                for (auto& kv : inflight)
+                    kv.second.window += (int64_t)val - peerInitialWindow;
+                peerInitialWindow = val;
+            } else if (id == h2::SETTINGS_MAX_FRAME_SIZE && val >= h2::DEFAULT_MAX_FRAME &&
+                       val < (1u << 24)) {
+                peerMaxFrame = val;
+            }
+        }
+    }
+
+public:
+    // No dynamic table and no server push: the peer may not use either
+    // once it has our SETTINGS.
+    Http2Connection(IByteStream* s) : sock(s) {
+        tx = h2::PREFACE;
+        string settings = {0, char(h2::SETTINGS_HEADER_TABLE_SIZE)};
+        settings += h2::u32(0);
+        settings += {0, char(h2::SETTINGS_ENABLE_PUSH)};
+        settings += h2::u32(0);
+        h2::writeFrame(tx, h2::SETTINGS, 0, 0, settings);
+    }
+
+    size_t inFlight() const { return inflight.size(); }
+    bool hasCapacity() const { return !goingAway && inflight.size() < peerMaxStreams; }
+    // After GOAWAY, once its last stream is done.
+    bool closed() const { return goingAway && inflight.empty(); }
+
+    void submit(const Http2Request& r, function<void(int)> done) {
+        uint32_t id = nextStream;
+        nextStream += 2;
+
+        string block;
+        h2::hpackLiteral(block, ":method", "POST");
+        h2::hpackLiteral(block, ":scheme", "https");
+        h2::hpackLiteral(block, ":authority", r.authority);
+        h2::hpackLiteral(block, ":path", r.path);
+        for (auto& h : r.headers)
+            h2::hpackLiteral(block, h.first, h.second);
+
+        bool hasBody = !r.body.empty();
+        for (size_t at = 0;;) {
+            size_t n = min(block.size() - at, peerMaxFrame);
+            bool last = at + n == block.size();
+            uint8_t flags = (last ? h2::END_HEADERS : 0) | (at == 0 && !hasBody ? h2::END_STREAM : 0);
+            h2::writeFrame(tx, at == 0 ? h2::HEADERS : h2::CONTINUATION, flags, id,
+                           string_view(block).substr(at, n));
+            at += n;
+            if (last)
+                break;
+        }
+        Stream& s = inflight[id];
+        s.done = move(done);
+        s.window = peerInitialWindow;
+        if (hasBody) {
+            s.body = r.body;
+            sending.push_back(id);
+            flushData();
+        }
+    }
+
+    // Flushes queued frames in one write, then handles every complete
+    // frame the peer sent. Returns the number of finished streams.
+    size_t pump() {
+        if (!tx.empty()) {
+            sock->write(tx);
+            tx.clear();
+        }
+        sock->read(rx);
+
+        size_t finished = 0;
+        h2::Frame f;
+        while (h2::readFrame(rx, f)) {
+            switch (f.type) {
+            case h2::SETTINGS:
+                if (f.flags & h2::ACK)
+                    break;
+                applySettings(f.payload);
+                h2::writeFrame(tx, h2::SETTINGS, h2::ACK, 0, "");
+                flushData();
+                break;
+            case h2::WINDOW_UPDATE: {
+                if (f.payload.size() < 4)
+                    break;
+                int64_t inc = h2::readU32(f.payload, 0) & 0x7FFFFFFF;
+                if (f.stream == 0) {
+                    connWindow += inc;
+                } else {
+                    auto it = inflight.find(f.stream);
+                    if (it != inflight.end())
+                        it->second.window += inc;
+                }
+                flushData();
+                break;
+            }
+            case h2::PING:
+                if (!(f.flags & h2::ACK))
+                    h2::writeFrame(tx, h2::PING, h2::ACK, 0, f.payload);
+                break;
+            case h2::HEADERS:
+                if (!h2::unpad(f))
+                    break;
+                headerStream = f.stream;
+                headerEndStream = f.flags & h2::END_STREAM;
+                headerBlock = move(f.payload);
+                if (f.flags & h2::END_HEADERS)
+                    onHeaders(f.stream, headerEndStream, finished);
+                break;
+            case h2::CONTINUATION:
+                if (f.stream != headerStream)
+                    break;
+                headerBlock += f.payload;
+                if (f.flags & h2::END_HEADERS)
+                    onHeaders(f.stream, headerEndStream, finished);
+                break;
+            case h2::DATA: {
+                // The body is not used, but its bytes count against our
+                // receive windows: hand them straight back.
+                uint32_t n = (uint32_t)f.payload.size();
+                bool open = inflight.count(f.stream) && !(f.flags & h2::END_STREAM);
+                if (n) {
+                    h2::writeFrame(tx, h2::WINDOW_UPDATE, 0, 0, h2::u32(n));
+                    if (open)
+                        h2::writeFrame(tx, h2::WINDOW_UPDATE, 0, f.stream, h2::u32(n));
+                }
+                if (f.flags & h2::END_STREAM) {
+                    auto it = inflight.find(f.stream);
+                    if (it != inflight.end())
+                        finish(f.stream, it->second.status, finished);
+                }
+                break;
+            }
+            case h2::RST_STREAM:
+                finish(f.stream, 0, finished);
+                break;
+            case h2::GOAWAY: {
+                // Streams above the last one the peer processed never ran.
+                uint32_t last = f.payload.size() >= 4 ? h2::readU32(f.payload, 0) & 0x7FFFFFFF : 0;
+                goingAway = true;
+                vector<uint32_t> lost;
+                for (auto& kv : inflight)
+                    if (kv.first > last)
+                        lost.push_back(kv.first);
+                for (uint32_t id : lost)
+                    finish(id, 0, finished);
+                break;
+            }
+            }
+        }
+        return finished;
+    }
+};
+
+// Shared by every HTTP-based notifier: a handful of connections per
+// authority, each multiplexing up to the peer's stream limit. Requests
+// beyond that wait for a free stream instead of opening new sockets.
+class Http2Client {
+private:
+    using Connector = function<unique_ptr<IByteStream>(const string&)>;
+
+    struct Waiting {
+        Http2Request req;
+        function<void(int)> done;
+    };
+
+    struct Pool {
+        vector<unique_ptr<IByteStream>> socks;
+        vector<unique_ptr<Http2Connection>> conns;
+        deque<Waiting> waiting;
+    };
+
+    Connector connect;
+    size_t maxConns;
+    unordered_map<string, Pool> pools;
+    size_t opened{0};
+
+    Http2Connection* pick(Pool& p, const string& authority) {
+        Http2Connection* best = nullptr;
+        for (auto& c : p.conns)
+            if (c->hasCapacity() && (!best || c->inFlight() < best->inFlight()))
+                best = c.get();
+        // Reuse a connection with room before dialing a new one.
+        if (best || p.conns.size() >= maxConns)
+            return best;
+        p.socks.push_back(connect(authority));
+        p.conns.push_back(make_unique<Http2Connection>(p.socks.back().get()));
+        ++opened;
+        return p.conns.back().get();
+    }
+
+public:
+    Http2Client(Connector c, size_t maxConnsPerAuthority = 2)
+        : connect(move(c)), maxConns(maxConnsPerAuthority) {}
+
+    void send(const Http2Request& r, function<void(int)> done) {
+        Pool& p = pools[r.authority];
+        Http2Connection* c = p.waiting.empty() ? pick(p, r.authority) : nullptr;
+        if (c)
+            c->submit(r, move(done));
+        else
+            p.waiting.push_back({r, move(done)});
+    }
+
+    // Drives all connections until every request has completed.
+    void run() {
+        bool busy = true;
+        while (busy) {
+            busy = false;
+            for (auto& kv : pools) {
+                Pool& p = kv.second;
+                for (auto& c : p.conns)
+                    c->pump();
+                for (size_t i = p.conns.size(); i-- > 0;)
+                    if (p.conns[i]->closed()) {  // after GOAWAY; redial on demand
+                        p.conns.erase(p.conns.begin() + i);
+                        p.socks.erase(p.socks.begin() + i);
+                    }
+                while (!p.waiting.empty()) {
+                    Http2Connection* c = pick(p, kv.first);
+                    if (!c)
+                        break;
+                    c->submit(p.waiting.front().req, move(p.waiting.front().done));
+                    p.waiting.pop_front();
+                }
+                for (auto& c : p.conns)
+                    busy |= c->inFlight() > 0;
+                busy |= !p.waiting.empty();
+            }
+        }
+    }
+
+    size_t connectionsOpened() const { return opened; }
+};
+
+// In-process HTTP/2 peer for local runs: parses the client's frames and
+// answers every finished stream with the configured :status, followed by
+// `body` in DATA frames when one is given (as APNs/FCM error replies
+// are). Request DATA is credited back with WINDOW_UPDATE. Responses are
+// held until the next read(), so streams genuinely overlap.
+class LoopbackHttp2Server : public IByteStream {
+private:
+    uint32_t maxStreams;
+    int status;
+    string body;
+    string rx;
+    string outbox;
+    bool sawPreface{false};
+    size_t pending{0};
+    size_t* peakStreams;
+
+public:
+    LoopbackHttp2Server(uint32_t maxConcurrent, int statusCode, size_t* peak,
+                        const string& responseBody = "")
+        : maxStreams(maxConcurrent), status(statusCode), body(responseBody), peakStreams(peak) {}
+
+    void write(const string& bytes) override {
+        rx += bytes;
+        if (!sawPreface) {
+            size_t n = sizeof(h2::PREFACE) - 1;
+            if (rx.size() < n)
+                return;
+            sawPreface = true;
+            rx.erase(0, n);
+            string settings = {0, char(h2::SETTINGS_MAX_CONCURRENT_STREAMS)};
+            settings += h2::u32(maxStreams);
+            h2::writeFrame(outbox, h2::SETTINGS, 0, 0, settings);
+        }
+
+        h2::Frame f;
+        while (h2::readFrame(rx, f)) {
+            if (f.type == h2::SETTINGS && !(f.flags & h2::ACK))
+                h2::writeFrame(outbox, h2::SETTINGS, h2::ACK, 0, "");
+            if (f.type == h2::DATA && !f.payload.empty()) {
+                h2::writeFrame(outbox, h2::WINDOW_UPDATE, 0, 0, h2::u32((uint32_t)f.payload.size()));
+                if (!(f.flags & h2::END_STREAM))
+                    h2::writeFrame(outbox, h2::WINDOW_UPDATE, 0, f.stream,
+                                   h2::u32((uint32_t)f.payload.size()));
+            }
+            if ((f.type == h2::HEADERS || f.type == h2::DATA) &&
+                (f.flags & h2::END_STREAM)) {
+                string block;
+                h2::hpackLiteral(block, ":status", to_string(status));
+                h2::writeFrame(outbox, h2::HEADERS,
+                               h2::END_HEADERS | (body.empty() ? h2::END_STREAM : 0), f.stream, block);
+                for (size_t at = 0; at < body.size(); at += h2::DEFAULT_MAX_FRAME) {
+                    size_t n = min<size_t>(h2::DEFAULT_MAX_FRAME, body.size() - at);
+                    h2::writeFrame(outbox, h2::DATA, at + n == body.size() ? h2::END_STREAM : 0,
+                                   f.stream, string_view(body).substr(at, n));
+                }
+                ++pending;
+            }
+        }
+        if (peakStreams)
+            *peakStreams = max(*peakStreams, pending);
+    }
+
+    void read(string& out) override {
+        out += outbox;
+        outbox.clear();
+        pending = 0;
+    }
+};
+
+// ------------------------ User Model ------------------------
+
+struct User {
+    string email;
+    string phone;
+    string deviceToken;  // mobile push registration, may be empty
+    uint32_t id;         // dense user id (preference store index), 0 = none
+    User(const string& e, const string& p, const string& d = "",
+         uint32_t uid = 0)
+        : email(e), phone(p), deviceToken(d), id(uid) {}
+};
+
+// Campaign-sized user lists can live in a huge-page arena (arena.hpp).
+using UserList = vector<User, arena::Allocator<User>>;
+
+// ------------------------ Notification Abstraction ------------------------
+
+class INotifier {
+public:
+    virtual void notify(const User& u) = 0;
+    virtual ~INotifier() = default;
+};
+
+// ------------------------ A/B Experiments ------------------------
+
+// splitmix64 finalizer: cheap, well-mixed, deterministic across runs.
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Counters split across cache-line-sized shards picked per thread, so
+// concurrent increments never share a line; reads sum the shards.
+class ShardedCounters {
+private:
+    static const size_t SHARDS = 16;
+    struct alignas(64) Shard {
+        atomic<uint64_t> n[8];
+    };
+    vector<Shard> shards;  // one Shard row holds up to 8 counters
+    size_t rows;
+
+    static size_t myShard() {
+        static atomic<size_t> next{0};
+        thread_local size_t s = next.fetch_add(1, memory_order_relaxed) % SHARDS;
+        return s;
+    }
+
+public:
+    ShardedCounters(size_t counters)
+        : shards(SHARDS * ((counters + 7) / 8)), rows((counters + 7) / 8) {
+        for (auto& sh : shards)
+            for (auto& c : sh.n)
+                c.store(0, memory_order_relaxed);
+    }
+
+    void add(size_t counter, uint64_t v = 1) {
+        shards[myShard() * rows + counter / 8].n[counter % 8]
+            .fetch_add(v, memory_order_relaxed);
+    }
+
+    uint64_t read(size_t counter) const {
+        uint64_t sum = 0;
+        for (size_t s = 0; s < SHARDS; ++s)
+            sum += shards[s * rows + counter / 8].n[counter % 8].load(memory_order_relaxed);
+        return sum;
+    }
+};
+
+struct Variant {
+    string name;
+    string templ;
+    string body;
+    uint32_t weight;
+};
+
+// Stateless, lock-free bucketing: a user's variant is a pure function of
+// (experiment seed, user id or email), so nothing is stored per user and
+// the same user sees the same variant on every host. Distinct seeds make
+// experiments independent of each other.
+class Experiment {
+private:
+    string name;
+    uint64_t seed;
+    vector<Variant> variants;
+    vector<uint32_t> upper;  // cumulative weights
+    uint32_t totalWeight{0};
+    mutable ShardedCounters exposures;
+
+    size_t bucket(uint64_t h) const {
+        // Multiply-shift maps the hash onto [0, totalWeight) without a divide.
+        uint32_t point = uint32_t(((h >> 32) * totalWeight) >> 32);
+        size_t v = 0;
+        while (point >= upper[v])
+            ++v;
+        return v;
+    }
+
+public:
+    // Throws invalid_argument unless the weights sum to 1..2^32-1, since
+    // bucket() has nothing to pick from otherwise.
+    Experiment(const string& n, uint64_t s, vector<Variant> vs)
+        : name(n), seed(s), variants(move(vs)), exposures(variants.size()) {
+        uint64_t sum = 0;
+        for (auto& v : variants)
+            sum += v.weight;
+        if (sum == 0 || sum > UINT32_MAX)
+            throw invalid_argument("experiment " + name + ": variant weights must sum to 1.." +
+                                   to_string(UINT32_MAX));
+        for (auto& v : variants)
+            upper.push_back(totalWeight += v.weight);
+    }
+
+    size_t assignId(uint32_t userId) const { return bucket(mix64(seed ^ userId)); }
+
+    size_t assign(const User& u) const {
+        if (u.id != 0)
+            return assignId(u.id);
+        uint64_t h = seed ^ 1469598103934665603ULL;  // FNV-1a over the email
+        for (unsigned char c : u.email)
+            h = (h ^ c) * 1099511628211ULL;
+        return bucket(mix64(h));
+    }
+
+    const Variant& variant(size_t i) const { return variants[i]; }
+    size_t variantCount() const { return variants.size(); }
+    const string& experimentName() const { return name; }
+
+    void recordExposure(size_t v) const { exposures.add(v); }
+    uint64_t exposureCount(size_t v) const { return exposures.read(v); }
+};
+
+// ------------------------ Concrete Notifiers ------------------------
+
+class WelcomeEmailNotifier : public INotifier {
+private:
+    IEmailService* email;
+    const Experiment* experiment;  // optional A/B test of the template
+public:
+    WelcomeEmailNotifier(IEmailService* svc, const Experiment* exp = nullptr)
+        : email(svc), experiment(exp) {}
+
+    void notify(const User& u) override {
+        TRACE_SPAN("WelcomeEmailNotifier::notify", "notify");
+        ALLOC_SCOPE("notify.welcome");
+        if (!experiment) {
+            email->sendEmail("welcome", u.email, "Welcome!");
+            return;
+        }
+        size_t v = experiment->assign(u);
+        experiment->recordExposure(v);
+        const Variant& var = experiment->variant(v);
+        email->sendEmail(var.templ, u.email, var.body);
+    }
+};
+
+class OTPNotifier : public INotifier {
+private:
+    ISmsService* sms;
+public:
+    OTPNotifier(ISmsService* svc) : sms(svc) {}
+
+    void notify(const User& u) override {
+        TRACE_SPAN("OTPNotifier::notify", "notify");
+        ALLOC_SCOPE("notify.otp");
+        sms->sendSMS(u.phone, "123456");
+    }
+};
+
+// Mobile push (APNs-style) over the shared HTTP/2 client.
+class PushNotifier : public INotifier {
+private:
+    Http2Client* http;
+    string authority;
+    string topic;
+    size_t delivered{0};
+    size_t failed{0};
+public:
+    PushNotifier(Http2Client* c, const string& host, const string& appTopic)
+        : http(c), authority(host), topic(appTopic) {}
+
+    void notify(const User& u) override {
+        TRACE_SPAN("PushNotifier::notify", "notify");
+        ALLOC_SCOPE("notify.push");
+        if (u.deviceToken.empty())
+            return;
+        Http2Request r{authority, "/3/device/" + u.deviceToken,
+                       {{"apns-topic", topic}, {"content-type", "application/json"}},
+                       "{\"aps\":{\"alert\":\"Welcome!\"}}"};
+        http->send(r, [this](int status) {
+            if (status >= 200 && status < 300)
+                ++delivered;
+            else
+                ++failed;
+        });
+    }
+
+    size_t deliveredCount() const { return delivered; }
+    size_t failedCount() const { return failed; }
+};
+
+// JSON string contents for `s` (quotes, backslashes and control
+// characters escaped; UTF-8 passes through).
+string jsonEscape(const string& s) {
+    string out;
+    out.reserve(s.size() + 8);
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back((char)c);
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out.push_back((char)c);
+        }
+    }
+    return out;
+}
+
+// Outgoing webhook: POSTs a signup event to a customer endpoint.
+class WebhookNotifier : public INotifier {
+private:
+    Http2Client* http;
+    string authority;
+    string path;
+public:
+    WebhookNotifier(Http2Client* c, const string& host, const string& p)
+        : http(c), authority(host), path(p) {}
+
+    void notify(const User& u) override {
+        TRACE_SPAN("WebhookNotifier::notify", "notify");
+        ALLOC_SCOPE("notify.webhook");
+        Http2Request r{authority, path, {{"content-type", "application/json"}},
+                       "{\"event\":\"signup\",\"email\":\"" + jsonEscape(u.email) + "\"}"};
+        string target = authority + path;
+        http->send(r, [target](int status) {
+            cout << "[Webhook] POST " << target << " -> " << status << "\n";
+        });
+    }
+};
+
+// ------------------------ Composite Notifier (OCP) ------------------------
+
+// Fans out on the shared executor: every channel but the last runs on a
+// worker while the caller runs the last one, and notify() returns when
+// all are done. Channels may therefore run concurrently with each other.
+class CompositeNotifier : public INotifier {
+private:
+    vector<INotifier*> notifiers;
+    exec::Executor& ex;
+public:
+    explicit CompositeNotifier(exec::Executor& e = exec::defaultExecutor()) : ex(e) {}
+
+    void add(INotifier* notifier) {
+        notifiers.push_back(notifier);
+    }
+
+    void notify(const User& u) override {
+        TRACE_SPAN("CompositeNotifier::notify", "notify");
+        ALLOC_SCOPE("notify.fanout");
+        if (notifiers.empty())
+            return;
+        exec::TaskGroup group(ex);
+        for (size_t i = 0; i + 1 < notifiers.size(); ++i) {
+            INotifier* n = notifiers[i];
+            group.spawn([n, &u] { n->notify(u); });
+        }
+        notifiers.back()->notify(u);
+        group.wait();
+    }
+};
+
+// ------------------------ Campaigns ------------------------
+
+// Bulk email to an audience in NUMA mode: shard n (built on node n, e.g.
+// by numa::scatter) is validated, grouped by domain, built and DKIM-signed
+// by node n's pinned workers into node-local messages; they then go to
+// the mailer from the calling thread in shard order, one sendMessages()
+// per recipient domain. Mail from a domain without a key goes out unsigned.
+class CampaignSender {
+private:
+    const DkimKeyring* keyring;
+    IEmailService* mailer;
+    string from;
+
+public:
+    CampaignSender(const DkimKeyring* k, IEmailService* m, const string& sender)
+        : keyring(k), mailer(m), from(sender) {}
+
+    // Returns the number of messages handed to the mailer; invalid
+    // addresses are skipped and counted in `rejected`.
+    size_t sendShards(const vector<vector<User>>& shards, numa::NodeExecutors& nodes,
+                      const string& templ, const string& body, size_t* rejected = nullptr) {
+        TRACE_SPAN("CampaignSender::sendShards", "notify");
+        ALLOC_SCOPE("notify.campaign");
+        vector<vector<vector<MailMessage>>> batches(shards.size());  // node, domain
+        vector<size_t> bad(shards.size());
+        nodes.eachNode([&](size_t n) {
+            if (n >= shards.size())
+                return;
+            vector<string> emails;
+            emails.reserve(shards[n].size());
+            for (auto& u : shards[n])
+                emails.push_back(u.email);
+            vector<DomainBatch> domains = groupByDomain(emails, &bad[n]);
+
+            vector<MailMessage> msgs;
+            msgs.reserve(emails.size() - bad[n]);
+            for (auto& d : domains)
+                for (auto i : d.recipients)
+                    msgs.push_back({from, emails[i], templ, body, {}});
+            DkimSigningPool pool(keyring, nodes.executor(n));
+            vector<string> sigs = pool.signAll(msgs);
+
+            size_t at = 0;
+            for (auto& d : domains) {
+                auto& batch = batches[n].emplace_back();
+                batch.reserve(d.recipients.size());
+                for (size_t k = 0; k < d.recipients.size(); ++k, ++at) {
+                    if (!sigs[at].empty())
+                        msgs[at].headers.insert(msgs[at].headers.begin(),
+                                                {"DKIM-Signature", move(sigs[at])});
+                    batch.push_back(move(msgs[at]));
+                }
+            }
+        });
+
+        size_t sent = 0, skipped = 0;
+        for (size_t n = 0; n < shards.size(); ++n) {
+            skipped += bad[n];
+            for (auto& batch : batches[n]) {
+                mailer->sendMessages(batch);
+                sent += batch.size();
+            }
+        }
+        if (rejected)
+            *rejected = skipped;
+        return sent;
+    }
+};
+
+// ------------------------ Deduplication ------------------------
+
+// Fingerprints seen in the last `window`, split into `gens` time buckets
+// plus the one filling now, so a key is remembered for at least `window`
+// and at most one bucket period longer. Slot i stores the key of every
+// bucket side by side and each bucket probes linearly from the same home
+// slot, so a lookup walks one row (one cache line) per probe position for
+// all buckets at once. When a period elapses the oldest bucket's column is
+// cleared; a bucket that reaches 3/4 full doubles the table instead of
+// dropping keys. Not thread-safe.
+class SlidingWindowSet {
+private:
+    vector<uint64_t> slots;  // slots[i * cols + c], 0 = empty
+    vector<size_t> fill;     // keys per bucket
+    size_t capacity;         // slots per bucket, power of two
+    size_t cols;
+    int64_t periodMs;
+    int64_t epoch{-1};
+    uint64_t growths{0};
+
+    void rotate(int64_t nowMs) {
+        int64_t e = nowMs / periodMs;
+        if (epoch < 0)
+            epoch = e;
+        for (int64_t k = 0; epoch < e && k < (int64_t)cols; ++k) {
+            ++epoch;
+            size_t c = epoch % cols;
+            for (size_t i = 0; i < capacity; ++i)
+                slots[i * cols + c] = 0;
+            fill[c] = 0;
+        }
+        epoch = max(epoch, e);
+    }
+
+    void place(vector<uint64_t>& to, size_t mask, size_t c, uint64_t key) const {
+        size_t i = key & mask;
+        while (to[i * cols + c] != 0)
+            i = (i + 1) & mask;
+        to[i * cols + c] = key;
+    }
+
+    void grow() {
+        size_t bigger = capacity * 2;
+        vector<uint64_t> next(bigger * cols, 0);
+        for (size_t i = 0; i < capacity; ++i)
+            for (size_t c = 0; c < cols; ++c)
+                if (uint64_t k = slots[i * cols + c])
+                    place(next, bigger - 1, c, k);
+        slots.swap(next);
+        capacity = bigger;
+        ++growths;
+    }
+
+    bool find(uint64_t key) const {
+        size_t mask = capacity - 1;
+        // Bit c stays set while bucket c's probe run from the home slot continues.
+        uint64_t open = (cols == 64 ? ~0ULL : (1ULL << cols) - 1);
+        for (size_t i = key & mask; open; i = (i + 1) & mask) {
+            const uint64_t* row = &slots[i * cols];
+            for (size_t c = 0; c < cols; ++c) {
+                if (!(open >> c & 1))
+                    continue;
+                if (row[c] == key)
+                    return true;
+                if (row[c] == 0)
+                    open &= ~(1ULL << c);
+            }
+        }
+        return false;
+    }
+
+public:
+    // `perGeneration` should be about twice the keys expected per period.
+    SlidingWindowSet(int64_t windowMs, size_t generations, size_t perGeneration)
+        : cols(min<size_t>(max<size_t>(1, generations), 63) + 1),
+          periodMs(max<int64_t>(1, windowMs / (int64_t)(cols - 1))) {
+        capacity = 16;
+        while (capacity < perGeneration)
+            capacity <<= 1;
+        slots.assign(capacity * cols, 0);
+        fill.assign(cols, 0);
+    }
+
+    // Records `key` and returns true if it was not seen within the window.
+    bool insertIfAbsent(uint64_t key, int64_t nowMs) {
+        rotate(nowMs);
+        if (key == 0)
+            key = 1;
+        if (find(key))
+            return false;
+        size_t cur = epoch % cols;
+        if ((fill[cur] + 1) * 4 > capacity * 3)
+            grow();
+        place(slots, capacity - 1, cur, key);
+        ++fill[cur];
+        return true;
+    }
+
+    // Seen within the window, without recording it.
+    bool contains(uint64_t key, int64_t nowMs) {
+        rotate(nowMs);
+        return find(key ? key : 1);
+    }
+
+    uint64_t growthCount() const { return growths; }
+};
+
+uint64_t idempotencyHash(string_view key) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a, then a final mix
+    for (unsigned char c : key)
+        h = (h ^ c) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Drops repeats of the same notification inside the window. Upstream
+// events pass their own key to notifyOnce(); plain notify() keys on
+// scope + user, e.g. at most one welcome mail per address per window.
+class DedupNotifier : public INotifier {
+private:
+    INotifier* inner;
+    SlidingWindowSet* seen;
+    string scope;
+    uint64_t suppressed{0};
+
+    static int64_t nowMs() {
+        return chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    DedupNotifier(INotifier* n, SlidingWindowSet* s, const string& keyScope)
+        : inner(n), seen(s), scope(keyScope) {}
+
+    void notifyOnce(const User& u, const string& idempotencyKey) {
+        if (!seen->insertIfAbsent(idempotencyHash(scope + "|" + idempotencyKey), nowMs())) {
+            ++suppressed;
+            return;
+        }
+        inner->notify(u);
+    }
+
+    // Addresses differ only in case for the same mailbox, so the email is
+    // lowercased like the uniqueness index does.
+    void notify(const User& u) override {
+        string key = u.email;
+        for (auto& c : key)
+            if (c >= 'A' && c <= 'Z')
+                c = char(c - 'A' + 'a');
+        notifyOnce(u, key + "|" + u.phone);
+    }
+
+    uint64_t suppressedCount() const { return suppressed; }
+};
+
+// ------------------------ Channel Preferences ------------------------
+
+enum PrefFlag : uint32_t {
+    PREF_EMAIL,
+    PREF_SMS,
+    PREF_PUSH,
+    PREF_TRANSACTIONAL,
+    PREF_MARKETING,
+    PREF_REMINDERS,
+    PREF_COUNT
+};
+
+// Opt-ins stored column-wise in a memory-mapped file: one packed bitset
+// per flag, bit `userId` set when the user opted in. A campaign audience
+// is the AND of a few columns, computed 128 bits at a time, instead of a
+// lookup per user.
+class PreferenceStore {
+private:
+    struct Header {
+        uint64_t magic;
+        uint64_t capacity;  // users, multiple of 128
+    };
+    static const uint64_t MAGIC = 0x31666572506e746eULL;
+
+    int fd{-1};
+    void* base{nullptr};
+    size_t mapped{0};
+    uint64_t capacity{0};
+
+    uint64_t* column(PrefFlag f) const {
+        return (uint64_t*)((char*)base + sizeof(Header)) + f * (capacity / 64);
+    }
+
+    static uint64_t fileBytes(uint64_t users) { return sizeof(Header) + PREF_COUNT * users / 8; }
+
+    // Copies every column into a file laid out for `users` and swaps it
+    // in (tmp + rename), so a crash leaves one layout or the other intact.
+    bool grow(const string& path, uint64_t oldCapacity, uint64_t users) {
+        string tmp = path + ".grow";
+        int out = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out < 0)
+            return false;
+        Header h{MAGIC, users};
+        bool ok = ::ftruncate(out, fileBytes(users)) == 0 &&
+                  ::pwrite(out, &h, sizeof(h), 0) == sizeof(h);
+        string col(oldCapacity / 8, '\0');
+        for (uint32_t f = 0; ok && f < PREF_COUNT; ++f)
+            ok = ::pread(fd, &col[0], col.size(), sizeof(Header) + f * oldCapacity / 8) ==
+                     (ssize_t)col.size() &&
+                 ::pwrite(out, col.data(), col.size(), sizeof(Header) + f * users / 8) ==
+                     (ssize_t)col.size();
+        if (!ok || ::fsync(out) != 0 || ::rename(tmp.c_str(), path.c_str()) != 0) {
+            ::close(out);
+            ::unlink(tmp.c_str());
+            return false;
+        }
+        ::close(fd);
+        fd = out;
+        return true;
+    }
+
+public:
+    // Opens or creates the file with room for at least `users` (an older,
+    // smaller file is grown). A file shorter than its header says is
+    // refused rather than mapped: touching the missing pages would SIGBUS.
+    PreferenceStore(const string& path, uint64_t users) {
+        uint64_t want = (users + 127) / 128 * 128;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            perror(path.c_str());
+            return;
+        }
+        struct stat st;
+        Header h{0, 0};
+        if (::fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header) &&
+            ::pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == MAGIC) {
+            if (h.capacity % 128 || h.capacity > (uint64_t(1) << 32) ||
+                (uint64_t)st.st_size < fileBytes(h.capacity)) {
+                cerr << "[Prefs] " << path << " is truncated or corrupt (" << st.st_size
+                     << " bytes for " << h.capacity << " users); not opening it\n";
+                return;
+            }
+            capacity = h.capacity;
+            if (capacity < want) {
+                if (!grow(path, capacity, want)) {
+                    cerr << "[Prefs] could not grow " << path << " to " << want << " users\n";
+                    capacity = 0;
+                    return;
+                }
+                capacity = want;
+            }
+        } else {
+            capacity = want;
+            h = {MAGIC, capacity};
+            if (::ftruncate(fd, fileBytes(capacity)) != 0 ||
+                ::pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+                capacity = 0;
+        }
+        mapped = fileBytes(capacity);
+        base = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            capacity = 0;
+        }
+    }
+
+    ~PreferenceStore() {
+        if (base)
+            ::munmap(base, mapped);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    PreferenceStore(const PreferenceStore&) = delete;
+    PreferenceStore& operator=(const PreferenceStore&) = delete;
+
+    uint64_t size() const { return capacity; }
+
+    // False when userId is beyond the store (open it with more users).
+    bool set(uint32_t userId, PrefFlag f, bool on) {
+        if (userId >= capacity) {
+            cerr << "[Prefs] user " << userId << " is beyond capacity " << capacity << "\n";
+            return false;
+        }
+        uint64_t& w = column(f)[userId / 64];
+        uint64_t bit = uint64_t(1) << (userId % 64);
+        w = on ? (w | bit) : (w & ~bit);
+        return true;
+    }
+
+    bool get(uint32_t userId, PrefFlag f) const {
+        return userId < capacity &&
+               (column(f)[userId / 64] >> (userId % 64) & 1);
+    }
+
+    // Appends ids of users opted into every flag in `required`.
+    size_t select(const vector<PrefFlag>& required, vector<uint32_t>& ids) const {
+        if (required.empty() || capacity == 0)
+            return 0;
+        size_t words = capacity / 64;
+        vector<uint64_t> acc(column(required[0]), column(required[0]) + words);
+        for (size_t r = 1; r < required.size(); ++r) {
+            const uint64_t* col = column(required[r]);
+            size_t i = 0;
+#if defined(__SSE2__)
+            for (; i + 2 <= words; i += 2) {
+                __m128i a = _mm_loadu_si128((const __m128i*)&acc[i]);
+                __m128i b = _mm_loadu_si128((const __m128i*)&col[i]);
+                _mm_storeu_si128((__m128i*)&acc[i], _mm_and_si128(a, b));
+            }
+#endif
+            for (; i < words; ++i)
+                acc[i] &= col[i];
+        }
+
+        size_t before = ids.size();
+        for (size_t i = 0; i < words; ++i)
+            for (uint64_t w = acc[i]; w; w &= w - 1)
+                ids.push_back(uint32_t(i * 64 + __builtin_ctzll(w)));
+        return ids.size() - before;
+    }
+
+    void sync() {
+        if (base)
+            ::msync(base, mapped, MS_SYNC);
+    }
+};
+
+// Forwards to `inner` only when the user opted into all `required` flags.
+// Users without an id (0) have no stored opt-ins, so they are dropped
+// unless every required flag is PREF_TRANSACTIONAL (mail the user cannot
+// opt out of).
+class OptInNotifier : public INotifier {
+private:
+    INotifier* inner;
+    const PreferenceStore* prefs;
+    vector<PrefFlag> required;
+public:
+    OptInNotifier(INotifier* n, const PreferenceStore* p, vector<PrefFlag> flags)
+        : inner(n), prefs(p), required(move(flags)) {}
+
+    void notify(const User& u) override {
+        for (auto f : required)
+            if (u.id == 0 ? f != PREF_TRANSACTIONAL : !prefs->get(u.id, f))
+                return;
+        inner->notify(u);
+    }
+};
+
+// ------------------------ Multi-tenant Dispatch ------------------------
+
+struct TenantConfig {
+    string id;
+    size_t quantum{1};        // DRR weight: notifications per round
+    double ratePerSec{100};   // quota refill rate
+    double burst{100};        // quota bucket size
+    size_t maxQueue{10000};   // back-pressure limit
+};
+
+struct TenantMetrics {
+    uint64_t enqueued{0};
+    uint64_t delivered{0};
+    uint64_t rejectedQuota{0};
+    uint64_t rejectedQueueFull{0};
+    size_t queueDepth{0};
+    double maxQueueDelayMs{0};
+};
+
+// Per-tenant queues drained by deficit round robin. Each tenant owns its
+// notifier stack (and therefore its provider credentials), its token
+// bucket quota and its metrics, so a tenant flooding its queue only delays
+// itself: every other tenant still gets `quantum` sends per round.
+class TenantDispatcher {
+private:
+    using Clock = chrono::steady_clock;
+
+    struct Pending {
+        User user;
+        Clock::time_point enqueuedAt;
+    };
+
+    struct Tenant {
+        TenantConfig cfg;
+        INotifier* notifier;
+        deque<Pending> queue;
+        size_t deficit{0};
+        double tokens;
+        Clock::time_point refilledAt;
+        TenantMetrics metrics;
+    };
+
+    vector<Tenant> tenants;
+    unordered_map<string, size_t> byId;
+    size_t cursor{0};
+
+    bool takeToken(Tenant& t) {
+        auto now = Clock::now();
+        double dt = chrono::duration<double>(now - t.refilledAt).count();
+        t.refilledAt = now;
+        t.tokens = min(t.cfg.burst, t.tokens + dt * t.cfg.ratePerSec);
+        if (t.tokens < 1.0)
+            return false;
+        t.tokens -= 1.0;
+        return true;
+    }
+
+public:
+    void addTenant(const TenantConfig& cfg, INotifier* notifier) {
+        byId[cfg.id] = tenants.size();
+        tenants.push_back({cfg, notifier, {}, 0, cfg.burst, Clock::now(), {}});
+    }
+
+    // Admits a notification for the tenant, or returns false when the
+    // tenant is unknown, over quota, or its queue is full.
+    bool enqueue(const string& tenantId, const User& u) {
+        auto it = byId.find(tenantId);
+        if (it == byId.end())
+            return false;
+        Tenant& t = tenants[it->second];
+        if (t.queue.size() >= t.cfg.maxQueue) {
+            ++t.metrics.rejectedQueueFull;
+            return false;
+        }
+        if (!takeToken(t)) {
+            ++t.metrics.rejectedQuota;
+            return false;
+        }
+        t.queue.push_back({u, Clock::now()});
+        ++t.metrics.enqueued;
+        return true;
+    }
+
+    // Runs DRR rounds until `budget` notifications were sent or every
+    // queue is empty. Returns the number sent.
+    size_t dispatch(size_t budget) {
+        size_t sent = 0;
+        while (sent < budget) {
+            bool any = false;
+            for (size_t k = 0; k < tenants.size() && sent < budget; ++k) {
+                Tenant& t = tenants[(cursor + k) % tenants.size()];
+                if (t.queue.empty()) {
+                    t.deficit = 0;  // idle tenants don't bank credit
+                    continue;
+                }
+                any = true;
+                t.deficit += t.cfg.quantum;
+                while (t.deficit > 0 && !t.queue.empty() && sent < budget) {
+                    Pending p = move(t.queue.front());
+                    t.queue.pop_front();
+                    double ms = chrono::duration<double, milli>(
+                        Clock::now() - p.enqueuedAt).count();
+                    t.metrics.maxQueueDelayMs = max(t.metrics.maxQueueDelayMs, ms);
+                    t.notifier->notify(p.user);
+                    ++t.metrics.delivered;
+                    --t.deficit;
+                    ++sent;
+                }
+            }
+            if (!any)
+                break;
+            cursor = (cursor + 1) % tenants.size();
+        }
+        return sent;
+    }
+
+    TenantMetrics metrics(const string& tenantId) const {
+        auto it = byId.find(tenantId);
+        if (it == byId.end())
+            return {};
+        TenantMetrics m = tenants[it->second].metrics;
+        m.queueDepth = tenants[it->second].queue.size();
+        return m;
+    }
+
+    void printMetrics(ostream& out) const {
+        for (auto& t : tenants)
+            out << "[tenant " << t.cfg.id << "]"
+                << " enqueued=" << t.metrics.enqueued
+                << " delivered=" << t.metrics.delivered
+                << " rejectedQuota=" << t.metrics.rejectedQuota
+                << " rejectedQueueFull=" << t.metrics.rejectedQueueFull
+                << " queued=" << t.queue.size()
+                << " maxDelayMs=" << t.metrics.maxQueueDelayMs << "\n";
+    }
+};
+
+// INotifier facade that routes into a tenant's queue, so SignUpService
+// stays unaware of tenancy.
+class TenantNotifier : public INotifier {
+private:
+    TenantDispatcher* dispatcher;
+    string tenantId;
+public:
+    TenantNotifier(TenantDispatcher* d, const string& id)
+        : dispatcher(d), tenantId(id) {}
+
+    void notify(const User& u) override {
+        dispatcher->enqueue(tenantId, u);
+    }
+};
+
+// ------------------------ Scheduled Notifications ------------------------
+
+// Next occurrence of `hour`:00 local time for a user at UTC+offsetMinutes.
+int64_t nextLocalTime(int64_t nowUtc, int offsetMinutes, int hour) {
+    const int64_t day = 86400;
+    int64_t local = nowUtc + offsetMinutes * 60;
+    int64_t target = local - local % day + hour * 3600;
+    if (target <= local)
+        target += day;
+    return target - offsetMinutes * 60;
+}
+
+// Hierarchical timing wheel (4 levels x 64 one-second slots, ~194 days of
+// range) over a slab of entries linked through their slot lists: insert
+// and expire are O(1), higher levels cascade down as the wheel turns.
+// Every schedule/fire/cancel is appended to a log that is replayed on
+// startup, so pending notifications survive a crash (at-least-once: a
+// batch fired but not yet logged is fired again). Records are an op byte
+// and a varint-length payload, so user fields may hold any bytes; a torn
+// tail is cut off on recovery. Schedules are synced every `syncEvery`
+// records, which bounds what a crash can lose.
+class NotificationScheduler {
+private:
+    static const int LEVELS = 4;
+    static const int BITS = 6;
+    static const int SLOTS = 1 << BITS;
+
+    struct Entry {
+        uint64_t id;
+        int64_t due;
+        string kind;
+        User user;
+        int32_t next;
+    };
+
+    vector<Entry> slab;
+    vector<int32_t> freeSlots;
+    int32_t heads[LEVELS][SLOTS];
+    vector<int32_t> overflow;  // beyond the wheel's range
+    vector<int32_t> ready;     // due at or before `current`
+    unordered_map<uint64_t, int32_t> byId;
+    unordered_map<string, INotifier*> notifiers;
+    int64_t current;
+    uint64_t nextId{1};
+    size_t live{0};
+    string logPath;
+    FILE* log{nullptr};
+    size_t batchSize;
+    size_t syncEvery;
+    size_t unsynced{0};
+
+    void place(int32_t idx) {
+        int64_t due = slab[idx].due;
+        if (due <= current) {
+            ready.push_back(idx);
+            return;
+        }
+        for (int l = 0; l < LEVELS; ++l) {
+            int shift = BITS * (l + 1);
+            if ((due >> shift) == (current >> shift)) {
+                int32_t& head = heads[l][(due >> (BITS * l)) & (SLOTS - 1)];
+                slab[idx].next = head;
+                head = idx;
+                return;
+            }
+        }
+        overflow.push_back(idx);
+    }
+
+    void cascade(int level, int slot) {
+        int32_t idx = heads[level][slot];
+        heads[level][slot] = -1;
+        while (idx >= 0) {
+            int32_t next = slab[idx].next;
+            place(idx);
+            idx = next;
+        }
+    }
+
+    int32_t store(uint64_t id, int64_t due, const string& kind, const User& u) {
+        int32_t idx;
+        if (!freeSlots.empty()) {
+            idx = freeSlots.back();
+            freeSlots.pop_back();
+            slab[idx] = {id, due, kind, u, -1};
+        } else {
+            idx = (int32_t)slab.size();
+            slab.push_back({id, due, kind, u, -1});
+        }
+        byId[id] = idx;
+        ++live;
+        return idx;
+    }
+
+    void append(char op, const Entry& e) {
+        if (!log)
+            return;
+        string payload;
+        audit::putVarint(payload, op == 'N' ? nextId : e.id);
+        if (op == 'S') {
+            audit::putVarint(payload, audit::zigzag(e.due));
+            for (const string* s : {&e.kind, &e.user.email, &e.user.phone, &e.user.deviceToken}) {
+                audit::putVarint(payload, s->size());
+                payload += *s;
+            }
+            audit::putVarint(payload, e.user.id);
+        }
+        string rec(1, op);
+        audit::putVarint(rec, payload.size());
+        rec += payload;
+        fwrite(rec.data(), 1, rec.size(), log);
+        if (++unsynced >= syncEvery)
+            sync();
+    }
+
+    void recover() {
+        FILE* in = fopen(logPath.c_str(), "r");
+        if (!in)
+            return;
+        string data;
+        char chunk[1 << 16];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+            data.append(chunk, n);
+        fclose(in);
+
+        unordered_map<uint64_t, Entry> pending;
+        size_t good = 0;
+        for (size_t i = 0; i < data.size(); good = i) {
+            char op = data[i++];
+            uint64_t len, id;
+            if (!audit::getVarint(data, i, len) || len > data.size() - i)
+                break;
+            string payload = data.substr(i, len);
+            i += len;
+            size_t k = 0;
+            if (!audit::getVarint(payload, k, id))
+                break;
+            if (op == 'S') {
+                uint64_t due, uid;
+                string s[4];
+                bool ok = audit::getVarint(payload, k, due);
+                for (auto& str : s) {
+                    uint64_t sl;
+                    ok = ok && audit::getVarint(payload, k, sl) && sl <= payload.size() - k;
+                    if (ok) {
+                        str.assign(payload, k, sl);
+                        k += sl;
+                    }
+                }
+                if (!ok || !audit::getVarint(payload, k, uid))
+                    break;
+                pending.emplace(id, Entry{id, audit::unzigzag(due), s[0],
+                                          User(s[1], s[2], s[3], (uint32_t)uid), -1});
+                nextId = max(nextId, id + 1);
+            } else if (op == 'F' || op == 'C') {
+                pending.erase(id);
+                nextId = max(nextId, id + 1);
+            } else if (op == 'N') {  // high-water mark kept across compaction
+                nextId = max(nextId, id);
+            } else {
+                break;
+            }
+        }
+        // A torn tail from a crash mid-write is cut off.
+        if (good < data.size() && truncate(logPath.c_str(), good) != 0)
+            perror("notification log");
+
+        for (auto& kv : pending)
+            place(store(kv.first, kv.second.due, kv.second.kind, kv.second.user));
+    }
+
+public:
+    NotificationScheduler(const string& path, int64_t nowSec, size_t batch = 1024,
+                          size_t syncEveryRecords = 64)
+        : current(nowSec), logPath(path), batchSize(batch),
+          syncEvery(max<size_t>(1, syncEveryRecords)) {
+        for (auto& level : heads)
+            for (auto& h : level)
+                h = -1;
+        recover();
+        log = fopen(logPath.c_str(), "a");
+    }
+
+    ~NotificationScheduler() {
+        if (log) {
+            sync();
+            fclose(log);
+        }
+    }
+
+    void registerKind(const string& kind, INotifier* n) { notifiers[kind] = n; }
+
+    uint64_t scheduleAt(int64_t dueSec, const string& kind, const User& u) {
+        int32_t idx = store(nextId++, dueSec, kind, u);
+        append('S', slab[idx]);
+        place(idx);
+        return slab[idx].id;
+    }
+
+    uint64_t scheduleIn(int64_t delaySec, const string& kind, const User& u) {
+        return scheduleAt(current + delaySec, kind, u);
+    }
+
+    // Removal from the slot list is lazy: the entry is dropped from the
+    // index now and skipped when its slot expires.
+    bool cancel(uint64_t id) {
+        auto it = byId.find(id);
+        if (it == byId.end())
+            return false;
+        append('C', slab[it->second]);
+        byId.erase(it);
+        --live;
+        return true;
+    }
+
+    // Makes every logged record durable now (appends sync on their own
+    // every `syncEvery` records).
+    void sync() {
+        unsynced = 0;
+        if (log) {
+            fflush(log);
+            fdatasync(fileno(log));
+        }
+    }
+
+    // Turns the wheel to `nowSec`, firing due notifications in batches of
+    // `batchSize`; each batch is logged and synced as one write. Returns
+    // the number fired.
+    size_t advance(int64_t nowSec) {
+        vector<int32_t> batch;
+        size_t fired = 0;
+
+        // A notifier may call scheduleAt() (e.g. a DelayedNotifier), which
+        // can grow `slab` and `ready`: notify a copy of the user, and walk
+        // a detached `ready` so new due entries wait for the next pass.
+        auto flush = [&]() {
+            for (int32_t idx : batch) {
+                auto n = notifiers.find(slab[idx].kind);
+                if (n != notifiers.end()) {
+                    User u = slab[idx].user;
+                    n->second->notify(u);
+                }
+                append('F', slab[idx]);
+            }
+            sync();
+            for (int32_t idx : batch) {
+                slab[idx].user = User("", "");
+                freeSlots.push_back(idx);
+            }
+            fired += batch.size();
+            batch.clear();
+        };
+
+        auto take = [&](int32_t idx) {
+            auto it = byId.find(slab[idx].id);
+            if (it == byId.end() || it->second != idx) {  // cancelled
+                freeSlots.push_back(idx);
+                return;
+            }
+            byId.erase(it);
+            --live;
+            batch.push_back(idx);
+            if (batch.size() >= batchSize)
+                flush();
+        };
+
+        auto takeReady = [&]() {
+            vector<int32_t> due;
+            due.swap(ready);
+            for (int32_t idx : due)
+                take(idx);
+        };
+
+        takeReady();
+        while (current < nowSec) {
+            if (live == 0 && ready.empty()) {  // nothing pending: jump
+                current = nowSec;
+                break;
+            }
+            ++current;
+            if ((current & ((int64_t(1) << (BITS * LEVELS)) - 1)) == 0) {
+                vector<int32_t> far;
+                far.swap(overflow);
+                for (int32_t idx : far)
+                    place(idx);
+            }
+            for (int l = LEVELS - 1; l >= 1; --l)
+                if ((current & ((int64_t(1) << (BITS * l)) - 1)) == 0)
+                    cascade(l, (current >> (BITS * l)) & (SLOTS - 1));
+
+            int32_t idx = heads[0][current & (SLOTS - 1)];
+            heads[0][current & (SLOTS - 1)] = -1;
+            while (idx >= 0) {
+                int32_t next = slab[idx].next;
+                take(idx);
+                idx = next;
+            }
+            takeReady();
+        }
+        if (!batch.empty())
+            flush();
+        return fired;
+    }
+
+    // Rewrites the log with only pending entries.
+    void compact() {
+        string tmp = logPath + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "w");
+        if (!out)
+            return;
+        sync();
+        swap(out, log);
+        append('N', Entry{0, 0, "", User("", ""), -1});
+        for (auto& kv : byId)
+            append('S', slab[kv.second]);
+        swap(out, log);
+        unsynced = 0;
+        fflush(out);
+        fsync(fileno(out));
+        fclose(out);
+        if (rename(tmp.c_str(), logPath.c_str()) == 0) {
+            if (log)
+                fclose(log);
+            log = fopen(logPath.c_str(), "a");
+        }
+    }
+
+    size_t pending() const { return live; }
+};
+
+// Schedules a follow-up instead of sending now, e.g. a 24h reminder.
+class DelayedNotifier : public INotifier {
+private:
+    NotificationScheduler* scheduler;
+    string kind;
+    int64_t delaySec;
+public:
+    DelayedNotifier(NotificationScheduler* s, const string& k, int64_t delay)
+        : scheduler(s), kind(k), delaySec(delay) {}
+
+    // Durable within the scheduler's sync batch, not per call.
+    void notify(const User& u) override {
+        scheduler->scheduleIn(delaySec, kind, u);
+    }
+};
+
+// ------------------------ Invoice Events ------------------------
+
+// Delivers invoices published by billing (01) through this program's
+// email stack, so they get the same signing, auditing and provider
+// sessions as every other mail. Each poll takes what the token bucket
+// allows, skips event ids delivered within the last hour (kept in a
+// DeliveredLog, so a restart does not repeat them), sends one
+// sendMessages() batch per recipient domain, retries whatever the relay
+// refused with backoff, and commits the spool cursor once all of it is
+// delivered. Invoices still refused after the last attempt stall the
+// relay with the cursor before them; the next run sends them again.
+class InvoiceEventRelay {
+public:
+    static constexpr int64_t kWindowMs = 3600 * 1000;
+
+private:
+    using Clock = chrono::steady_clock;
+
+    events::InvoiceEventReader* reader;
+    IEmailService* mailer;
+    events::DeliveredLog* log;
+    string from;
+    SlidingWindowSet seen;
+    double ratePerSec;
+    double burst;
+    double tokens;
+    Clock::time_point refilledAt;
+    size_t batch;
+    int attempts;
+    chrono::milliseconds backoff;
+    uint64_t delivered{0};
+    uint64_t duplicates{0};
+    uint64_t failed{0};
+    bool caughtUp{false};
+    bool stalled{false};
+
+    // One round per copy of a recipient, so each refusal names one
+    // message. Returns the invoices the relay refused.
+    vector<events::InvoiceIssued> send(vector<events::InvoiceIssued> rest) {
+        vector<events::InvoiceIssued> refusedOut;
+        while (!rest.empty()) {
+            vector<events::InvoiceIssued> round, later;
+            unordered_set<string> rcpts;
+            for (auto& inv : rest)
+                (rcpts.insert(inv.email).second ? round : later).push_back(move(inv));
+            auto domain = [](const string& email) {
+                return string_view(email).substr(email.find('@') + 1);
+            };
+            stable_sort(round.begin(), round.end(), [&](const auto& a, const auto& b) {
+                return domain(a.email) < domain(b.email);
+            });
+            for (size_t i = 0; i < round.size();) {
+                vector<MailMessage> msgs;
+                size_t j = i;
+                for (; j < round.size() && domain(round[j].email) == domain(round[i].email); ++j)
+                    msgs.push_back({from, round[j].email, "invoice", round[j].content, {}});
+                mailer->sendMessages(msgs);
+                i = j;
+            }
+
+            vector<string> no = mailer->settle();
+            unordered_multiset<string> refused(no.begin(), no.end());
+            int64_t now = wallClockMs();
+            for (auto& inv : round) {
+                auto it = refused.find(inv.email);
+                if (it != refused.end()) {
+                    refused.erase(it);
+                    refusedOut.push_back(move(inv));
+                    continue;
+                }
+                seen.insertIfAbsent(inv.id, now);
+                if (log)
+                    log->add(now, inv.id);
+                ++delivered;
+            }
+            rest = move(later);
+        }
+        return refusedOut;
+    }
+
+public:
+    InvoiceEventRelay(events::InvoiceEventReader* r, IEmailService* m, const string& sender,
+                      events::DeliveredLog* deliveredIds = nullptr, double rate = 1000,
+                      double burstSize = 200, size_t maxBatch = 256, int maxAttempts = 4,
+                      chrono::milliseconds retryDelay = chrono::milliseconds(100))
+        : reader(r), mailer(m), log(deliveredIds), from(sender), seen(kWindowMs, 4, 1 << 16),
+          ratePerSec(rate), burst(burstSize), tokens(burstSize), refilledAt(Clock::now()),
+          batch(maxBatch), attempts(max(1, maxAttempts)), backoff(retryDelay) {
+        if (log)
+            for (auto& e : log->entries())
+                seen.insertIfAbsent(e.second, e.first);
+    }
+
+    // Returns the number of invoices sent; 0 with caughtUp() false means
+    // the rate limit is holding the rest back.
+    size_t poll() {
+        TRACE_SPAN("InvoiceEventRelay::poll", "notify");
+        ALLOC_SCOPE("notify.invoices");
+        auto now = Clock::now();
+        tokens = min(burst, tokens + chrono::duration<double>(now - refilledAt).count() *
+                                         ratePerSec);
+        refilledAt = now;
+
+        vector<events::InvoiceIssued> out;
+        unordered_set<uint64_t> inBatch;
+        events::InvoiceIssued e;
+        int64_t nowMs = wallClockMs();
+        caughtUp = false;
+        while (out.size() < min<double>(batch, tokens)) {
+            if (!reader->next(e)) {
+                caughtUp = true;
+                break;
+            }
+            if (seen.contains(e.id, nowMs) || !inBatch.insert(e.id).second)
+                ++duplicates;
+            else
+                out.push_back(move(e));
+        }
+
+        size_t sent = 0, before = delivered;
+        for (int attempt = 0; !out.empty() && attempt < attempts; ++attempt) {
+            if (attempt > 0)
+                this_thread::sleep_for(backoff * (1 << (attempt - 1)));
+            sent += out.size();
+            out = send(move(out));
+        }
+        tokens -= sent;
+
+        bool durable = !log || log->sync(wallClockMs());
+        if (out.empty() && durable) {
+            reader->commit();
+        } else {
+            // Delivered ones are in the dedup set; the rest are read again.
+            failed += out.size();
+            stalled = true;
+            reader->rewind();
+            cout << "[Invoices] " << out.size() << " refused after " << attempts
+                 << " attempts" << (durable ? "" : ", delivery log not synced")
+                 << "; cursor kept before them\n";
+        }
+        return delivered - before;
+    }
+
+    // Polls until the spool is drained (or stalled), sleeping while rate
+    // limited.
+    void drain() {
+        while (!stalled) {
+            size_t n = poll();
+            if (n == 0 && caughtUp)
+                return;
+            if (n == 0)
+                this_thread::sleep_for(chrono::milliseconds(5));
+        }
+    }
+
+    bool isStalled() const { return stalled; }
+    uint64_t failedCount() const { return failed; }
+    uint64_t deliveredCount() const { return delivered; }
+    uint64_t duplicateCount() const { return duplicates; }
+};
+
+// ------------------------ User Store ------------------------
+
+class IUserStore {
+public:
+    // Returns once the user is durable; false on I/O failure.
+    virtual bool put(const User& u) = 0;
+    virtual bool get(const string& email, User& out) = 0;
+    // Visits every stored user (latest record per email).
+    virtual void forEach(const function<void(const User&)>& fn) = 0;
+    virtual ~IUserStore() = default;
+};
+
+// Embedded append-only store: one "email\tphone\tdevice\tid\n" record per
+// put (records written before ids existed lack the last field), an in-memory hash index email -> (offset, length), and a writer
+// thread doing group commit: every put queued while the previous fsync
+// ran goes out in a single write + fdatasync. Overwritten records become
+// garbage; a compaction thread rewrites the file once garbage outweighs
+// live data.
+class AppendOnlyUserStore : public IUserStore {
+private:
+    struct Loc {
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    struct Staged {
+        string email;
+        uint64_t relOffset;  // within the batch buffer
+        uint32_t length;
+    };
+
+    string path;
+    int fd{-1};
+    uint64_t fileSize{0};
+    uint64_t liveBytes{0};
+
+    mutex ioMu;  // file descriptor and on-disk layout; taken before mu
+    mutex mu;    // buffer, index and sequence numbers
+    condition_variable workCv;
+    condition_variable durableCv;
+    condition_variable compactCv;
+
+    string buffer;
+    vector<Staged> staged;
+    unordered_map<string, Loc> index;
+    uint64_t queuedSeq{0};
+    uint64_t durableSeq{0};
+    bool failed{false};
+    bool stopping{false};
+    bool compactWanted{false};
+
+    thread writer;
+    thread compactor;
+    atomic<uint64_t> commits{0};
+
+    void recover() {
+        string data;
+        char chunk[1 << 16];
+        ssize_t n;
+        while ((n = ::pread(fd, chunk, sizeof(chunk), data.size())) > 0)
+            data.append(chunk, n);
+
+        size_t start = 0;
+        for (size_t nl; (nl = data.find('\n', start)) != string::npos; start = nl + 1) {
+            size_t tab = data.find('\t', start);
+            if (tab == string::npos || tab > nl)
+                continue;
+            string email = data.substr(start, tab - start);
+            auto it = index.find(email);
+            if (it != index.end())
+                liveBytes -= it->second.length;
+            index[email] = {start, uint32_t(nl + 1 - start)};
+            liveBytes += nl + 1 - start;
+        }
+        // A torn tail from a crash mid-write is cut off.
+        fileSize = start;
+        if (ftruncate(fd, fileSize) != 0)
+            failed = true;
+    }
+
+    void writerLoop() {
+        unique_lock<mutex> lk(mu);
+        while (true) {
+            workCv.wait(lk, [&] { return stopping || !buffer.empty(); });
+            if (buffer.empty() && stopping)
+                return;
+
+            string out;
+            vector<Staged> batch;
+            out.swap(buffer);
+            batch.swap(staged);
+            uint64_t seq = queuedSeq;
+            lk.unlock();
+
+            bool ok;
+            {
+                lock_guard<mutex> io(ioMu);
+                uint64_t base = fileSize;
+                ok = ::pwrite(fd, out.data(), out.size(), base) == (ssize_t)out.size() &&
+                     ::fdatasync(fd) == 0;
+                if (ok)
+                    fileSize += out.size();
+
+                lock_guard<mutex> g(mu);
+                if (ok) {
+                    for (auto& s : batch) {
+                        auto it = index.find(s.email);
+                        if (it != index.end())
+                            liveBytes -= it->second.length;
+                        index[s.email] = {base + s.relOffset, s.length};
+                        liveBytes += s.length;
+                    }
+                    if (fileSize > (1u << 20) && fileSize > 2 * liveBytes) {
+                        compactWanted = true;
+                        compactCv.notify_one();
+                    }
+                } else {
+                    failed = true;
+                }
+                durableSeq = seq;
+            }
+            commits.fetch_add(1, memory_order_relaxed);
+            durableCv.notify_all();
+            lk.lock();
+        }
+    }
+
+    // "email\tphone\tdevice\tid\n" -> User; id 0 for old 3-field records
+    static User parse(const string& rec) {
+        size_t t1 = rec.find('\t');
+        size_t t2 = rec.find('\t', t1 + 1);
+        size_t end = rec.size() - 1;  // the newline
+        size_t t3 = rec.find('\t', t2 + 1);
+        uint32_t id = 0;
+        if (t3 != string::npos && t3 < end)
+            id = (uint32_t)strtoul(rec.c_str() + t3 + 1, nullptr, 10);
+        else
+            t3 = end;
+        return User(rec.substr(0, t1), rec.substr(t1 + 1, t2 - t1 - 1),
+                    rec.substr(t2 + 1, t3 - t2 - 1), id);
+    }
+
+    void compactorLoop() {
+        unique_lock<mutex> lk(mu);
+        while (true) {
+            compactCv.wait(lk, [&] { return stopping || compactWanted; });
+            if (stopping)
+                return;
+            compactWanted = false;
+            lk.unlock();
+            compact();
+            lk.lock();
+        }
+    }
+
+public:
+    AppendOnlyUserStore(const string& file) : path(file) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            failed = true;
+        else
+            recover();
+        writer = thread([this] { writerLoop(); });
+        compactor = thread([this] { compactorLoop(); });
+    }
+
+    ~AppendOnlyUserStore() {
+        {
+            lock_guard<mutex> g(mu);
+            stopping = true;
+        }
+        workCv.notify_all();
+        compactCv.notify_all();
+        writer.join();
+        compactor.join();
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    bool put(const User& u) override {
+        string rec = u.email + "\t" + u.phone + "\t" + u.deviceToken + "\t" + to_string(u.id) + "\n";
+        unique_lock<mutex> lk(mu);
+        if (failed)
+            return false;
+        staged.push_back({u.email, buffer.size(), (uint32_t)rec.size()});
+        buffer += rec;
+        uint64_t seq = ++queuedSeq;
+        workCv.notify_one();
+        durableCv.wait(lk, [&] { return durableSeq >= seq; });
+        return !failed;
+    }
+
+    bool get(const string& email, User& out) override {
+        lock_guard<mutex> io(ioMu);
+        Loc loc;
+        {
+            lock_guard<mutex> g(mu);
+            auto it = index.find(email);
+            if (it == index.end())
+                return false;
+            loc = it->second;
+        }
+        string rec(loc.length, '\0');
+        if (::pread(fd, &rec[0], loc.length, loc.offset) != (ssize_t)loc.length)
+            return false;
+        out = parse(rec);
+        return true;
+    }
+
+    // One sequential read of the file, then the live record of each email.
+    void forEach(const function<void(const User&)>& fn) override {
+        string data;
+        vector<Loc> live;
+        {
+            lock_guard<mutex> io(ioMu);
+            {
+                lock_guard<mutex> g(mu);
+                for (auto& kv : index)
+                    live.push_back(kv.second);
+            }
+            data.resize(fileSize);
+            if (fileSize && ::pread(fd, &data[0], fileSize, 0) != (ssize_t)fileSize)
+                return;
+        }
+        for (auto& loc : live)
+            fn(parse(data.substr(loc.offset, loc.length)));
+    }
+
+    // Copies live records into a fresh file and swaps it in. Writers
+    // queue up behind ioMu meanwhile; readers see either layout intact.
+    void compact() {
+        lock_guard<mutex> io(ioMu);
+        vector<pair<string, Loc>> live;
+        {
+            lock_guard<mutex> g(mu);
+            live.assign(index.begin(), index.end());
+        }
+
+        string tmp = path + ".compact";
+        int out = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out < 0)
+            return;
+        string data;
+        unordered_map<string, Loc> fresh;
+        for (auto& kv : live) {
+            string rec(kv.second.length, '\0');
+            if (::pread(fd, &rec[0], rec.size(), kv.second.offset) != (ssize_t)rec.size()) {
+                ::close(out);
+                ::unlink(tmp.c_str());
+                return;
+            }
+            fresh[kv.first] = {data.size(), kv.second.length};
+            data += rec;
+        }
+        if (::pwrite(out, data.data(), data.size(), 0) != (ssize_t)data.size() ||
+            ::fsync(out) != 0 || ::rename(tmp.c_str(), path.c_str()) != 0) {
+            ::close(out);
+            ::unlink(tmp.c_str());
+            return;
+        }
+
+        ::close(fd);
+        fd = out;
+        fileSize = data.size();
+        lock_guard<mutex> g(mu);
+        index.swap(fresh);
+        liveBytes = fileSize;
+    }
+
+    size_t size() {
+        lock_guard<mutex> g(mu);
+        return index.size();
+    }
+
+    uint64_t groupCommits() const { return commits.load(); }
+};
+
+// ------------------------ Uniqueness Index ------------------------
+
+// Hash set split into cache-line-aligned stripes, each with its own lock,
+// so concurrent inserts only contend when they hash to the same stripe.
+// A key is pending from insert() until commit() or erase(): an insert of
+// a pending key waits for the outcome instead of failing, since the
+// holder's claim may still be rolled back.
+class StripedHashSet {
+private:
+    static const size_t STRIPES = 256;
+
+    struct alignas(64) Stripe {
+        mutex mu;
+        condition_variable resolved;
+        unordered_map<string, bool> keys;  // key -> committed
+    };
+
+    Stripe stripes[STRIPES];
+
+    Stripe& stripeFor(const string& key) {
+        return stripes[hash<string>()(key) & (STRIPES - 1)];
+    }
+
+public:
+    // Atomic insert-if-absent: true when this call added the key.
+    bool insert(const string& key, bool committed = false) {
+        Stripe& s = stripeFor(key);
+        unique_lock<mutex> g(s.mu);
+        while (true) {
+            auto it = s.keys.find(key);
+            if (it == s.keys.end()) {
+                s.keys.emplace(key, committed);
+                return true;
+            }
+            if (it->second)
+                return false;
+            s.resolved.wait(g);
+        }
+    }
+
+    void commit(const string& key) {
+        Stripe& s = stripeFor(key);
+        {
+            lock_guard<mutex> g(s.mu);
+            auto it = s.keys.find(key);
+            if (it == s.keys.end() || it->second)
+                return;
+            it->second = true;
+        }
+        s.resolved.notify_all();
+    }
+
+    void erase(const string& key) {
+        Stripe& s = stripeFor(key);
+        {
+            lock_guard<mutex> g(s.mu);
+            s.keys.erase(key);
+        }
+        s.resolved.notify_all();
+    }
+
+    // Visits every committed key, one stripe lock at a time.
+    void forEach(const function<void(const string&)>& fn) {
+        for (auto& s : stripes) {
+            lock_guard<mutex> g(s.mu);
+            for (auto& k : s.keys)
+                if (k.second)
+                    fn(k.first);
+        }
+    }
+};
+
+// Claim set shared by forked processes through a MAP_SHARED region, for
+// keys that must stay unique across shards. Open addressing over 64-bit
+// fingerprints with lock-free CAS; a slot is empty, a pending claim, a
+// committed key, or a tombstone left by a released claim. Slots never
+// return to empty, so every claimant of a key stops at the same slot.
+class SharedClaimTable {
+private:
+    static constexpr uint64_t EMPTY = 0;
+    static constexpr uint64_t TOMBSTONE = 1;  // fingerprints are >= 2, pending sets bit 0
+
+    atomic<uint64_t>* slots{nullptr};
+    size_t mask{0};
+
+    static uint64_t fingerprint(const string& key) { return (idempotencyHash(key) & ~1ULL) | 2; }
+
+    atomic<uint64_t>* find(uint64_t v) {
+        for (size_t i = v & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+            uint64_t s = slots[i].load(memory_order_acquire);
+            if (s == v)
+                return &slots[i];
+            if (s == EMPTY)
+                break;
+        }
+        return nullptr;
+    }
+
+public:
+    enum class Result { Claimed, Duplicate, Unavailable };
+
+    static size_t bytesFor(size_t n) { return n * sizeof(atomic<uint64_t>); }
+
+    SharedClaimTable() = default;
+    // Constructs `n` (a power of two) slots in place at `mem`.
+    SharedClaimTable(void* mem, size_t n) : slots((atomic<uint64_t>*)mem), mask(n - 1) {
+        for (size_t i = 0; i < n; ++i)
+            new (&slots[i]) atomic<uint64_t>(EMPTY);
+    }
+
+    bool attached() const { return slots != nullptr; }
+
+    // Takes `key` as a pending claim. Another process's pending claim is
+    // waited out for up to `patience` (its owner may have died), after
+    // which the key is reported unavailable.
+    Result claim(const string& key, chrono::milliseconds patience = chrono::milliseconds(2000)) {
+        uint64_t f = fingerprint(key);
+        auto deadline = chrono::steady_clock::now() + patience;
+        for (size_t i = f & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+            uint64_t s = slots[i].load(memory_order_acquire);
+            while (s == EMPTY || s == (f | 1)) {
+                if (s == EMPTY) {
+                    if (slots[i].compare_exchange_weak(s, f | 1, memory_order_acq_rel))
+                        return Result::Claimed;
+                    continue;
+                }
+                if (chrono::steady_clock::now() > deadline)
+                    return Result::Unavailable;
+                this_thread::sleep_for(chrono::microseconds(50));
+                s = slots[i].load(memory_order_acquire);
+            }
+            if (s == f)
+                return Result::Duplicate;
+        }
+        return Result::Unavailable;  // table full
+    }
+
+    void commit(const string& key) {
+        uint64_t f = fingerprint(key);
+        if (auto* s = find(f | 1))
+            s->store(f, memory_order_release);
+    }
+
+    void release(const string& key) {
+        if (auto* s = find(fingerprint(key) | 1))
+            s->store(TOMBSTONE, memory_order_release);
+    }
+
+    // Adds an already committed key (startup seeding).
+    void seed(const string& key) {
+        uint64_t f = fingerprint(key);
+        for (size_t i = f & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+            uint64_t s = slots[i].load(memory_order_acquire);
+            while (s == EMPTY && !slots[i].compare_exchange_weak(s, f, memory_order_acq_rel)) {
+            }
+            if (s == EMPTY || s == f || s == (f | 1))
+                return;
+        }
+    }
+};
+
+// Global email/phone uniqueness for concurrent signups. Keys are
+// normalized first (lower-cased email, E.164 phone), so "A@x.com" and
+// "a@x.com" collide. A user is claimed only if both keys are free; a
+// phone clash rolls the email claim back. A claim holds its keys pending
+// until commit() (the user is stored) or release() (it was not), and a
+// concurrent claim on the same keys waits for that rather than failing.
+// Seed it from the store at startup so users from earlier runs count.
+// Sharded workers also share phone claims through a SharedClaimTable,
+// since a user's phone is not tied to the shard their email maps to.
+class UniquenessIndex {
+private:
+    StripedHashSet keys;
+    string defaultCc;
+    SharedClaimTable* sharedPhones{nullptr};
+
+    static string emailKey(const string& email) {
+        string k = "e:" + email;
+        for (auto& c : k)
+            if (c >= 'A' && c <= 'Z')
+                c = char(c - 'A' + 'a');
+        return k;
+    }
+
+    string phoneKey(const string& phone) const {
+        string e164;
+        if (phone.empty() || !normalizeE164(phone, defaultCc, e164))
+            return "";
+        return "p:" + e164;
+    }
+
+public:
+    // Unavailable: a shared phone claim stayed pending too long or the
+    // shared table is full.
+    enum class Claim { Ok, DuplicateEmail, DuplicatePhone, Unavailable };
+
+    UniquenessIndex(const string& cc = "1", SharedClaimTable* phones = nullptr)
+        : defaultCc(cc), sharedPhones(phones) {}
+
+    Claim claim(const User& u) {
+        string ek = emailKey(u.email);
+        if (!keys.insert(ek))
+            return Claim::DuplicateEmail;
+        string pk = phoneKey(u.phone);
+        if (!pk.empty() && !keys.insert(pk)) {
+            keys.erase(ek);
+            return Claim::DuplicatePhone;
+        }
+        if (!pk.empty() && sharedPhones) {
+            auto r = sharedPhones->claim(pk);
+            if (r != SharedClaimTable::Result::Claimed) {
+                keys.erase(pk);
+                keys.erase(ek);
+                return r == SharedClaimTable::Result::Duplicate ? Claim::DuplicatePhone
+                                                                : Claim::Unavailable;
+            }
+        }
+        return Claim::Ok;
+    }
+
+    // Makes a successful claim final.
+    void commit(const User& u) {
+        keys.commit(emailKey(u.email));
+        string pk = phoneKey(u.phone);
+        if (!pk.empty()) {
+            keys.commit(pk);
+            if (sharedPhones)
+                sharedPhones->commit(pk);
+        }
+    }
+
+    // Undoes a successful claim (e.g. the store write failed).
+    void release(const User& u) {
+        keys.erase(emailKey(u.email));
+        string pk = phoneKey(u.phone);
+        if (!pk.empty()) {
+            keys.erase(pk);
+            if (sharedPhones)
+                sharedPhones->release(pk);
+        }
+    }
+
+    // Adds every user already in `store`; returns how many.
+    size_t seed(IUserStore& store) {
+        size_t n = 0;
+        store.forEach([&](const User& u) {
+            keys.insert(emailKey(u.email), true);
+            string pk = phoneKey(u.phone);
+            if (!pk.empty()) {
+                keys.insert(pk, true);
+                if (sharedPhones)
+                    sharedPhones->seed(pk);
+            }
+            ++n;
+        });
+        return n;
+    }
+
+    // Writes all committed keys to `path` atomically (tmp file + rename).
+    bool snapshot(const string& path) {
+        string tmp = path + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "w");
+        if (!out)
+            return false;
+        keys.forEach([&](const string& k) { fprintf(out, "%s\n", k.c_str()); });
+        bool ok = fflush(out) == 0 && fsync(fileno(out)) == 0;
+        fclose(out);
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    bool load(const string& path) {
+        FILE* in = fopen(path.c_str(), "r");
+        if (!in)
+            return false;
+        char line[512];
+        while (fgets(line, sizeof(line), in)) {
+            string k(line);
+            if (!k.empty() && k.back() == '\n')
+                k.pop_back();
+            if (!k.empty())
+                keys.insert(k, true);
+        }
+        fclose(in);
+        return true;
+    }
+};
+
+// ------------------------ Admission Control ------------------------
+
+// Gates a notifier behind an admission controller at a given priority
+// (marketing runs at Low). Shed notifications are deferred rather than
+// lost: flushDeferred() replays them once the controller has recovered.
+class AdmissionNotifier : public INotifier {
+private:
+    INotifier* inner;
+    admission::Controller* gate;
+    admission::Priority prio;
+    size_t maxDeferred;
+    mutex mu;
+    deque<User> deferred;
+    uint64_t deferredTotal{0};
+    uint64_t dropped{0};  // deferred queue overflowed
+
+    void defer(const User& u) {
+        lock_guard<mutex> g(mu);
+        ++deferredTotal;
+        if (deferred.size() >= maxDeferred) {
+            deferred.pop_front();
+            ++dropped;
+        }
+        deferred.push_back(u);
+    }
+
+public:
+    AdmissionNotifier(INotifier* n, admission::Controller* g,
+                      admission::Priority p = admission::Priority::Low,
+                      size_t maxDeferredUsers = 100000)
+        : inner(n), gate(g), prio(p), maxDeferred(maxDeferredUsers) {}
+
+    void notify(const User& u) override {
+        admission::Ticket t = gate->admit(prio);
+        if (!t) {
+            defer(u);
+            return;
+        }
+        inner->notify(u);
+    }
+
+    // Replays up to `budget` deferred notifications while the gate is not
+    // overloaded; stops at the first one shed again. Returns the number sent.
+    size_t flushDeferred(size_t budget) {
+        size_t sent = 0;
+        while (sent < budget && !gate->isOverloaded()) {
+            User u("", "");
+            {
+                lock_guard<mutex> g(mu);
+                if (deferred.empty())
+                    break;
+                u = move(deferred.front());
+                deferred.pop_front();
+            }
+            admission::Ticket t = gate->admit(prio);
+            if (!t) {
+                lock_guard<mutex> g(mu);
+                deferred.push_front(move(u));
+                break;
+            }
+            inner->notify(u);
+            ++sent;
+        }
+        return sent;
+    }
+
+    size_t deferredCount() {
+        lock_guard<mutex> g(mu);
+        return deferred.size();
+    }
+    uint64_t deferredTotalCount() {
+        lock_guard<mutex> g(mu);
+        return deferredTotal;
+    }
+    uint64_t droppedCount() {
+        lock_guard<mutex> g(mu);
+        return dropped;
+    }
+};
+
+// ------------------------ High-level SignUp Service ------------------------
+
+class SignUpService {
+private:
+    INotifier* notifier;  // depends on abstractions only (DIP)
+    IUserStore* store;
+    UniquenessIndex* unique;
+    admission::Controller* gate;  // optional overload protection
+public:
+    SignUpService(INotifier* n, IUserStore* s = nullptr,
+                  UniquenessIndex* idx = nullptr,
+                  admission::Controller* g = nullptr)
+        : notifier(n), store(s), unique(idx), gate(g) {}
+
+    // Interactive signups are Critical; bulk imports can pass Normal or
+    // Low so they are shed first under overload (returning false).
+    bool signUp(const User& u,
+                admission::Priority prio = admission::Priority::Critical) {
+        TRACE_SPAN("SignUpService::signUp", "notify");
+        ALLOC_SCOPE("notify.signup");
+        admission::Ticket ticket;
+        if (gate && !(ticket = gate->admit(prio)))
+            return false;
+        if (!isValidEmail(u.email))
+            return false;
+
+        if (unique && unique->claim(u) != UniquenessIndex::Claim::Ok)
+            return false;
+
+        if (store && !store->put(u)) {
+            if (unique)
+                unique->release(u);
+            return false;
+        }
+        if (unique)
+            unique->commit(u);
+
+        notifier->notify(u);  // triggers all notifications
+        return true;
+    }
+};
+
+// ------------------------ Sharded Deployment ------------------------
+
+// Email -> shard via consistent hashing with virtual nodes, so adding a
+// shard only moves ~1/N of the users.
+class ConsistentHashRing {
+private:
+    vector<pair<uint64_t, uint32_t>> points;  // sorted by hash
+public:
+    ConsistentHashRing(uint32_t shards, uint32_t vnodes = 128) {
+        for (uint32_t s = 0; s < shards; ++s)
+            for (uint32_t v = 0; v < vnodes; ++v)
+                points.push_back({idempotencyHash("shard-" + to_string(s) + "#" + to_string(v)), s});
+        sort(points.begin(), points.end());
+    }
+
+    uint32_t shardFor(const string& email) const {
+        string key = email;
+        for (auto& c : key)
+            if (c >= 'A' && c <= 'Z')
+                c = char(c - 'A' + 'a');
+        uint64_t h = idempotencyHash(key);
+        auto it = lower_bound(points.begin(), points.end(), make_pair(h, 0u));
+        return (it == points.end() ? points.front() : *it).second;
+    }
+};
+
+// Single-producer/single-consumer ring placed in shared memory; the
+// lock-free atomics work across processes mapping the same pages.
+template <typename T, size_t N>
+struct ShmRing {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+    static_assert(atomic<uint64_t>::is_always_lock_free, "need address-free atomics");
+
+    alignas(64) atomic<uint64_t> head{0};  // next slot to read
+    alignas(64) atomic<uint64_t> tail{0};  // next slot to write
+    T slots[N];
+
+    bool push(const T& v) {
+        uint64_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == N)
+            return false;
+        slots[t & (N - 1)] = v;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T& v) {
+        uint64_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire))
+            return false;
+        v = slots[h & (N - 1)];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+};
+
+struct ShardRequest {
+    uint64_t tag;
+    char email[256];
+    char phone[32];
+};
+
+struct ShardResponse {
+    uint64_t tag;
+    bool ok;
+};
+
+struct ShardChannel {
+    ShmRing<ShardRequest, 4096> requests;
+    ShmRing<ShardResponse, 4096> responses;
+    atomic<bool> stop{false};
+};
+
+// Front dispatcher for N forked worker processes. Each worker owns its
+// own SignUpService, user store and uniqueness index; a given email
+// always hashes to the same shard, so email uniqueness stays global, and
+// phones are claimed in a SharedClaimTable all workers map. Workers seed
+// that table from their stores and wait for each other before serving.
+// Requests and responses travel over shared-memory rings. A worker that
+// dies is noticed by waitpid; its queued requests come back as failed.
+// Construct before the parent starts any threads: fork() only carries
+// the calling thread over.
+class ShardedSignUpService {
+public:
+    using NotifierFactory = function<INotifier*(uint32_t shard)>;
+
+private:
+    static constexpr size_t PHONE_SLOTS = 1 << 20;
+
+    ConsistentHashRing ring;
+    ShardChannel* channels{nullptr};
+    atomic<uint32_t>* seeded{nullptr};  // workers done seeding the phone table
+    SharedClaimTable phones;
+    void* mem{nullptr};
+    size_t mapped{0};
+    vector<pid_t> workers;               // -1 once reaped
+    vector<unordered_set<uint64_t>> outstanding;  // tags queued per shard
+    vector<pair<uint64_t, bool>> early;  // responses drained while submitting
+
+    static void runWorker(uint32_t shard, uint32_t shards, ShardChannel& ch,
+                          atomic<uint32_t>& seeded, SharedClaimTable* phones,
+                          const string& dir, size_t threads,
+                          const NotifierFactory& makeNotifier) {
+        AppendOnlyUserStore store(dir + "/users-shard-" + to_string(shard) + ".db");
+        UniquenessIndex unique("1", phones);
+        unique.seed(store);
+        // A phone claimed here before another shard has seeded its users
+        // could duplicate one of them.
+        seeded.fetch_add(1, memory_order_acq_rel);
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(30);
+        while (seeded.load(memory_order_acquire) < shards) {
+            if (chrono::steady_clock::now() > deadline) {
+                cerr << "[Shard " << shard << "] peers did not finish seeding, serving anyway\n";
+                break;
+            }
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        SignUpService svc(makeNotifier(shard), &store, &unique);
+
+        // Threads let the shard's store batch their puts into one fsync.
+        mutex popMu, pushMu;
+        vector<thread> pool;
+        for (size_t t = 0; t < threads; ++t)
+            pool.emplace_back([&] {
+                ShardRequest req;
+                while (true) {
+                    bool got;
+                    {
+                        lock_guard<mutex> g(popMu);
+                        got = ch.requests.pop(req);
+                    }
+                    if (!got) {
+                        if (ch.stop.load(memory_order_acquire))
+                            return;
+                        this_thread::sleep_for(chrono::microseconds(20));
+                        continue;
+                    }
+                    ShardResponse resp{req.tag, svc.signUp(User(req.email, req.phone))};
+                    lock_guard<mutex> g(pushMu);
+                    while (!ch.responses.push(resp))
+                        this_thread::yield();
+                }
+            });
+        for (auto& t : pool)
+            t.join();
+    }
+
+    // Reaps workers that exited; their unanswered requests fail.
+    void reapDead() {
+        for (size_t s = 0; s < workers.size(); ++s) {
+            if (workers[s] < 0 || waitpid(workers[s], nullptr, WNOHANG) != workers[s])
+                continue;
+            cerr << "[Shard " << s << "] worker exited, failing " << outstanding[s].size()
+                 << " queued signups\n";
+            workers[s] = -1;
+            ShardResponse r;
+            while (channels[s].responses.pop(r))
+                if (outstanding[s].erase(r.tag))
+                    early.push_back({r.tag, r.ok});
+            for (uint64_t tag : outstanding[s])
+                early.push_back({tag, false});
+            outstanding[s].clear();
+        }
+    }
+
+public:
+    ShardedSignUpService(uint32_t shards, const string& dir, size_t threadsPerShard,
+                         NotifierFactory makeNotifier)
+        : ring(shards), outstanding(shards) {
+        size_t chanBytes = sizeof(ShardChannel) * shards;
+        size_t ctlBytes = (sizeof(atomic<uint32_t>) + 63) & ~size_t(63);
+        mapped = chanBytes + ctlBytes + SharedClaimTable::bytesFor(PHONE_SLOTS);
+        mem = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            mem = nullptr;
+            return;
+        }
+        channels = (ShardChannel*)mem;
+        for (uint32_t s = 0; s < shards; ++s)
+            new (&channels[s]) ShardChannel;
+        seeded = new ((char*)mem + chanBytes) atomic<uint32_t>(0);
+        phones = SharedClaimTable((char*)mem + chanBytes + ctlBytes, PHONE_SLOTS);
+
+        for (uint32_t s = 0; s < shards; ++s) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                runWorker(s, shards, channels[s], *seeded, &phones, dir, threadsPerShard,
+                          makeNotifier);
+                _exit(0);
+            }
+            workers.push_back(pid);
+        }
+    }
+
+    ~ShardedSignUpService() {
+        shutdown();
+        if (mem)
+            munmap(mem, mapped);
+    }
+
+    // Queues a signup; the result comes back from poll() with `tag`.
+    // False when the request is malformed or its shard's worker is gone.
+    bool submit(const User& u, uint64_t tag) {
+        if (!channels || u.email.size() >= sizeof(ShardRequest::email) ||
+            u.phone.size() >= sizeof(ShardRequest::phone))
+            return false;
+        ShardRequest req;
+        req.tag = tag;
+        memcpy(req.email, u.email.c_str(), u.email.size() + 1);
+        memcpy(req.phone, u.phone.c_str(), u.phone.size() + 1);
+
+        uint32_t s = ring.shardFor(u.email);
+        while (true) {
+            if (workers[s] < 0)
+                return false;
+            if (channels[s].requests.push(req))
+                break;
+            // Keep responses flowing so a full response ring can't stall
+            // the worker we are waiting on; notice if it died instead.
+            if (!poll(early)) {
+                reapDead();
+                this_thread::yield();
+            }
+        }
+        outstanding[s].insert(tag);
+        return true;
+    }
+
+    // Appends finished (tag, ok) pairs; returns how many were added.
+    size_t poll(vector<pair<uint64_t, bool>>& done) {
+        size_t before = done.size();
+        if (&done != &early && !early.empty()) {
+            done.insert(done.end(), early.begin(), early.end());
+            early.clear();
+        }
+        ShardResponse r;
+        for (size_t s = 0; s < workers.size(); ++s)
+            while (channels[s].responses.pop(r))
+                if (outstanding[s].erase(r.tag))
+                    done.push_back({r.tag, r.ok});
+        if (done.size() == before && &done != &early) {
+            reapDead();
+            done.insert(done.end(), early.begin(), early.end());
+            early.clear();
+        }
+        return done.size() - before;
+    }
+
+    // Lets workers drain their queues, then reaps them.
+    void shutdown() {
+        if (workers.empty())
+            return;
+        for (size_t s = 0; s < workers.size(); ++s)
+            channels[s].stop.store(true, memory_order_release);
+        for (pid_t pid : workers)
+            if (pid > 0)
+                waitpid(pid, nullptr, 0);
+        workers.clear();
+    }
+};
+
+// ------------------------ Workload Generator ------------------------
+
+// Signup and campaign traffic for benchmarks and PGO training: consumer
+// domains dominate, phones arrive in whatever format the form allowed,
+// a few percent of addresses are junk, and SMS bodies mix plain ASCII,
+// accented text, emoji and long messages.
+class FanOutGenerator {
+private:
+    uint64_t state;
+
+    uint64_t next() {
+        state = mix64(state + 0x9e3779b97f4a7c15ULL);
+        return state;
+    }
+
+    template <size_t N>
+    const char* pick(const char* const (&xs)[N], const double (&cdf)[N]) {
+        double u = (next() >> 11) * (1.0 / 9007199254740992.0);
+        for (size_t i = 0; i + 1 < N; ++i)
+            if (u < cdf[i])
+                return xs[i];
+        return xs[N - 1];
+    }
+
+public:
+    explicit FanOutGenerator(uint64_t seed) : state(seed) {}
+
+    User user(uint32_t id) {
+        static const char* const domains[] = {"gmail.com",  "yahoo.com",     "outlook.com",
+                                              "icloud.com", "example.com",   "globex.io",
+                                              "acme.co.uk", "mail.example.in"};
+        static const double domainCdf[] = {0.42, 0.56, 0.68, 0.76, 0.84, 0.9, 0.95, 1.0};
+        static const char* const phones[] = {"+1 (555) %03u-%04u", "555%03u%04u",
+                                             "+44 20 %04u %04u", "+91 98%03u %05u"};
+        static const double phoneCdf[] = {0.5, 0.7, 0.85, 1.0};
+
+        string email = "user" + to_string(id);
+        if (next() % 100 < 3)
+            email += "@@broken";  // junk the validator has to reject
+        else
+            email += string("@") + pick(domains, domainCdf);
+        char phone[32];
+        snprintf(phone, sizeof(phone), pick(phones, phoneCdf), (unsigned)(next() % 1000),
+                 (unsigned)(next() % 10000));
+        return User(email, phone, next() % 4 ? "" : "device-" + to_string(id), id);
+    }
+
+    // Users first..first+n-1, held in `mem` when given.
+    UserList users(uint32_t first, size_t n, arena::HugePageArena* mem = nullptr) {
+        UserList out{arena::Allocator<User>(mem)};
+        out.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+            out.push_back(user(first + (uint32_t)i));
+        return out;
+    }
+
+    string sms() {
+        static const char* const bodies[] = {
+            "Your code is 482913", "Café reservation confirmed for 19:30",
+            "Order shipped \xF0\x9F\x93\xA6 track it in the app",
+            "Reminder: your appointment is tomorrow at 10:00. Reply C to confirm, R to "
+            "reschedule, or call us if anything changed. We look forward to seeing you!"};
+        static const double cdf[] = {0.6, 0.75, 0.9, 1.0};
+        return pick(bodies, cdf);
+    }
+};
+
+// --train [N]: signup fan-out plus a signed campaign, for profile-guided
+// builds. Providers still print, so run it with stdout discarded.
+void runTrainingWorkload(size_t users) {
+    FanOutGenerator gen(2024);
+    SmtpMailer smtp;
+    PhoneRouter router = PhoneRouter::withNumberingPlan();
+    TwilioClient twilio(&router);
+    WelcomeEmailNotifier welcome(&smtp);
     OTPNotifier otp(&twilio);
+    CompositeNotifier fanOut;
+    fanOut.add(&welcome);
+    fanOut.add(&otp);
+    SlidingWindowSet seen(600000, 4, 1 << 16);
+    DedupNotifier once(&fanOut, &seen, "signup");
+    UniquenessIndex unique;
+    SignUpService svc(&once, nullptr, &unique);
+
+    vector<string> campaign;
+    size_t accepted = 0;
+    for (uint32_t i = 0; i < users; ++i) {
+        User u = gen.user(i);
+        accepted += svc.signUp(u);
+        if (i % 20 == 0)
+            svc.signUp(u);  // client retry
+        campaign.push_back(u.email);
+        encodeSms(gen.sms());
+    }
+
+    for (auto& b : groupByDomain(campaign)) {
+        vector<string> rcpt;
+        for (auto i : b.recipients)
+            rcpt.push_back(campaign[i]);
+        smtp.sendEmailBatch("newsletter", rcpt, "This month at Example");
+    }
+
+    DkimKeyring keys;
+    keys.add("example.com", "s1", DkimKeyring::generate(true));
+    DkimSigningPool signer(&keys);
+    vector<MailMessage> msgs;
+    for (size_t i = 0; i < min<size_t>(campaign.size(), 2000); ++i)
+        msgs.push_back({"news@example.com", campaign[i], "newsletter", "This month at Example", {}});
+    signer.signAll(msgs);
+
+    cerr << "Trained on " << users << " signups (" << accepted << " accepted)\n";
+}
+
+// ------------------------ Benchmarks ------------------------
+// Each benchX registers its cases on the suite. Inputs are built on first
+// use or in the setup hook, so the timed run is the hot path alone; the
+// detail line is printed once, after the warm-up.
+
+// Validation + grouping throughput over `total` synthetic addresses: one
+// chunk of up to 1M addresses, built once, is grouped total/chunk times.
+void benchEmailGrouping(bench::Suite& suite, size_t total) {
+    struct State {
+        vector<string> emails;
+        size_t passes{0}, valid{0}, rejected{0}, sessions{0};
+        bool reported{false};
+    };
+    auto st = make_shared<State>();
+    suite.add("email_grouping",
+              [st] {
+                  st->valid = st->rejected = st->sessions = 0;
+                  for (size_t p = 0; p < st->passes; ++p) {
+                      size_t bad = 0;
+                      st->sessions += groupByDomain(st->emails, &bad).size();
+                      st->rejected += bad;
+                      st->valid += st->emails.size() - bad;
+                  }
+                  return double(st->passes * st->emails.size());
+              },
+              [st, total] {
+                  static const char* const domains[] = {
+                      "gmail.com", "Yahoo.com", "outlook.com", "example.org", "corp.example.com",
+                      "mail.ru", "qq.com", "proton.me", "icloud.com", "gmx.de",
+                  };
+                  if (!st->emails.empty())
+                      return;
+                  size_t n = max<size_t>(1, min<size_t>(total, 1 << 20));
+                  st->emails.reserve(n);
+                  for (size_t id = 0; id < n; ++id) {
+                      if (id % 50 == 49)
+                          st->emails.push_back("broken..user" + to_string(id) + "@nowhere");
+                      else
+                          st->emails.push_back("user." + to_string(id) + "@" + domains[id % 10]);
+                  }
+                  st->passes = (total + n - 1) / n;
+              },
+              [st] {
+                  if (!exchange(st->reported, true))
+                      cout << "[bench] email validate+group: " << st->passes * st->emails.size()
+                           << " addresses, " << st->valid << " valid, " << st->rejected
+                           << " rejected, " << st->sessions << " SMTP sessions\n";
+              });
+}
+
+// Concurrent durable signups against a fresh append-only store; group
+// commit turns `threads` blocked puts into one fdatasync.
+void benchUserStore(bench::Suite& suite, size_t total, size_t threads) {
+    struct State {
+        vector<User> users;
+        unique_ptr<AppendOnlyUserStore> store;
+        bool reported{false};
+    };
+    auto st = make_shared<State>();
+    suite.add("user_store",
+              [st, threads] {
+                  vector<thread> workers;
+                  for (size_t t = 0; t < threads; ++t)
+                      workers.emplace_back([&st, t, threads] {
+                          for (size_t i = t; i < st->users.size(); i += threads)
+                              st->store->put(st->users[i]);
+                      });
+                  for (auto& w : workers)
+                      w.join();
+                  return (double)st->users.size();
+              },
+              [st, total] {
+                  if (st->users.empty())
+                      for (size_t i = 0; i < total; ++i)
+                          st->users.push_back(
+                              User("user" + to_string(i) + "@example.com", "+15550001111"));
+                  remove("bench-users.db");
+                  st->store = make_unique<AppendOnlyUserStore>("bench-users.db");
+              },
+              [st, threads] {
+                  if (!exchange(st->reported, true))
+                      cout << "[bench] user store: " << st->users.size() << " durable puts, "
+                           << threads << " threads, " << st->store->groupCommits()
+                           << " fsyncs\n";
+                  st->store.reset();
+                  remove("bench-users.db");
+              });
+}
+
+// 64 threads racing to claim overlapping users in a fresh index: every
+// email is offered by 4 threads, so exactly total/4 claims must win.
+void benchUniqueness(bench::Suite& suite, size_t total, size_t threads) {
+    struct State {
+        vector<User> users;  // total / 4 distinct
+        unique_ptr<UniquenessIndex> idx;
+        atomic<size_t> won{0};
+        bool reported{false};
+    };
+    auto st = make_shared<State>();
+    suite.add("uniqueness",
+              [st, total, threads] {
+                  vector<thread> workers;
+                  for (size_t t = 0; t < threads; ++t)
+                      workers.emplace_back([&st, t, total, threads] {
+                          size_t mine = 0;
+                          for (size_t i = t; i < total; i += threads) {
+                              const User& u = st->users[i / 4];
+                              if (st->idx->claim(u) == UniquenessIndex::Claim::Ok) {
+                                  st->idx->commit(u);
+                                  ++mine;
+                              }
+                          }
+                          st->won += mine;
+                      });
+                  for (auto& w : workers)
+                      w.join();
+                  return (double)total;
+              },
+              [st, total] {
+                  if (st->users.empty())
+                      for (size_t id = 0; id < (total + 3) / 4; ++id)
+                          st->users.push_back(User("User" + to_string(id) + "@Example.com",
+                                                   "+1555" + to_string(1000000 + id)));
+                  st->idx = make_unique<UniquenessIndex>();
+                  st->won = 0;
+              },
+              [st, total, threads] {
+                  if (!exchange(st->reported, true))
+                      cout << "[bench] uniqueness: " << total << " claims, " << threads
+                           << " threads, " << st->won << " accepted (expected " << total / 4
+                           << ")\n";
+                  st->idx.reset();
+              });
+}
+
+// Audience selection for an email marketing campaign over `users` ids.
+void benchPreferenceSelect(bench::Suite& suite, uint32_t users) {
+    struct State {
+        unique_ptr<PreferenceStore> prefs;
+        vector<uint32_t> ids;
+        size_t eligible{0};
+        bool reported{false};
+        ~State() {
+            prefs.reset();
+            remove("bench-prefs.db");
+        }
+    };
+    auto st = make_shared<State>();
+    suite.add("preference_select",
+              [st, users] {
+                  st->ids.clear();
+                  st->eligible = st->prefs->select(
+                      {PREF_EMAIL, PREF_MARKETING, PREF_TRANSACTIONAL}, st->ids);
+                  return (double)users;
+              },
+              [st, users] {
+                  if (st->prefs)
+                      return;
+                  remove("bench-prefs.db");
+                  st->prefs = make_unique<PreferenceStore>("bench-prefs.db", users);
+                  uint64_t x = 88172645463325252ULL;  // xorshift64
+                  for (uint32_t id = 0; id < users; ++id) {
+                      x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                      st->prefs->set(id, PREF_EMAIL, x & 1);
+                      st->prefs->set(id, PREF_MARKETING, x & 2);
+                      st->prefs->set(id, PREF_TRANSACTIONAL, true);
+                  }
+                  st->ids.reserve(users / 2);
+              },
+              [st, users] {
+                  if (!exchange(st->reported, true))
+                      cout << "[bench] preference select: " << users << " users, "
+                           << st->eligible << " eligible\n";
+              });
+}
+
+// SMS classification + segmentation over a mix of short/long, GSM-7,
+// transliterable and UCS-2 messages.
+void benchSmsEncoding(bench::Suite& suite, size_t total) {
+    auto msgs = make_shared<vector<string>>(vector<string>{
+        "Your code is 123456",
+        "Hi! Your order #4821 has shipped and will arrive Tuesday. Track it at https://ex.co/t/4821 ~ reply STOP to opt out.",
+        string(300, 'x'),
+        "Caf\xC3\xA9 \xE2\x80\x9Cspecial\xE2\x80\x9D \xE2\x80\x94 don\xE2\x80\x99t miss it\xE2\x80\xA6",
+        "\xD0\x92\xD0\xB0\xD1\x88 \xD0\xBA\xD0\xBE\xD0\xB4: 123456 \xF0\x9F\x94\x91",
+    });
+    auto segments = make_shared<size_t>(0);
+    suite.add("sms_encoding",
+              [msgs, segments, total] {
+                  size_t n = 0;
+                  for (size_t i = 0; i < total; ++i)
+                      n += encodeSms((*msgs)[i % msgs->size()], true, uint8_t(i)).segments.size();
+                  *segments = n;
+                  return (double)total;
+              },
+              {},
+              [segments, total, reported = make_shared<bool>(false)] {
+                  if (!exchange(*reported, true))
+                      cout << "[bench] sms encode: " << total << " messages, " << *segments
+                           << " segments\n";
+              });
+}
+
+// DKIM signing per algorithm, on one core and on a worker pool, against
+// body canonicalization alone as the baseline. Keys are generated once.
+void benchDkim(bench::Suite& suite, size_t total) {
+    struct State {
+        vector<MailMessage> msgs;
+        DkimKeyring keys[2];  // ed25519, rsa-2048
+        bool keyed{false};
+    };
+    auto st = make_shared<State>();
+    auto prepare = [st] {
+        if (st->keyed)
+            return;
+        for (size_t i = 0; i < 256; ++i)
+            st->msgs.push_back({"noreply@example.com", "user" + to_string(i) + "@gmail.com",
+                                "welcome", string(2000 + i, 'x') + "\n\nThanks,  \n The team \n",
+                                {}});
+        st->keys[0].add("example.com", "s1", DkimKeyring::generate(true));
+        st->keys[1].add("example.com", "s1", DkimKeyring::generate(false));
+        st->keyed = true;
+    };
+    suite.add("dkim_canon",
+              [st, total] {
+                  size_t bytes = 0;
+                  for (size_t i = 0; i < total; ++i)
+                      bytes += dkim::canonBody(st->msgs[i % st->msgs.size()].body).size();
+                  asm volatile("" ::"r"(bytes));
+                  return (double)total;
+              },
+              prepare);
+    for (int k = 0; k < 2; ++k) {
+        string name = k ? "rsa" : "ed25519";
+        size_t n = k ? total / 10 : total;  // RSA signs ~10x slower
+        suite.add("dkim_" + name + "_core",
+                  [st, k, n] {
+                      EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+                      size_t bytes = 0;
+                      for (size_t i = 0; i < n; ++i)
+                          bytes += st->keys[k].sign(st->msgs[i % st->msgs.size()], ctx).size();
+                      EVP_MD_CTX_free(ctx);
+                      asm volatile("" ::"r"(bytes));
+                      return (double)n;
+                  },
+                  prepare);
+        auto all = make_shared<vector<MailMessage>>();
+        suite.add("dkim_" + name + "_pool",
+                  [st, k, all] {
+                      DkimSigningPool pool(&st->keys[k]);
+                      return (double)pool.signAll(*all).size();
+                  },
+                  [st, prepare, all, n] {
+                      prepare();
+                      for (size_t i = all->size(); i < n; ++i)
+                          all->push_back(st->msgs[i % st->msgs.size()]);
+                  });
+    }
+}
+
+// 10M keys with 10% repeats through a 10s window at a simulated 1M msg/s
+// (keys hashed up front, so this times the window probe alone).
+void benchDedup(bench::Suite& suite, size_t total) {
+    struct State {
+        vector<uint64_t> keys;
+        unique_ptr<SlidingWindowSet> seen;
+        size_t dupes{0};
+        bool reported{false};
+    };
+    auto st = make_shared<State>();
+    suite.add("dedup",
+              [st] {
+                  size_t dupes = 0;
+                  for (size_t i = 0; i < st->keys.size(); ++i)
+                      if (!st->seen->insertIfAbsent(st->keys[i], (int64_t)(i / 1000)))
+                          ++dupes;
+                  st->dupes = dupes;
+                  return (double)st->keys.size();
+              },
+              [st, total] {
+                  if (st->keys.empty()) {
+                      st->keys.resize(total);
+                      for (size_t i = 0; i < total; ++i)
+                          st->keys[i] = idempotencyHash(to_string((i % 10 == 9) ? i - 5 : i));
+                  }
+                  st->seen = make_unique<SlidingWindowSet>(10000, 4, 1 << 22);
+              },
+              [st] {
+                  if (!exchange(st->reported, true))
+                      cout << "[bench] dedup: " << st->keys.size() << " keys, " << st->dupes
+                           << " duplicates, growths=" << st->seen->growthCount() << "\n";
+                  st->seen.reset();
+              });
+}
+
+// 10M messages to 1M users over 90 days into a fresh log, then "user X in
+// one month" against the last log written.
+void benchAuditLog(bench::Suite& suite, size_t total) {
+    static const int64_t day = 86400000, start = 1735689600000;  // 2025-01-01
+    struct State {
+        vector<string> emails, phones;  // per user
+        AuditQueryStats q;
+        bool written{false}, reported[2]{false, false};
+        ~State() { remove("bench-audit.log"); }
+    };
+    auto st = make_shared<State>();
+    auto write = [st, total] {
+        AuditLogWriter w("bench-audit.log");
+        uint64_t x = 88172645463325252ULL;
+        for (size_t i = 0; i < total; ++i) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            uint32_t u = uint32_t(x % st->emails.size());
+            bool sms = x & (1ULL << 40);
+            w.append({start + (int64_t)(i * 90 * day / total), u,
+                      sms ? AuditChannel::Sms : AuditChannel::Email,
+                      sms ? st->phones[u] : st->emails[u],
+                      sms ? "OTP 123456" : "welcome: Welcome!", AuditOutcome::Sent});
+        }
+        st->written = true;
+        return (double)total;
+    };
+    auto prepare = [st] {
+        const uint32_t users = 1000000;
+        for (uint32_t u = (uint32_t)st->emails.size(); u < users; ++u) {
+            st->emails.push_back("user" + to_string(u) + "@example.com");
+            st->phones.push_back("+1555" + to_string(1000000 + u));
+        }
+    };
+    suite.add("audit_write", write,
+              [prepare] {
+                  prepare();
+                  remove("bench-audit.log");
+              },
+              [st, total] {
+                  struct stat sb;
+                  if (!exchange(st->reported[0], true) && stat("bench-audit.log", &sb) == 0)
+                      cout << "[bench] audit log: " << total << " records in " << sb.st_size
+                           << " bytes (" << (double)sb.st_size / total << " B/rec)\n";
+              });
+    suite.add("audit_query",
+              [st] {
+                  AuditLogReader r("bench-audit.log");
+                  st->q = r.query(4242, start + 59 * day, start + 90 * day - 1,
+                                  [](const AuditRecord&) {});
+                  return 1.0;
+              },
+              [st, prepare, write] {
+                  if (!st->written) {
+                      prepare();
+                      write();
+                  }
+              },
+              [st] {
+                  if (!exchange(st->reported[1], true))
+                      cout << "[bench] audit query: read " << st->q.blocksRead << "/"
+                           << st->q.blocksTotal << " blocks, " << st->q.bytesRead << " bytes, "
+                           << st->q.matches << " matches\n";
+              });
+}
+
+// Durable signups through 1, 2 and 4 shard processes, forked fresh for
+// every rep outside the clock.
+void benchSharding(bench::Suite& suite, size_t total) {
+    struct Quiet : INotifier {
+        void notify(const User&) override {}
+    };
+    struct State {
+        Quiet quiet;
+        vector<User> users;
+        unique_ptr<ShardedSignUpService> svc;
+        size_t ok{0};
+        bool reported{false};
+    };
+    for (uint32_t shards : {1u, 2u, 4u}) {
+        auto st = make_shared<State>();
+        suite.add("sharding_" + to_string(shards),
+                  [st, total] {
+                      vector<pair<uint64_t, bool>> done;
+                      for (size_t i = 0; i < total; ++i) {
+                          if (!st->svc->submit(st->users[i], i))
+                              done.push_back({i, false});
+                          st->svc->poll(done);
+                      }
+                      while (done.size() < total)
+                          if (!st->svc->poll(done))
+                              this_thread::yield();
+                      st->ok = 0;
+                      for (auto& d : done)
+                          st->ok += d.second;
+                      return (double)total;
+                  },
+                  [st, shards, total] {
+                      if (st->users.empty())
+                          for (size_t i = 0; i < total; ++i)
+                              st->users.push_back(User("user" + to_string(i) + "@example.com",
+                                                       "+1555" + to_string(1000000 + i)));
+                      for (uint32_t s = 0; s < shards; ++s)
+                          remove(("users-shard-" + to_string(s) + ".db").c_str());
+                      Quiet* quiet = &st->quiet;
+                      st->svc = make_unique<ShardedSignUpService>(
+                          shards, ".", 16, [quiet](uint32_t) -> INotifier* { return quiet; });
+                  },
+                  [st, shards, total] {
+                      st->svc.reset();
+                      for (uint32_t s = 0; s < shards; ++s)
+                          remove(("users-shard-" + to_string(s) + ".db").c_str());
+                      if (!exchange(st->reported, true))
+                          cout << "[bench] sharded signup: " << shards << " shards, " << st->ok
+                               << "/" << total << " ok\n";
+                  });
+    }
+}
+
+// Assignment cost and split accuracy for a 50/30/20 experiment, and
+// exposure counting from 8 threads.
+void benchExperiment(bench::Suite& suite, size_t total) {
+    struct State {
+        Experiment exp{"welcome-v2", 0x5eed, {{"control", "welcome", "Welcome!", 50},
+                                              {"short", "welcome_short", "Hi!", 30},
+                                              {"promo", "welcome_promo", "Welcome, 10% off", 20}}};
+        size_t counts[3]{0, 0, 0};
+        bool reported{false};
+    };
+    auto st = make_shared<State>();
+    suite.add("experiment_assign",
+              [st, total] {
+                  size_t counts[3] = {0, 0, 0};
+                  for (size_t i = 0; i < total; ++i)
+                      ++counts[st->exp.assignId(uint32_t(i + 1))];
+                  copy(begin(counts), end(counts), st->counts);
+                  return (double)total;
+              },
+              {},
+              [st, total] {
+                  if (!exchange(st->reported, true))
+                      cout << "[bench] a/b assign: split " << 100.0 * st->counts[0] / total << "/"
+                           << 100.0 * st->counts[1] / total << "/"
+                           << 100.0 * st->counts[2] / total << "\n";
+              });
+    suite.add("experiment_exposure", [st, total] {
+        vector<thread> ts;
+        for (int t = 0; t < 8; ++t)
+            ts.emplace_back([&st, t, total] {
+                for (size_t i = t; i < total; i += 8)
+                    st->exp.recordExposure(st->exp.assignId(uint32_t(i + 1)));
+            });
+        for (auto& t : ts)
+            t.join();
+        return (double)total;
+    });
+}
+
+// Spawn+run cost of an empty task, and a fork/join sum over 64M ints
+// against a plain loop.
+void benchExecutor(bench::Suite& suite, size_t tasks) {
+    struct State {
+        vector<uint32_t> data;
+        uint64_t serial{0}, parallel{0};
+        bool reported{false};
+    };
+    auto st = make_shared<State>();
+    auto prepare = [st] {
+        if (!st->data.empty())
+            return;
+        st->data.resize(1 << 26);
+        for (size_t i = 0; i < st->data.size(); ++i)
+            st->data[i] = (uint32_t)mix64(i);
+    };
+    suite.add("executor_spawn", [tasks] {
+        atomic<size_t> ran{0};
+        exec::TaskGroup g(exec::defaultExecutor());
+        for (size_t i = 0; i < tasks; ++i)
+            g.spawn([&ran] { ran.fetch_add(1, memory_order_relaxed); });
+        g.wait();
+        return (double)ran.load();
+    });
+    suite.add("executor_sum_serial",
+              [st] {
+                  uint64_t s = 0;
+                  for (uint32_t v : st->data)
+                      s += v;
+                  st->serial = s;
+                  return (double)st->data.size();
+              },
+              prepare);
+    suite.add("executor_sum_parallel",
+              [st] {
+                  st->parallel = exec::parallel_reduce(
+                      exec::defaultExecutor(), 0, st->data.size(), 1 << 16, uint64_t(0),
+                      [&st](size_t lo, size_t hi) {
+                          uint64_t s = 0;
+                          for (size_t i = lo; i < hi; ++i)
+                              s += st->data[i];
+                          return s;
+                      },
+                      [](uint64_t a, uint64_t b) { return a + b; });
+                  return (double)st->data.size();
+              },
+              prepare,
+              [st] {
+                  exec::Executor& ex = exec::defaultExecutor();
+                  if (!exchange(st->reported, true) && st->serial)
+                      cout << "[bench] executor(" << ex.size() << " workers): reduce "
+                           << (st->parallel == st->serial ? "ok" : "MISMATCH") << ", "
+                           << ex.tasksStolen() << " stolen\n";
+              });
+}
+
+// Per-span cost with recording off and on (buffers are reset between
+// rounds so every span is stored, none dropped). A span reads the clock
+// twice, so the clock's own cost is measured alongside: under some
+// hypervisors rdtsc traps and dominates.
+void benchTrace(bench::Suite& suite, size_t spans) {
+    suite.add("trace_clock", [spans] {
+        for (size_t i = 0; i < spans; ++i) {
+            uint64_t t = trace::now();
+            asm volatile("" ::"r"(t));
+        }
+        return (double)spans;
+    });
+    auto run = [spans] {
+        const size_t round = trace::ThreadBuffer::kCapacity;
+        for (size_t done = 0; done < spans; done += round) {
+            trace::reset();
+            for (size_t i = 0; i < round; ++i) {
+                TRACE_SPAN("bench", "bench");
+                asm volatile("" ::: "memory");
+            }
+        }
+        return (double)spans;
+    };
+    suite.add("trace_span_off", run);
+    suite.add("trace_span_on", run, [] { trace::start(); },
+              [] {
+                  trace::stop();
+                  trace::reset();
+              });
+}
+
+// Syscalls per operation for each reactor backend: 100k OTPs and 10k
+// welcome mails pipelined through loopback stand-ins, which are set up
+// fresh for every rep outside the clock.
+void benchReactor(bench::Suite& suite, size_t sms, size_t emails) {
+    struct Wire {
+        unique_ptr<io::IoReactor> reactor;
+        int smtpFds[2]{-1, -1}, smsFds[2]{-1, -1};
+        unique_ptr<io::LineChannel> smtpChan, smsChan;
+        unique_ptr<io::LoopbackLineServer> smtpServer, smsServer;
+        unique_ptr<SmtpMailer> mailer;
+        unique_ptr<TwilioClient> gateway;
+        uint64_t sys0{0}, ops0{0};
+        bool reported{false};
+
+        void close() {
+            if (!reactor)
+                return;
+            mailer.reset();
+            gateway.reset();
+            smtpChan.reset();
+            smsChan.reset();
+            ::close(smtpFds[0]);
+            ::close(smsFds[0]);
+            reactor->runUntilIdle();  // stand-ins see EOF and stop
+            smtpServer.reset();
+            smsServer.reset();
+            ::close(smtpFds[1]);
+            ::close(smsFds[1]);
+            reactor.reset();
+        }
+    };
+    for (bool uring : {true, false}) {
+        if (uring && string(io::makeReactor(true)->backend()) != "io_uring")
+            continue;
+        auto w = make_shared<Wire>();
+        suite.add(string("reactor_") + (uring ? "io_uring" : "epoll"),
+                  [w, sms, emails] {
+                      for (size_t i = 0; i < sms; ++i) {
+                          w->gateway->sendSMS("+1555" + to_string(1000000 + i), "123456");
+                          if (i % 1024 == 1023)
+                              w->reactor->poll(false);
+                      }
+                      for (size_t i = 0; i < emails; ++i) {
+                          w->mailer->sendEmail("welcome", "user" + to_string(i) + "@example.com",
+                                               "Welcome!");
+                          if (i % 256 == 255)
+                              w->reactor->poll(false);
+                      }
+                      w->gateway->drain();
+                      w->mailer->drain();
+                      return double(sms + emails);
+                  },
+                  [w, uring] {
+                      w->reactor = io::makeReactor(uring);
+                      if (!io::loopbackPair(w->smtpFds) || !io::loopbackPair(w->smsFds))
+                          abort();
+                      auto& r = *w->reactor;
+                      w->smtpChan = make_unique<io::LineChannel>(r, w->smtpFds[0], io::Framing::Smtp);
+                      w->smsChan = make_unique<io::LineChannel>(r, w->smsFds[0]);
+                      w->smtpServer = make_unique<io::LoopbackLineServer>(
+                          r, w->smtpFds[1], smtpStandIn(), smtpStandInGreeting);
+                      w->smsServer = make_unique<io::LoopbackLineServer>(r, w->smsFds[1],
+                                                                         smsGatewayStandIn());
+                      w->mailer = make_unique<SmtpMailer>(&r, w->smtpChan.get(),
+                                                          "noreply@example.com");
+                      w->gateway = make_unique<TwilioClient>(&r, w->smsChan.get());
+                      w->sys0 = r.syscalls();
+                      w->ops0 = r.operations();
+                  },
+                  [w, sms, emails] {
+                      if (!exchange(w->reported, true)) {
+                          uint64_t sys = w->reactor->syscalls() - w->sys0,
+                                   ops = w->reactor->operations() - w->ops0;
+                          cout << "[bench] reactor " << w->reactor->backend() << ": "
+                               << w->gateway->acceptedCount() << " sms + "
+                               << w->mailer->acceptedCount() << " mails, " << ops
+                               << " I/O ops, " << sys << " syscalls ("
+                               << (double)sys / (sms + emails) << "/message)\n";
+                      }
+                      w->close();
+                  });
+    }
+}
+
+// Critical signups mixed into a flood of marketing sends: 16 closed-loop
+// clients, 1 request in 8 Critical, each holding a core for ~200us.
+// Compares no admission control, a plain concurrency limit, and CoDel
+// shedding; shed clients back off 1ms like a retry-after.
+void benchAdmission(bench::Suite& suite, size_t requests) {
+    using Clock = chrono::steady_clock;
+    size_t cores = max(1u, thread::hardware_concurrency());
+    struct Mode {
+        const char* name;
+        bool gated;
+        admission::Config cfg;
+    };
+    for (Mode m : {Mode{"none", false, {}},
+                   Mode{"limit", true, {cores, chrono::hours(1), chrono::hours(1), SIZE_MAX}},
+                   Mode{"codel", true,
+                        {cores, chrono::milliseconds(1), chrono::milliseconds(10), 1024}}}) {
+        struct State {
+            unique_ptr<admission::Controller> gate;
+            vector<double> latency;  // critical requests, ms
+            size_t done{0};
+            bool reported{false};
+        };
+        auto st = make_shared<State>();
+        suite.add(string("admission_") + m.name,
+                  [st, m, requests] {
+                      const size_t clients = 16;
+                      auto spin = [](chrono::microseconds d) {
+                          auto end = Clock::now() + d;
+                          while (Clock::now() < end)
+                              ;
+                      };
+                      vector<vector<double>> latency(clients);
+                      atomic<size_t> issued{0}, done{0};
+                      vector<thread> threads;
+                      for (size_t c = 0; c < clients; ++c)
+                          threads.emplace_back([&, c] {
+                              size_t i;
+                              while ((i = issued.fetch_add(1)) < requests) {
+                                  bool critical = mix64(i) % 8 == 0;
+                                  auto start = Clock::now();
+                                  admission::Ticket t;
+                                  if (m.gated &&
+                                      !(t = st->gate->admit(critical
+                                                                ? admission::Priority::Critical
+                                                                : admission::Priority::Low))) {
+                                      this_thread::sleep_for(chrono::milliseconds(1));
+                                      continue;
+                                  }
+                                  spin(chrono::microseconds(200));
+                                  ++done;
+                                  if (critical)
+                                      latency[c].push_back(chrono::duration<double, milli>(
+                                                               Clock::now() - start).count());
+                              }
+                          });
+                      for (auto& t : threads)
+                          t.join();
+                      st->latency.clear();
+                      for (auto& l : latency)
+                          st->latency.insert(st->latency.end(), l.begin(), l.end());
+                      st->done = done;
+                      return (double)requests;
+                  },
+                  [st, m] { st->gate = make_unique<admission::Controller>(m.cfg); },
+                  [st, m] {
+                      if (!exchange(st->reported, true)) {
+                          auto& all = st->latency;
+                          sort(all.begin(), all.end());
+                          auto pct = [&](double q) {
+                              return all.empty() ? 0.0 : all[(size_t)(q * (all.size() - 1))];
+                          };
+                          admission::Stats s = st->gate->stats();
+                          cout << "[bench] admission " << m.name << ": critical p50=" << pct(0.5)
+                               << "ms p99=" << pct(0.99) << "ms, " << st->done
+                               << " done, shed=" << s.shedTotal() << " (low "
+                               << s.shed[(size_t)admission::Priority::Low]
+                               << "), overloads=" << s.overloadEpisodes << "\n";
+                      }
+                      st->gate.reset();
+                  });
+    }
+}
+
+// Campaign fan-out in NUMA mode (CampaignSender::sendShards): each node
+// generates its shard of users on its own pinned workers (so the shard is
+// node-local), then validates, builds and DKIM-signs it there; delivery
+// goes to a mailer that only counts signed messages. First socket alone,
+// then every socket; also samples how many shard entries really sit on
+// their node. Node pools and shards are built on first use.
+void benchNumaFanOut(bench::Suite& suite, size_t users) {
+    struct CountingMailer : IEmailService {
+        size_t signedCount{0};
+        void sendEmail(const string&, const string&, const string&) override {}
+        void sendMessage(const MailMessage& m) override {
+            signedCount += !m.headers.empty();
+        }
+    };
+    struct State {
+        DkimKeyring keys;
+        unique_ptr<numa::NodeExecutors> nodes;
+        vector<vector<User>> shards;
+        CountingMailer mailer;
+        size_t signedCount{0};
+        bool reported{false};
+    };
+    for (size_t maxNodes : {1, 0}) {
+        if (maxNodes == 0 && numa::topology().size() == 1)
+            break;  // single-node host: same run as above
+        auto st = make_shared<State>();
+        suite.add(maxNodes ? "numa_fanout_1node" : "numa_fanout_all_nodes",
+                  [st] {
+                      CampaignSender sender(&st->keys, &st->mailer, "noreply@example.com");
+                      st->mailer.signedCount = 0;
+                      sender.sendShards(st->shards, *st->nodes, "welcome", "Welcome!");
+                      st->signedCount = st->mailer.signedCount;
+                      size_t total = 0;
+                      for (auto& s : st->shards)
+                          total += s.size();
+                      return (double)total;
+                  },
+                  [st, maxNodes, users] {
+                      if (st->nodes)
+                          return;
+                      st->keys.add("example.com", "s1", DkimKeyring::generate(true));
+                      st->nodes = make_unique<numa::NodeExecutors>(maxNodes);
+                      auto& nodes = *st->nodes;
+                      auto range = nodes.ranges(users);
+                      st->shards.resize(nodes.size());
+                      nodes.eachNode([&](size_t n) {
+                          FanOutGenerator gen(n + 1);
+                          for (size_t i = range[n].first; i < range[n].second; ++i)
+                              st->shards[n].push_back(gen.user((uint32_t)i));
+                      });
+                  },
+                  [st] {
+                      if (exchange(st->reported, true))
+                          return;
+                      auto& nodes = *st->nodes;
+                      size_t sampled = 0, local = 0;
+                      for (size_t n = 0; n < st->shards.size(); ++n)
+                          for (size_t i = 0; i < st->shards[n].size(); i += 64, ++sampled)
+                              local += numa::nodeOf(&st->shards[n][i]) == nodes.node(n).id;
+                      cout << "[bench] numa fan-out " << nodes.size() << " node(s), "
+                           << nodes.workers() << " workers: " << st->signedCount << " signed, "
+                           << (sampled ? 100 * local / sampled : 0)
+                           << "% of sampled users node-local\n";
+                  });
+    }
+}
+
+// Campaign audience selection over 2M users on 4KB pages vs in a
+// huge-page arena: a sequential scan for push-eligible users, then a
+// gather of users by id (the shape of a preference-store selection).
+// Same generator and layout, only the page size differs; only the User
+// records move, their strings stay on the heap. Each audience is built on
+// first use.
+void benchAudienceScan(bench::Suite& suite, size_t n) {
+    struct State {
+        unique_ptr<arena::HugePageArena> mem;
+        UserList users;
+        vector<uint32_t> ids;
+        size_t eligible{0};
+        bool reported{false};
+    };
+    for (auto pages : {arena::Pages::Regular, arena::Pages::Huge}) {
+        auto st = make_shared<State>();
+        suite.add(pages == arena::Pages::Regular ? "audience_scan_4k_pages"
+                                                 : "audience_scan_huge_pages",
+                  [st] {
+                      size_t eligible = 0;
+                      uint64_t acc = 0;
+                      for (auto& u : st->users)
+                          eligible += !u.deviceToken.empty();
+                      for (uint32_t id : st->ids)
+                          acc += st->users[id].id + st->users[id].deviceToken.size();
+                      asm volatile("" ::"r"(acc));
+                      st->eligible = eligible;
+                      return (double)st->ids.size();
+                  },
+                  [st, n, pages] {
+                      if (st->mem)
+                          return;
+                      st->mem = make_unique<arena::HugePageArena>(256u << 20, pages);
+                      st->users = FanOutGenerator(5).users(0, n, st->mem.get());
+                      st->ids.resize(n);
+                      for (size_t i = 0; i < n; ++i)
+                          st->ids[i] = (uint32_t)(mix64(i) % n);
+                  },
+                  [st] {
+                      if (exchange(st->reported, true))
+                          return;
+                      cout << "[bench] audience " << arena::backingName(st->mem->backing())
+                           << ": " << (st->mem->bytesUsed() >> 20) << " MB of users, "
+                           << (st->mem->hugeBytes() >> 20) << " MB on huge pages, "
+                           << st->eligible << " push-eligible\n";
+                  });
+    }
+}
+
+// ------------------------ MAIN: Composition Root ------------------------
+
+int main(int argc, char** argv) {
+    // ALLOC_PROFILE_OUT=<file.json> in -DALLOC_PROFILE builds, any mode
+    alloc::Session allocProfile(getenv("ALLOC_PROFILE_OUT"));
+
+    if (argc > 5 && string(argv[1]) == "--audit-query") {
+        // --audit-query <file> <userId> <fromMs> <toMs>
+        AuditLogReader reader(argv[2]);
+        AuditQueryStats st = reader.query(
+            (uint32_t)strtoul(argv[3], nullptr, 10), strtoll(argv[4], nullptr, 10),
+            strtoll(argv[5], nullptr, 10), [](const AuditRecord& r) {
+                cout << r.tsMs << "\t" << r.userId << "\t"
+                     << (r.channel == AuditChannel::Email ? "email" : "sms") << "\t"
+                     << r.recipient << "\t" << r.content << "\t"
+                     << (r.outcome == AuditOutcome::Sent ? "sent" : "rejected") << "\n";
+            });
+        cerr << "blocks " << st.blocksRead << "/" << st.blocksTotal
+             << ", bytes read " << st.bytesRead << "\n";
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "--invoice-events") {
+        // --invoice-events <spool>: deliver invoices published by billing
+        string spool = argv[2];
+        events::InvoiceEventReader reader(spool, spool + ".cursor");
+        if (!reader.ok()) {
+            cerr << "cannot open " << spool << "\n";
+            return 1;
+        }
+        SmtpMailer smtp("billing");
+        DkimKeyring keys;
+        keys.add("example.com", "billing", DkimKeyring::generate(true));
+        DkimSigningPool signer(&keys);
+        DkimSigningMailer signedSmtp(&smtp, &signer, "billing@example.com");
+        events::DeliveredLog deliveredIds(spool + ".delivered", InvoiceEventRelay::kWindowMs,
+                                          wallClockMs());
+        if (!deliveredIds.ok()) {
+            cerr << "cannot open " << spool << ".delivered\n";
+            return 1;
+        }
+        InvoiceEventRelay relay(&reader, &signedSmtp, "billing@example.com", &deliveredIds);
+        relay.drain();
+        cout << "[Invoices] delivered=" << relay.deliveredCount()
+             << " duplicates=" << relay.duplicateCount()
+             << " failed=" << relay.failedCount()
+             << " corrupt=" << reader.corruptRecords() << "\n";
+        return relay.isStalled() ? 1 : 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--train") {
+        runTrainingWorkload(argc > 2 ? strtoull(argv[2], nullptr, 10) : 50000);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]).rfind("--bench", 0) == 0) {
+        // --bench [N] [--reps R] [--json F] [--filter S]; N sizes email grouping
+        size_t n = argc > 2 && isdigit((unsigned char)argv[2][0])
+                       ? strtoull(argv[2], nullptr, 10)
+                       : 10000000;
+        bench::Suite suite("03-notify");
+        // sharding first: it forks, which must happen before any thread exists
+        benchSharding(suite, 200000);
+        benchEmailGrouping(suite, n);
+        benchUserStore(suite, 1000000, 64);
+        benchUniqueness(suite, 4000000, 64);
+        benchPreferenceSelect(suite, 10000000);
+        benchSmsEncoding(suite, 5000000);
+        benchDkim(suite, 20000);
+        benchDedup(suite, 10000000);
+        benchAuditLog(suite, 10000000);
+        benchExperiment(suite, 50000000);
+        benchReactor(suite, 100000, 10000);
+        benchExecutor(suite, 1000000);
+        benchTrace(suite, 1 << 20);
+        benchAdmission(suite, 4000);
+        benchNumaFanOut(suite, 20000);
+        benchAudienceScan(suite, 2000000);
+        return bench::main(suite, argc, argv);
+    }
+
+    // TRACE_OUT=<file.json> records spans for the demo below
+    trace::Session tracing(getenv("TRACE_OUT"));
+
+    // Concrete dependencies
+    SmtpMailer smtp;
+    PhoneRouter router = PhoneRouter::withNumberingPlan();
+    TwilioClient twilio(&router);
+
+    // The demo's stores start empty each run, so its output is reproducible
+    for (const char* f : {"users.db", "prefs.db", "notify-audit.log"})
+        remove(f);
+
+    // Compliance: every email/SMS the providers send is audited
+    unordered_map<string, uint32_t> userIds = {{"user@example.com", 1},
+                                               {"+15550001111", 1}};
+    auto resolveUser = [&](const string& r) {
+        auto it = userIds.find(r);
+        return it == userIds.end() ? 0u : it->second;
+    };
+    AuditLogWriter auditLog("notify-audit.log");
+    AuditedEmailService auditedSmtp(&smtp, &auditLog, resolveUser);
+    AuditedSmsService auditedTwilio(&twilio, &auditLog, resolveUser);
+
+    // Individual notifiers
+    WelcomeEmailNotifier welcomeEmail(&auditedSmtp);
+    OTPNotifier otp(&auditedTwilio);
+
+    // Only channels the user opted into. The OTP is transactional (the
+    // signup cannot finish without it), so it is never gated.
+    PreferenceStore prefs("prefs.db", 1 << 20);
+    OptInNotifier welcomeIfOptedIn(&welcomeEmail, &prefs, {PREF_EMAIL});
+
+    // At most one welcome per user per 10 minutes, despite retries
+    SlidingWindowSet recentlySent(10 * 60 * 1000, 4, 1 << 16);
+    DedupNotifier welcomeOnce(&welcomeIfOptedIn, &recentlySent, "welcome");
 
     // Composite notifier
     CompositeNotifier composite;
-    composite.add(&welcomeEmail);
+    composite.add(&welcomeOnce);
     composite.add(&otp);
 
     // High level service depends ONLY on abstraction
-    SignUpService svc(&composite);
+    AppendOnlyUserStore users("users.db");
+    UniquenessIndex uniqueUsers;
+    cout << "[SignUp] " << uniqueUsers.seed(users) << " stored users indexed\n";
+    SignUpService svc(&composite, &users, &uniqueUsers);
+
+    User user("user@example.com", "+15550001111", "", 1);
+    prefs.set(user.id, PREF_EMAIL, true);
+    bool signedUp = svc.signUp(user);
+    cout << "[SignUp] " << user.email << (signedUp ? " signed up\n" : " rejected\n");
+    if (!svc.signUp(User("User@Example.com", "+1 555 000 2222")))
+        cout << "[SignUp] duplicate email rejected\n";
+    welcomeOnce.notify(user);  // upstream retry of the same event
+    cout << "[Dedup] suppressed " << welcomeOnce.suppressedCount() << "\n";
+    auditLog.flush();
+    AuditQueryStats audited = AuditLogReader("notify-audit.log")
+        .query(user.id, 0, INT64_MAX, [](const AuditRecord&) {});
+    cout << "[Audit] user " << user.id << ": " << audited.matches << " messages\n";
+
+    // Same notifications over the shared I/O reactor (loopback stand-ins
+    // for the SMTP relay and SMS gateway)
+    {
+        auto reactor = io::makeReactor();
+        int smtpFds[2], smsFds[2];
+        if (io::loopbackPair(smtpFds) && io::loopbackPair(smsFds)) {
+            io::LineChannel smtpChan(*reactor, smtpFds[0], io::Framing::Smtp);
+            io::LineChannel smsChan(*reactor, smsFds[0]);
+            io::LoopbackLineServer smtpServer(*reactor, smtpFds[1], smtpStandIn(),
+                                              smtpStandInGreeting);
+            io::LoopbackLineServer smsServer(*reactor, smsFds[1], smsGatewayStandIn());
+            SmtpMailer wireSmtp(reactor.get(), &smtpChan, "noreply@example.com");
+            TwilioClient wireSms(reactor.get(), &smsChan, &router);
+            WelcomeEmailNotifier(&wireSmtp).notify(user);
+            OTPNotifier(&wireSms).notify(user);
+            wireSmtp.drain();
+            wireSms.drain();
+            cout << "[Reactor] " << reactor->backend() << ": mail accepted="
+                 << wireSmtp.acceptedCount() << " sms accepted=" << wireSms.acceptedCount()
+                 << " syscalls=" << reactor->syscalls() << "\n";
+            close(smtpFds[0]);
+            close(smsFds[0]);
+            reactor->runUntilIdle();
+            close(smtpFds[1]);
+            close(smsFds[1]);
+        }
+    }
+
+    // Multi-tenant: each tenant has its own provider accounts and quota
+    SmtpMailer acmeSmtp("acme-smtp"), globexSmtp("globex-smtp");
+    TwilioClient acmeSms(&router, "1", "acme-twilio");
+    TwilioClient globexSms(&router, "44", "globex-twilio");
+    OTPNotifier acmeOtp(&acmeSms), globexOtp(&globexSms);
+    Experiment globexWelcomeTest("globex-welcome", 0x61ab,
+                                 {{"control", "welcome", "Welcome!", 50},
+                                  {"short", "welcome_short", "Hi!", 50}});
+    WelcomeEmailNotifier globexWelcome(&globexSmtp, &globexWelcomeTest);
+    CompositeNotifier globexAll;
+    globexAll.add(&globexWelcome);
+    globexAll.add(&globexOtp);
+
+    TenantDispatcher tenants;
+    tenants.addTenant({"acme", 1, 1000, 2, 100}, &acmeOtp);
+    tenants.addTenant({"globex", 1, 1000, 10, 100}, &globexAll);
+
+    TenantNotifier acmeNotifier(&tenants, "acme");
+    SignUpService acmeSignUp(&acmeNotifier);
+    for (int i = 0; i < 3; ++i)  // third one exceeds acme's burst quota
+        acmeSignUp.signUp(User("a" + to_string(i) + "@acme.com", "+15550002222"));
+    tenants.enqueue("globex", User("g@globex.co.uk", "07700 900123"));
+    tenants.dispatch(100);
+    tenants.printMetrics(cout);
+
+    // Push + webhook fan-out over a few multiplexed HTTP/2 connections
+    size_t peakStreams = 0;
+    Http2Client http([&](const string& authority) {
+        if (authority == "hooks.example.com")  // replies with a body
+            return make_unique<LoopbackHttp2Server>(100, 202, &peakStreams, "{\"accepted\":true}");
+        return make_unique<LoopbackHttp2Server>(100, 200, &peakStreams);
+    });
+    PushNotifier push(&http, "api.push.apple.com", "com.example.app");
+    WebhookNotifier hook(&http, "hooks.example.com", "/signup");
+    hook.notify(user);
+    for (int i = 0; i < 1000; ++i)
+        push.notify(User("d@example.com", "", "device" + to_string(i)));
+    http.run();
+    cout << "[Push] delivered=" << push.deliveredCount()
+         << " failed=" << push.failedCount()
+         << " connections=" << http.connectionsOpened()
+         << " peakStreams=" << peakStreams << "\n";
+
+    // Overload protection: signups are Critical, the promo push is Low and
+    // deferred (not lost) while the gate sheds
+    admission::Controller gate({8, chrono::milliseconds(5), chrono::milliseconds(100), 1024});
+    SignUpService gatedSignUp(&composite, nullptr, nullptr, &gate);
+    AdmissionNotifier promo(&push, &gate);
+    gatedSignUp.signUp(User("gated@example.com", "+15550004444"));
+    promo.notify(User("d@example.com", "", "device-promo"));
+    promo.flushDeferred(100);
+    http.run();
+    admission::Stats gateStats = gate.stats();
+    cout << "[Admission] admitted=" << gateStats.admittedTotal()
+         << " shed=" << gateStats.shedTotal() << " deferred=" << promo.deferredCount()
+         << " maxQueueDelayMs=" << gateStats.maxQueueDelayMs << "\n";
+
+    // Scheduled: reminder 24h after signup, digest at the user's local 9am
+    int64_t now = time(nullptr);
+    remove("notify-schedule.log");
+    {
+        NotificationScheduler scheduler("notify-schedule.log", now);
+        DelayedNotifier reminder(&scheduler, "reminder", 24 * 3600);
+        SignUpService remindSignUp(&reminder);
+        remindSignUp.signUp(User("late@example.com", "+15550003333"));
+        scheduler.scheduleAt(nextLocalTime(now, 330, 9), "digest",
+                             User("ist@example.in", "+919800000000"));
+        scheduler.sync();
+    }  // "crash": pending entries live only in the log now
+    NotificationScheduler scheduler("notify-schedule.log", now);
+    WelcomeEmailNotifier reminderEmail(&smtp);
+    scheduler.registerKind("reminder", &reminderEmail);
+    scheduler.registerKind("digest", &otp);
+    cout << "[Scheduler] recovered " << scheduler.pending() << " pending\n";
+    size_t fired = scheduler.advance(now + 24 * 3600);
+    cout << "[Scheduler] fired " << fired << "\n";
+    scheduler.compact();
 
-    User user("user@example.com", "+15550001111");
-    svc.signUp(user);
+    // Bulk welcome campaign: each NUMA node DKIM-signs its own shard of
+    // the audience, then one SMTP session per recipient domain
+    DkimKeyring dkimKeys;
+    if (!dkimKeys.add("example.com", "s2026", DkimKeyring::generate(true)))
+        cerr << "[DKIM] no signing key for example.com; mail goes out unsigned\n";
+    numa::NodeExecutors nodes;
+    vector<User> campaign = {User("a@example.com", ""), User("b@Example.com", ""),
+                             User("c@example.org", ""), User("not-an-address", "")};
+    CampaignSender welcome(&dkimKeys, &smtp, "noreply@example.com");
+    size_t rejected = 0;
+    welcome.sendShards(numa::scatter(nodes, campaign), nodes, "welcome", "Welcome!", &rejected);
+    cout << "[Campaign] " << rejected << " invalid address(es) skipped\n";
 
     return 0;
 }
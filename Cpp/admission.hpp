@@ -0,0 +1,202 @@
+// admission.hpp
+// Overload protection for request entry points (invoice processing,
+// signups). A Controller caps how many requests run at once and measures
+// how long admitted requests waited for a slot. When that queue delay
+// stays above `target` for a whole `interval` (the CoDel rule: a standing
+// queue, not a burst), the controller is overloaded: Low work is shed on
+// arrival and Normal work gives up after waiting `target`, so Critical
+// work keeps its latency. The overload ends once a request is admitted
+// with a short wait, or arrives to an empty queue.
+//
+//   admission::Ticket t = gate.admit(admission::Priority::Low);
+//   if (!t)
+//       return;  // shed: retry later or defer
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace admission {
+
+enum class Priority : uint8_t { Critical = 0, Normal = 1, Low = 2 };
+constexpr size_t kPriorities = 3;
+
+struct Config {
+    size_t maxConcurrent{64};
+    std::chrono::microseconds target{5000};     // acceptable queue delay
+    std::chrono::microseconds interval{100000};  // how long it may persist
+    size_t maxQueued{1024};                      // Critical may exceed this
+};
+
+struct Stats {
+    uint64_t admitted[kPriorities]{};
+    uint64_t shed[kPriorities]{};
+    uint64_t overloadEpisodes{0};
+    double maxQueueDelayMs{0};
+    size_t inFlight{0};
+    size_t queued{0};
+    bool overloaded{false};
+
+    uint64_t admittedTotal() const { return admitted[0] + admitted[1] + admitted[2]; }
+    uint64_t shedTotal() const { return shed[0] + shed[1] + shed[2]; }
+};
+
+class Controller;
+
+// Holds a concurrency slot until destroyed; false when the request was shed.
+class Ticket {
+private:
+    Controller* owner{nullptr};
+
+public:
+    Ticket() = default;
+    explicit Ticket(Controller* c) : owner(c) {}
+    Ticket(Ticket&& o) noexcept : owner(o.owner) { o.owner = nullptr; }
+    Ticket& operator=(Ticket&& o) noexcept {
+        std::swap(owner, o.owner);
+        return *this;
+    }
+    Ticket(const Ticket&) = delete;
+    Ticket& operator=(const Ticket&) = delete;
+    inline ~Ticket();
+
+    explicit operator bool() const { return owner != nullptr; }
+};
+
+class Controller {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    Config cfg;
+    mutable std::mutex mu;
+    std::condition_variable slotFreed;
+    size_t inFlight{0};
+    std::deque<uint64_t> waiting[kPriorities];  // FIFO per priority
+    uint64_t nextWaiter{0};
+    Clock::time_point firstAbove{};  // when delay above target turns into overload
+    bool overloaded{false};
+    Stats stats_;
+
+    size_t queuedCount() const {
+        return waiting[0].size() + waiting[1].size() + waiting[2].size();
+    }
+
+    bool higherWaiting(size_t p) const {
+        for (size_t q = 0; q < p; ++q)
+            if (!waiting[q].empty())
+                return true;
+        return false;
+    }
+
+    // CoDel state machine, fed with the queue delay of every Normal or Low
+    // request that got (or gave up on) a slot. Critical requests jump the
+    // queue, so their short waits say nothing about the standing queue.
+    void observe(Clock::duration delay, Clock::time_point now) {
+        if (delay < cfg.target) {
+            firstAbove = {};
+            overloaded = false;
+        } else if (firstAbove == Clock::time_point{}) {
+            firstAbove = now + cfg.interval;
+        } else if (now >= firstAbove && !overloaded) {
+            overloaded = true;
+            ++stats_.overloadEpisodes;
+        }
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> g(mu);
+            --inFlight;
+        }
+        slotFreed.notify_all();
+    }
+
+    friend class Ticket;
+
+public:
+    explicit Controller(Config c = {}) : cfg(c) {
+        cfg.maxConcurrent = std::max<size_t>(1, cfg.maxConcurrent);
+    }
+    Controller(const Controller&) = delete;
+    Controller& operator=(const Controller&) = delete;
+
+    // Waits for a slot (higher priorities first) unless the request is shed.
+    // Critical requests are never shed.
+    Ticket admit(Priority prio) {
+        size_t p = (size_t)prio;
+        auto arrived = Clock::now();
+        std::unique_lock<std::mutex> g(mu);
+        size_t queued = queuedCount();
+        if (queued == 0 && inFlight < cfg.maxConcurrent) {  // the standing queue has drained
+            firstAbove = {};
+            overloaded = false;
+        }
+        if (prio != Priority::Critical &&
+            ((overloaded && prio == Priority::Low) || queued >= cfg.maxQueued)) {
+            ++stats_.shed[p];
+            return Ticket();
+        }
+
+        uint64_t me = nextWaiter++;
+        waiting[p].push_back(me);
+        auto ready = [&] {
+            return inFlight < cfg.maxConcurrent && !higherWaiting(p) && waiting[p].front() == me;
+        };
+        bool got = true;
+        if (prio == Priority::Critical) {
+            slotFreed.wait(g, ready);
+        } else {
+            // A burst may be waited out; once overloaded, only the target.
+            auto patience = overloaded ? cfg.target : cfg.interval;
+            got = slotFreed.wait_until(g, arrived + patience, ready);
+        }
+        waiting[p].erase(std::find(waiting[p].begin(), waiting[p].end(), me));
+
+        auto now = Clock::now();
+        stats_.maxQueueDelayMs = std::max(
+            stats_.maxQueueDelayMs, std::chrono::duration<double, std::milli>(now - arrived).count());
+        if (prio != Priority::Critical)
+            observe(now - arrived, now);
+        if (!got) {
+            ++stats_.shed[p];
+            g.unlock();
+            slotFreed.notify_all();  // the next waiter may be unblocked now
+            return Ticket();
+        }
+        ++inFlight;
+        ++stats_.admitted[p];
+        if (inFlight < cfg.maxConcurrent && queuedCount()) {
+            g.unlock();
+            slotFreed.notify_all();  // a free slot for the next in line
+        }
+        return Ticket(this);
+    }
+
+    bool isOverloaded() const {
+        std::lock_guard<std::mutex> g(mu);
+        return overloaded;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> g(mu);
+        Stats s = stats_;
+        s.inFlight = inFlight;
+        s.queued = queuedCount();
+        s.overloaded = overloaded;
+        return s;
+    }
+
+    const Config& config() const { return cfg; }
+};
+
+inline Ticket::~Ticket() {
+    if (owner)
+        owner->release();
+}
+
+}  // namespace admission
@@ -0,0 +1,404 @@
+// alloc-profiler.hpp
+// Opt-in heap accounting for the assignment programs. Built with
+// -DALLOC_PROFILE, this header replaces global operator new/delete (each
+// program is a single translation unit, so it is included exactly once)
+// and charges every allocation to the innermost ALLOC_SCOPE on the
+// calling thread:
+//
+//   ALLOC_SCOPE("invoice.render");
+//
+// Per subsystem it keeps allocation/free counts, total and live bytes and
+// the live peak. About one allocation per `sampleBytes` of traffic also
+// records its call stack, so the report can name the hot allocation
+// sites. alloc::Session(path) rewrites a JSON breakdown at `path` every
+// second while the program runs and prints a summary on exit.
+//
+// Without ALLOC_PROFILE the scopes compile to nothing.
+#pragma once
+
+#include <cstdio>
+
+#ifdef ALLOC_PROFILE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+namespace alloc {
+
+constexpr size_t kMaxTags = 64;
+constexpr size_t kMaxSites = 1024;
+constexpr int kMaxFrames = 10;
+constexpr int kSkipFrames = 2;  // allocate() and operator new
+constexpr int64_t kSampleBytes = 256 * 1024;
+
+struct TagStats {
+    const char* name{nullptr};
+    std::atomic<uint64_t> allocs{0};
+    std::atomic<uint64_t> frees{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<int64_t> live{0};
+    std::atomic<int64_t> peak{0};
+};
+
+struct Site {
+    uint64_t hash;
+    void* frames[kMaxFrames];
+    int depth;
+    uint16_t tag;
+    uint64_t samples;
+    uint64_t bytes;  // estimated from the sampling rate
+};
+
+// Everything here is zero-initialized static storage: the hooks run
+// before and after main and must not allocate themselves.
+struct State {
+    TagStats tags[kMaxTags];
+    std::atomic<size_t> tagCount{1};
+    std::atomic_flag tagLock = ATOMIC_FLAG_INIT;
+    Site sites[kMaxSites];
+    std::atomic_flag siteLock = ATOMIC_FLAG_INIT;
+    uint64_t sitesDropped{0};
+};
+
+inline State& state() {
+    static State s;
+    return s;
+}
+
+struct ThreadState {
+    uint16_t tag;
+    bool inHook;
+    int64_t untilSample;
+};
+
+inline ThreadState& threadState() {
+    static thread_local ThreadState t{0, false, kSampleBytes};
+    return t;
+}
+
+// Header in front of every block; `offset` leads back to the raw pointer
+// for over-aligned allocations.
+struct alignas(16) Header {
+    uint64_t size;
+    uint32_t offset;
+    uint16_t tag;
+    uint16_t magic;
+};
+constexpr uint16_t kMagic = 0xA110;
+
+class SpinGuard {
+    std::atomic_flag& f;
+public:
+    explicit SpinGuard(std::atomic_flag& flag) : f(flag) {
+        while (f.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+    ~SpinGuard() { f.clear(std::memory_order_release); }
+};
+
+inline uint16_t tagId(const char* name) {
+    State& s = state();
+    SpinGuard g(s.tagLock);
+    size_t n = s.tagCount.load(std::memory_order_relaxed);
+    for (size_t i = 1; i < n; ++i)
+        if (strcmp(s.tags[i].name, name) == 0)
+            return (uint16_t)i;
+    if (n == kMaxTags)
+        return 0;
+    s.tags[n].name = name;
+    s.tagCount.store(n + 1, std::memory_order_release);
+    return (uint16_t)n;
+}
+
+class Scope {
+    uint16_t saved;
+public:
+    explicit Scope(uint16_t tag) : saved(threadState().tag) { threadState().tag = tag; }
+    ~Scope() { threadState().tag = saved; }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+};
+
+inline void sample(size_t size, uint16_t tag) {
+    ThreadState& t = threadState();
+    t.inHook = true;
+    void* frames[kMaxFrames + kSkipFrames];
+    int depth = backtrace(frames, kMaxFrames + kSkipFrames) - kSkipFrames;
+    t.inHook = false;
+    if (depth <= 0)
+        return;
+    uint64_t h = 1469598103934665603ULL ^ tag;
+    for (int i = 0; i < depth; ++i)
+        h = (h ^ (uint64_t)frames[i + kSkipFrames]) * 1099511628211ULL;
+    h |= 1;
+
+    State& s = state();
+    SpinGuard g(s.siteLock);
+    for (size_t probe = 0; probe < 64; ++probe) {
+        Site& site = s.sites[(h + probe) % kMaxSites];
+        if (site.hash == 0) {
+            site.hash = h;
+            memcpy(site.frames, frames + kSkipFrames, sizeof(void*) * depth);
+            site.depth = depth;
+            site.tag = tag;
+        }
+        if (site.hash == h) {
+            ++site.samples;
+            site.bytes += size < (size_t)kSampleBytes ? kSampleBytes : size;
+            return;
+        }
+    }
+    ++s.sitesDropped;
+}
+
+inline void* allocate(size_t size, size_t align, bool nothrow) {
+    size_t pad = align > sizeof(Header) ? align : sizeof(Header);
+    char* raw;
+    if (align > alignof(std::max_align_t))
+        raw = (char*)aligned_alloc(align, (size + pad + align - 1) / align * align);
+    else
+        raw = (char*)malloc(size + pad);
+    if (!raw) {
+        if (nothrow)
+            return nullptr;
+        throw std::bad_alloc();
+    }
+    ThreadState& t = threadState();
+    Header* h = (Header*)(raw + pad) - 1;
+    h->size = size;
+    h->offset = (uint32_t)pad;
+    h->tag = t.tag;
+    h->magic = kMagic;
+
+    TagStats& ts = state().tags[t.tag];
+    ts.allocs.fetch_add(1, std::memory_order_relaxed);
+    ts.bytes.fetch_add(size, std::memory_order_relaxed);
+    int64_t live = ts.live.fetch_add((int64_t)size, std::memory_order_relaxed) + (int64_t)size;
+    int64_t peak = ts.peak.load(std::memory_order_relaxed);
+    while (live > peak && !ts.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+        ;
+
+    if (!t.inHook && (t.untilSample -= (int64_t)size) <= 0) {
+        t.untilSample = kSampleBytes;
+        sample(size, h->tag);
+    }
+    return raw + pad;
+}
+
+inline void release(void* p) {
+    if (!p)
+        return;
+    Header* h = (Header*)p - 1;
+    if (h->magic != kMagic) {  // not ours; should not happen
+        free(p);
+        return;
+    }
+    TagStats& ts = state().tags[h->tag];
+    ts.frees.fetch_add(1, std::memory_order_relaxed);
+    ts.live.fetch_sub((int64_t)h->size, std::memory_order_relaxed);
+    h->magic = 0;
+    free((char*)p - h->offset);
+}
+
+inline void writeJson(FILE* f) {
+    State& s = state();
+    fprintf(f, "{\"sample_bytes\":%lld,\"subsystems\":[", (long long)kSampleBytes);
+    size_t n = s.tagCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+        TagStats& t = s.tags[i];
+        fprintf(f,
+                "%s\n{\"name\":\"%s\",\"allocs\":%llu,\"frees\":%llu,\"bytes\":%llu,"
+                "\"live\":%lld,\"peak\":%lld}",
+                i ? "," : "", i ? t.name : "untagged", (unsigned long long)t.allocs.load(),
+                (unsigned long long)t.frees.load(), (unsigned long long)t.bytes.load(),
+                (long long)t.live.load(), (long long)t.peak.load());
+    }
+    fprintf(f, "\n],\"sites\":[");
+    bool first = true;
+    SpinGuard g(s.siteLock);
+    for (auto& site : s.sites) {
+        if (!site.hash)
+            continue;
+        fprintf(f, "%s\n{\"subsystem\":\"%s\",\"samples\":%llu,\"bytes\":%llu,\"frames\":[",
+                first ? "" : ",", site.tag ? s.tags[site.tag].name : "untagged",
+                (unsigned long long)site.samples, (unsigned long long)site.bytes);
+        for (int i = 0; i < site.depth; ++i)
+            fprintf(f, "%s\"%p\"", i ? "," : "", site.frames[i]);
+        fprintf(f, "]}");
+        first = false;
+    }
+    fprintf(f, "\n],\"sites_dropped\":%llu}\n", (unsigned long long)s.sitesDropped);
+}
+
+// "module(mangled+0x1f)" -> demangled name, or the raw symbol.
+inline std::string symbolize(void* frame) {
+    char** sym = backtrace_symbols(&frame, 1);
+    if (!sym)
+        return "?";
+    std::string raw = sym[0];
+    free(sym);
+    size_t open = raw.find('('), plus = raw.find('+', open);
+    if (open == std::string::npos || plus == std::string::npos || plus == open + 1)
+        return raw;
+    std::string mangled = raw.substr(open + 1, plus - open - 1);
+    int status = 0;
+    char* name = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+    std::string out = status == 0 && name ? name : mangled;
+    free(name);
+    return out;
+}
+
+// Subsystem table and the top sites by sampled bytes. A site's first
+// frame is often inside the standard library, so the first frame from
+// the program itself is shown as well.
+inline void printSummary(FILE* f, size_t topSites = 8) {
+    State& s = state();
+    fprintf(f, "[Alloc] %-28s %12s %12s %14s %12s %12s\n", "subsystem", "allocs", "frees",
+            "bytes", "live", "peak");
+    size_t n = s.tagCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+        TagStats& t = s.tags[i];
+        fprintf(f, "[Alloc] %-28s %12llu %12llu %14llu %12lld %12lld\n",
+                i ? t.name : "untagged", (unsigned long long)t.allocs.load(),
+                (unsigned long long)t.frees.load(), (unsigned long long)t.bytes.load(),
+                (long long)t.live.load(), (long long)t.peak.load());
+    }
+    Site top[16];
+    size_t found = 0;
+    {
+        SpinGuard g(s.siteLock);
+        const Site* used[kMaxSites];
+        size_t nUsed = 0;
+        for (auto& site : s.sites)
+            if (site.hash)
+                used[nUsed++] = &site;
+        found = std::min({topSites, nUsed, (size_t)16});
+        std::partial_sort(used, used + found, used + nUsed,
+                          [](const Site* a, const Site* b) { return a->bytes > b->bytes; });
+        for (size_t i = 0; i < found; ++i)
+            top[i] = *used[i];
+    }
+    for (size_t i = 0; i < found; ++i) {
+        const Site& site = top[i];
+        std::string where = symbolize(site.frames[0]), caller;
+        for (int k = 1; k < site.depth && caller.empty(); ++k) {
+            std::string sym = symbolize(site.frames[k]);
+            if (sym.compare(0, 5, "std::") != 0 && sym.compare(0, 9, "__gnu_cxx") != 0 &&
+                sym.find("operator new") == std::string::npos)
+                caller = sym;
+        }
+        fprintf(f, "[Alloc] site #%zu %s ~%llu bytes (%llu samples): %s%s%s\n", i + 1,
+                site.tag ? s.tags[site.tag].name : "untagged",
+                (unsigned long long)site.bytes, (unsigned long long)site.samples,
+                where.substr(0, 80).c_str(), caller.empty() ? "" : " <- ",
+                caller.substr(0, 80).c_str());
+    }
+}
+
+class Session {
+private:
+    std::string path;
+    std::mutex mu;
+    std::condition_variable cv;
+    bool stopping{false};
+    std::thread writer;
+
+    void dump() {
+        std::string tmp = path + ".tmp";
+        if (FILE* f = fopen(tmp.c_str(), "w")) {
+            writeJson(f);
+            fclose(f);
+            rename(tmp.c_str(), path.c_str());
+        }
+    }
+
+public:
+    explicit Session(const char* out) : path(out ? out : "") {
+        if (path.empty())
+            return;
+        writer = std::thread([this] {
+            static const uint16_t self = tagId("alloc.profiler");
+            Scope scope(self);
+            std::unique_lock<std::mutex> lk(mu);
+            while (!cv.wait_for(lk, std::chrono::seconds(1), [this] { return stopping; }))
+                dump();
+        });
+    }
+    ~Session() {
+        if (path.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> g(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        writer.join();
+        dump();
+        printSummary(stderr);
+    }
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+};
+
+}  // namespace alloc
+
+#define ALLOC_CONCAT_(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_(a, b)
+#define ALLOC_SCOPE(name)                                                           \
+    static const uint16_t ALLOC_CONCAT(allocTag_, __LINE__) = ::alloc::tagId(name); \
+    ::alloc::Scope ALLOC_CONCAT(allocScope_, __LINE__)(ALLOC_CONCAT(allocTag_, __LINE__))
+
+void* operator new(std::size_t n) { return alloc::allocate(n, 0, false); }
+void* operator new[](std::size_t n) { return alloc::allocate(n, 0, false); }
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept {
+    return alloc::allocate(n, 0, true);
+}
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept {
+    return alloc::allocate(n, 0, true);
+}
+void* operator new(std::size_t n, std::align_val_t a) {
+    return alloc::allocate(n, (size_t)a, false);
+}
+void* operator new[](std::size_t n, std::align_val_t a) {
+    return alloc::allocate(n, (size_t)a, false);
+}
+void operator delete(void* p) noexcept { alloc::release(p); }
+void operator delete[](void* p) noexcept { alloc::release(p); }
+void operator delete(void* p, std::size_t) noexcept { alloc::release(p); }
+void operator delete[](void* p, std::size_t) noexcept { alloc::release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { alloc::release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { alloc::release(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { alloc::release(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { alloc::release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { alloc::release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { alloc::release(p); }
+
+#else  // !ALLOC_PROFILE
+
+namespace alloc {
+
+class Session {
+public:
+    explicit Session(const char* out) {
+        if (out)
+            fprintf(stderr, "[Alloc] profiling not built in; rebuild with -DALLOC_PROFILE\n");
+    }
+};
+
+}  // namespace alloc
+
+#define ALLOC_SCOPE(name) ((void)0)
+
+#endif  // ALLOC_PROFILE
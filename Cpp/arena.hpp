@@ -0,0 +1,234 @@
+// arena.hpp
+// Bump arena on 2MB pages for large batch data (invoice line items, user
+// lists), so walking a few hundred MB touches hundreds of TLB entries
+// instead of tens of thousands. Each region is tried as explicit huge
+// pages (MAP_HUGETLB, needs vm.nr_hugepages), then as a 2MB-aligned
+// mapping with madvise(MADV_HUGEPAGE) for transparent huge pages, then
+// plain 4KB pages.
+//
+//   arena::HugePageArena batchMemory;
+//   vector<LineItem, arena::Allocator<LineItem>> items{arena::Allocator<LineItem>(&batchMemory)};
+//
+// Memory is released only by reset() or destruction; deallocate is a
+// no-op. A default-constructed Allocator has no arena and uses the heap,
+// and so does a copy-constructed container (e.g. numa::scatter's shards),
+// which may outlive the arena its source lives in. Copy-assignment keeps
+// the destination's allocator; moves and swaps take the source's arena.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <sys/mman.h>
+
+namespace arena {
+
+constexpr size_t kHugePage = 2u << 20;
+
+enum class Backing { Explicit, Transparent, Regular };
+
+inline const char* backingName(Backing b) {
+    switch (b) {
+    case Backing::Explicit:
+        return "hugetlb";
+    case Backing::Transparent:
+        return "thp";
+    default:
+        return "4k";
+    }
+}
+
+// Which page sizes an arena may use; Regular also opts out of THP so it
+// is a fair 4KB baseline when THP is set to "always".
+enum class Pages { Huge, Regular };
+
+struct Region {
+    char* base{nullptr};
+    size_t size{0};
+    Backing backing{Backing::Regular};
+};
+
+inline Region mapRegion(size_t bytes, Pages pages) {
+    size_t size = (bytes + kHugePage - 1) & ~(kHugePage - 1);
+    Region r;
+    r.size = size;
+    if (pages == Pages::Huge) {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+        if (p != MAP_FAILED) {
+            r.base = (char*)p;
+            r.backing = Backing::Explicit;
+            return r;
+        }
+    }
+
+    // Over-map by one huge page and trim, so the region is 2MB aligned
+    // and every 2MB of it can be a huge page.
+    void* p = mmap(nullptr, size + kHugePage, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        r.size = 0;
+        return r;
+    }
+    uintptr_t start = (uintptr_t)p, aligned = (start + kHugePage - 1) & ~(uintptr_t)(kHugePage - 1);
+    if (aligned > start)
+        munmap(p, aligned - start);
+    if (aligned + size < start + size + kHugePage)
+        munmap((void*)(aligned + size), start + size + kHugePage - (aligned + size));
+    r.base = (char*)aligned;
+    if (pages == Pages::Huge && madvise(r.base, size, MADV_HUGEPAGE) == 0)
+        r.backing = Backing::Transparent;
+    else
+        madvise(r.base, size, MADV_NOHUGEPAGE);
+    return r;
+}
+
+class HugePageArena {
+private:
+    std::mutex mu;
+    std::vector<Region> regions;
+    size_t chunk;
+    Pages pages;
+    size_t current{0};  // region being bumped
+    size_t offset{0};
+    size_t used{0};
+
+public:
+    explicit HugePageArena(size_t chunkBytes = 64u << 20, Pages p = Pages::Huge)
+        : chunk(chunkBytes), pages(p) {}
+    ~HugePageArena() {
+        for (auto& r : regions)
+            munmap(r.base, r.size);
+    }
+    HugePageArena(const HugePageArena&) = delete;
+    HugePageArena& operator=(const HugePageArena&) = delete;
+
+    // nullptr when no memory could be mapped.
+    void* allocate(size_t n, size_t align) {
+        std::lock_guard<std::mutex> g(mu);
+        for (; current < regions.size(); ++current, offset = 0) {
+            Region& r = regions[current];
+            size_t at = (offset + align - 1) & ~(align - 1);
+            if (at + n <= r.size) {
+                offset = at + n;
+                used += n;
+                return r.base + at;
+            }
+        }
+        Region r = mapRegion(n > chunk ? n : chunk, pages);
+        if (!r.base)
+            return nullptr;
+        regions.push_back(r);
+        current = regions.size() - 1;
+        offset = n;
+        used += n;
+        return r.base;
+    }
+
+    // Forgets every allocation but keeps the mappings (and their huge
+    // pages) for the next batch. Only safe once nothing uses the memory.
+    void reset() {
+        std::lock_guard<std::mutex> g(mu);
+        current = offset = used = 0;
+    }
+
+    size_t bytesUsed() {
+        std::lock_guard<std::mutex> g(mu);
+        return used;
+    }
+
+    size_t bytesMapped() {
+        std::lock_guard<std::mutex> g(mu);
+        size_t n = 0;
+        for (auto& r : regions)
+            n += r.size;
+        return n;
+    }
+
+    // Best backing the first region got (later ones may have fallen back).
+    Backing backing() {
+        std::lock_guard<std::mutex> g(mu);
+        return regions.empty() ? Backing::Regular : regions[0].backing;
+    }
+
+    // Bytes of this arena the kernel actually backs with huge pages, from
+    // /proc/self/smaps (AnonHugePages for THP, the whole VMA for hugetlb).
+    size_t hugeBytes() {
+        std::lock_guard<std::mutex> g(mu);
+        FILE* f = fopen("/proc/self/smaps", "r");
+        if (!f)
+            return 0;
+        size_t total = 0;
+        char line[512];
+        bool mine = false;
+        Backing vma = Backing::Regular;
+        while (fgets(line, sizeof(line), f)) {
+            unsigned long lo, hi;
+            if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {  // a new mapping
+                mine = false;
+                for (auto& r : regions)
+                    if ((uintptr_t)r.base < hi && lo < (uintptr_t)r.base + r.size) {
+                        mine = true;
+                        vma = r.backing;
+                    }
+                if (mine && vma == Backing::Explicit)
+                    total += hi - lo;
+                continue;
+            }
+            unsigned long kb;
+            if (mine && vma != Backing::Explicit && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+                total += kb << 10;
+        }
+        fclose(f);
+        return total;
+    }
+};
+
+// std-compatible allocator over an arena; heap when constructed without one.
+template <class T>
+class Allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    HugePageArena* source{nullptr};
+
+    Allocator() = default;
+    explicit Allocator(HugePageArena* a) : source(a) {}
+    template <class U>
+    Allocator(const Allocator<U>& o) : source(o.source) {}
+
+    Allocator select_on_container_copy_construction() const { return Allocator(); }
+
+    T* allocate(size_t n) {
+        if (!source)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        void* p = source->allocate(n * sizeof(T), alignof(T));
+        if (!p)
+            throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) {
+        if (!source)
+            ::operator delete(p);
+    }
+
+    template <class U>
+    bool operator==(const Allocator<U>& o) const { return source == o.source; }
+    template <class U>
+    bool operator!=(const Allocator<U>& o) const { return source != o.source; }
+};
+
+// Copies must never pick up the source's arena.
+static_assert(!std::allocator_traits<Allocator<int>>::propagate_on_container_copy_assignment::value,
+              "copy-assignment keeps the destination's allocator");
+
+}  // namespace arena
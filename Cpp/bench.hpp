@@ -0,0 +1,439 @@
+// bench.hpp
+// Benchmark harness shared by the assignment programs. Each case runs
+// `reps` times after a warm-up; every rep records wall time plus
+// perf_event_open counters (cycles, instructions, cache, branch and dTLB
+// misses, page faults, context switches) for the calling thread. Results
+// go to stdout and, with --json, to one JSON object per case per line;
+// --bench-compare flags cases whose wall time or IPC regressed
+// significantly. Counters cover the calling thread only, not pool workers.
+//
+//   bench::Suite suite("01-invoice");
+//   suite.add("process_batch", [&] { ...; return itemsDone; });
+//   return bench::main(suite, argc, argv);  // --bench [--reps N] [--json F]
+//
+// The warm-up is a full untimed run, so a case costs reps + 1 runs. Work
+// a rep needs but shouldn't be timed for (fresh files, forked workers)
+// goes in the optional setup and teardown hooks, which run around every
+// rep outside the clock and counters.
+//
+// Counters the kernel or hypervisor doesn't expose are reported as null.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace bench {
+
+enum Counter { Cycles, Instructions, CacheMisses, BranchMisses, PageFaults, ContextSwitches,
+               DtlbMisses, kCounters };
+
+inline const char* counterName(int c) {
+    static const char* names[kCounters] = {"cycles",        "instructions", "cache_misses",
+                                           "branch_misses", "page_faults",  "context_switches",
+                                           "dtlb_misses"};
+    return names[c];
+}
+
+// One independent event per counter, so a missing PMU event doesn't take
+// the others down with it. Values are scaled when the kernel multiplexed.
+class PerfCounters {
+private:
+    int fds[kCounters];
+
+    static int openEvent(uint32_t type, uint64_t config) {
+        perf_event_attr a;
+        memset(&a, 0, sizeof(a));
+        a.size = sizeof(a);
+        a.type = type;
+        a.config = config;
+        a.disabled = 1;
+        // Software events (faults, switches) happen in the kernel by definition.
+        a.exclude_kernel = type != PERF_TYPE_SOFTWARE;
+        a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int)syscall(SYS_perf_event_open, &a, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+
+public:
+    PerfCounters() {
+        fds[Cycles] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[Instructions] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[CacheMisses] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds[BranchMisses] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fds[PageFaults] = openEvent(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+        fds[ContextSwitches] = openEvent(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+        fds[DtlbMisses] = openEvent(PERF_TYPE_HW_CACHE,
+                                    PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                        PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+    ~PerfCounters() {
+        for (int fd : fds)
+            if (fd >= 0)
+                close(fd);
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available(int c) const { return fds[c] >= 0; }
+
+    void start() {
+        for (int fd : fds)
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+    }
+
+    void stop() {
+        for (int fd : fds)
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    // -1 when unavailable.
+    double read(int c) const {
+        if (fds[c] < 0)
+            return -1;
+        uint64_t v[3];
+        if (::read(fds[c], v, sizeof(v)) != (ssize_t)sizeof(v))
+            return -1;
+        return v[2] ? (double)v[0] * v[1] / v[2] : (double)v[0];
+    }
+};
+
+struct Stats {
+    double median{0}, mean{0}, stddev{0}, min{0};
+};
+
+inline Stats summarize(std::vector<double> xs) {
+    Stats s;
+    if (xs.empty())
+        return s;
+    std::sort(xs.begin(), xs.end());
+    size_t n = xs.size();
+    s.min = xs[0];
+    s.median = n % 2 ? xs[n / 2] : (xs[n / 2 - 1] + xs[n / 2]) / 2;
+    for (double x : xs)
+        s.mean += x;
+    s.mean /= n;
+    for (double x : xs)
+        s.stddev += (x - s.mean) * (x - s.mean);
+    s.stddev = n > 1 ? std::sqrt(s.stddev / (n - 1)) : 0;
+    return s;
+}
+
+// Welch's t statistic for b against a; 0 unless both have two samples.
+inline double welchT(const std::vector<double>& a, const std::vector<double>& b) {
+    if (a.size() < 2 || b.size() < 2)
+        return 0;
+    Stats sa = summarize(a), sb = summarize(b);
+    double se = std::sqrt(sa.stddev * sa.stddev / a.size() + sb.stddev * sb.stddev / b.size());
+    return se > 0 ? (sb.mean - sa.mean) / se : 0;
+}
+
+struct Result {
+    std::string program;
+    std::string name;
+    double items{0};                       // per rep, as returned by the case
+    std::vector<double> wallNs;            // one sample per rep
+    std::vector<double> ipc;               // one sample per rep, if counted
+    double counters[kCounters];            // per-rep medians, -1 if missing
+};
+
+// A case returns how many items (invoices, samples, messages...) one run
+// processed, so results can be normalized per item.
+using Case = std::function<double()>;
+using Hook = std::function<void()>;
+
+class Suite {
+private:
+    struct Entry {
+        std::string name;
+        Case run;
+        Hook setup, teardown;
+    };
+
+    std::string program;
+    std::vector<Entry> cases;
+
+public:
+    explicit Suite(const std::string& programName) : program(programName) {}
+
+    void add(const std::string& name, Case c, Hook setup = {}, Hook teardown = {}) {
+        cases.push_back({name, std::move(c), std::move(setup), std::move(teardown)});
+    }
+
+    std::vector<Result> run(size_t reps, const std::string& filter = "") {
+        std::vector<Result> results;
+        PerfCounters pc;
+        for (auto& e : cases) {
+            if (!filter.empty() && e.name.find(filter) == std::string::npos)
+                continue;
+            Result r;
+            r.program = program;
+            r.name = e.name;
+            std::vector<double> samples[kCounters];
+            // Rep 0 is the warm-up: page in data, fill caches and branch history.
+            for (size_t i = 0; i <= reps; ++i) {
+                if (e.setup)
+                    e.setup();
+                pc.start();
+                auto t0 = std::chrono::steady_clock::now();
+                double items = e.run();
+                auto t1 = std::chrono::steady_clock::now();
+                pc.stop();
+                if (e.teardown)
+                    e.teardown();
+                if (i == 0)
+                    continue;
+                r.items = items;
+                r.wallNs.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+                for (int c = 0; c < kCounters; ++c)
+                    samples[c].push_back(pc.read(c));
+                if (samples[Cycles].back() > 0 && samples[Instructions].back() >= 0)
+                    r.ipc.push_back(samples[Instructions].back() / samples[Cycles].back());
+            }
+            for (int c = 0; c < kCounters; ++c)
+                r.counters[c] = pc.available(c) ? summarize(samples[c]).median : -1;
+            results.push_back(std::move(r));
+        }
+        return results;
+    }
+};
+
+inline void print(const Result& r) {
+    Stats w = summarize(r.wallNs);
+    printf("[bench] %s/%s: %.3f ms median (+/- %.1f%%), %.1f ns/item", r.program.c_str(),
+           r.name.c_str(), w.median / 1e6, w.mean ? 100 * w.stddev / w.mean : 0,
+           r.items ? w.median / r.items : 0);
+    if (r.counters[Cycles] > 0 && r.counters[Instructions] >= 0)
+        printf(", IPC %.2f", r.counters[Instructions] / r.counters[Cycles]);
+    if (r.counters[CacheMisses] >= 0 && r.items)
+        printf(", %.3f cache misses/item", r.counters[CacheMisses] / r.items);
+    if (r.counters[BranchMisses] >= 0 && r.items)
+        printf(", %.3f branch misses/item", r.counters[BranchMisses] / r.items);
+    if (r.counters[DtlbMisses] >= 0 && r.items)
+        printf(", %.3f dTLB misses/item", r.counters[DtlbMisses] / r.items);
+    if (r.counters[Cycles] < 0)
+        printf(" (no PMU: %.0f page faults, %.0f ctx switches)", r.counters[PageFaults],
+               r.counters[ContextSwitches]);
+    printf("\n");
+}
+
+inline void writeJson(FILE* f, const Result& r) {
+    Stats w = summarize(r.wallNs);
+    fprintf(f, "{\"program\":\"%s\",\"bench\":\"%s\",\"reps\":%zu,\"items\":%.0f,",
+            r.program.c_str(), r.name.c_str(), r.wallNs.size(), r.items);
+    fprintf(f, "\"wall_ns\":{\"median\":%.0f,\"mean\":%.0f,\"stddev\":%.0f,\"min\":%.0f},",
+            w.median, w.mean, w.stddev, w.min);
+    fprintf(f, "\"samples_ns\":[");
+    for (size_t i = 0; i < r.wallNs.size(); ++i)
+        fprintf(f, "%s%.0f", i ? "," : "", r.wallNs[i]);
+    fprintf(f, "],\"ipc_samples\":[");
+    for (size_t i = 0; i < r.ipc.size(); ++i)
+        fprintf(f, "%s%.4f", i ? "," : "", r.ipc[i]);
+    fprintf(f, "]");
+    for (int c = 0; c < kCounters; ++c) {
+        if (r.counters[c] < 0)
+            fprintf(f, ",\"%s\":null", counterName(c));
+        else
+            fprintf(f, ",\"%s\":%.0f", counterName(c), r.counters[c]);
+    }
+    if (r.counters[Cycles] > 0 && r.counters[Instructions] >= 0)
+        fprintf(f, ",\"ipc\":%.4f", r.counters[Instructions] / r.counters[Cycles]);
+    else
+        fprintf(f, ",\"ipc\":null");
+    fprintf(f, "}\n");
+}
+
+// ---- comparison of two --json files ----
+
+namespace detail {
+
+// Our own one-object-per-line output only; not a general JSON parser.
+inline bool field(const std::string& line, const std::string& key, std::string& out) {
+    std::string k = "\"" + key + "\":";
+    size_t p = line.find(k);
+    if (p == std::string::npos)
+        return false;
+    p += k.size();
+    size_t e = p;
+    if (line[p] == '"') {
+        e = line.find('"', p + 1);
+        out = line.substr(p + 1, e - p - 1);
+    } else if (line[p] == '[') {
+        e = line.find(']', p);
+        out = line.substr(p + 1, e - p - 1);
+    } else {
+        e = line.find_first_of(",}", p);
+        out = line.substr(p, e - p);
+    }
+    return true;
+}
+
+inline double number(const std::string& line, const std::string& key) {
+    std::string v;
+    if (!field(line, key, v) || v == "null")
+        return -1;
+    return strtod(v.c_str(), nullptr);
+}
+
+inline std::map<std::string, std::string> load(const char* path) {
+    std::map<std::string, std::string> byName;
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return byName;
+    char buf[1 << 16];
+    while (fgets(buf, sizeof(buf), f)) {
+        std::string line(buf), prog, name;
+        if (field(line, "program", prog) && field(line, "bench", name))
+            byName[prog + "/" + name] = line;
+    }
+    fclose(f);
+    return byName;
+}
+
+inline std::vector<double> samples(const std::string& line, const char* key = "samples_ns") {
+    std::vector<double> xs;
+    std::string v;
+    if (!field(line, key, v))
+        return xs;
+    for (const char* p = v.c_str(); *p;) {
+        char* end;
+        double x = strtod(p, &end);
+        if (end == p)
+            break;
+        xs.push_back(x);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return xs;
+}
+
+}  // namespace detail
+
+// Welch's t-test on the per-rep samples; a case regresses when it is
+// more than `threshold` slower and t > 2.5, or (with counters) when its
+// IPC dropped by more than `threshold` and t < -2.5. Cases with fewer
+// than two samples on either side are reported but never judged.
+// Returns the number of regressions.
+inline int compare(const char* basePath, const char* newPath, double threshold = 0.05) {
+    auto base = detail::load(basePath), cur = detail::load(newPath);
+    int regressions = 0;
+    for (auto& [key, line] : cur) {
+        auto it = base.find(key);
+        if (it == base.end())
+            continue;
+        std::vector<double> wa = detail::samples(it->second), wb = detail::samples(line);
+        std::vector<double> ia = detail::samples(it->second, "ipc_samples"),
+                            ib = detail::samples(line, "ipc_samples");
+        Stats a = summarize(wa), b = summarize(wb);
+        double t = welchT(wa, wb), tIpc = welchT(ia, ib);
+        double delta = a.median ? b.median / a.median - 1 : 0;
+        double ipcA = detail::number(it->second, "ipc"), ipcB = detail::number(line, "ipc");
+        double ipcDelta = ipcA > 0 && ipcB > 0 ? ipcB / ipcA - 1 : 0;
+
+        bool judged = wa.size() >= 2 && wb.size() >= 2;
+        bool slower = judged && delta > threshold && t > 2.5;
+        bool ipcDrop = ipcDelta < -threshold && tIpc < -2.5;
+        const char* verdict = !judged                ? "too few reps to compare"
+                              : slower || ipcDrop    ? "REGRESSION"
+                              : delta < -threshold && t < -2.5 ? "improved"
+                                                               : "same";
+        printf("%-40s %+7.1f%% wall (t=%+.1f)", key.c_str(), 100 * delta, t);
+        if (ipcA > 0 && ipcB > 0)
+            printf(" %+6.1f%% IPC (t=%+.1f)", 100 * ipcDelta, tIpc);
+        printf("  %s\n", verdict);
+        regressions += slower || ipcDrop;
+    }
+    return regressions;
+}
+
+// Median ns per item for every case across several result files (e.g.
+// one per build variant), side by side, with the speed-up over the first.
+inline void table(const std::vector<const char*>& paths) {
+    std::vector<std::map<std::string, std::string>> runs;
+    std::map<std::string, bool> keys;
+    for (const char* p : paths) {
+        runs.push_back(detail::load(p));
+        for (auto& kv : runs.back())
+            keys[kv.first] = true;
+    }
+    printf("%-34s", "case (ns/item)");
+    for (const char* p : paths)
+        printf(" %18s", p);
+    printf("\n");
+    for (auto& [key, _] : keys) {
+        printf("%-34s", key.c_str());
+        double first = -1;
+        for (auto& run : runs) {
+            auto it = run.find(key);
+            if (it == run.end()) {
+                printf(" %18s", "-");
+                continue;
+            }
+            double median = detail::number(it->second, "median");  // of wall_ns
+            double items = detail::number(it->second, "items");
+            double perItem = items > 0 ? median / items : median;
+            if (first < 0) {
+                first = perItem;
+                printf(" %18.1f", perItem);
+            } else {
+                printf(" %10.1f (%4.2fx)", perItem, perItem > 0 ? first / perItem : 0);
+            }
+        }
+        printf("\n");
+    }
+}
+
+// Handles the harness flags; returns -1 when argv isn't a bench invocation.
+//   --bench [--reps N] [--json FILE] [--filter SUBSTR]
+//   --bench-compare BASE.json NEW.json
+//   --bench-table A.json B.json ...
+// Other arguments are left to the program. --json appends, and on compare
+// the last line per case wins. Fewer than 2 reps can't be compared later.
+inline int main(Suite& suite, int argc, char** argv, size_t defaultReps = 5) {
+    if (argc > 3 && std::string(argv[1]) == "--bench-compare")
+        return compare(argv[2], argv[3]) ? 1 : 0;
+    if (argc > 2 && std::string(argv[1]) == "--bench-table") {
+        table(std::vector<const char*>(argv + 2, argv + argc));
+        return 0;
+    }
+    if (argc < 2 || std::string(argv[1]) != "--bench")
+        return -1;
+    size_t reps = defaultReps;
+    std::string json, filter;
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "--reps")
+            reps = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (flag == "--json")
+            json = argv[++i];
+        else if (flag == "--filter")
+            filter = argv[++i];
+    }
+    auto results = suite.run(reps, filter);
+    FILE* f = json.empty() ? nullptr : fopen(json.c_str(), "a");
+    for (auto& r : results) {
+        print(r);
+        if (f)
+            writeJson(f, r);
+    }
+    if (f)
+        fclose(f);
+    return 0;
+}
+
+}  // namespace bench
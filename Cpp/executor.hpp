@@ -0,0 +1,346 @@
+// executor.hpp
+// Shared work-stealing executor for the assignment programs. One pool per
+// process, sized to the machine, so invoice batches, media jobs and
+// notification fan-out share the cores instead of each bringing threads.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+namespace exec {
+
+// Tasks must not throw.
+using Task = std::function<void()>;
+
+// Idle workers take High work from any queue before Normal from their own.
+enum class Priority : uint8_t { High = 0, Normal = 1, Low = 2 };
+constexpr size_t kPriorities = 3;
+
+class Executor {
+private:
+    class SpinLock {
+        std::atomic_flag f = ATOMIC_FLAG_INIT;
+    public:
+        void lock() {
+            while (f.test_and_set(std::memory_order_acquire))
+                std::this_thread::yield();
+        }
+        void unlock() { f.clear(std::memory_order_release); }
+    };
+
+    // Owner pushes and pops at the back (LIFO keeps data warm); thieves
+    // take from the front, where the oldest and usually largest work is.
+    struct alignas(64) Worker {
+        SpinLock lock;
+        std::deque<Task> queues[kPriorities];
+        std::atomic<uint64_t> stolen{0};
+    };
+
+    struct Slot {
+        const Executor* owner{nullptr};
+        size_t index{0};
+    };
+
+    static Slot& current() {
+        static thread_local Slot s;
+        return s;
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> sleeping{0};
+    std::atomic<size_t> nextVictim{0};
+    std::atomic<uint64_t> spawned{0};
+    std::mutex sleepMu;
+    std::condition_variable wake;
+    bool stopping{false};
+    std::vector<int> cpuList;           // worker i runs on cpuList[i], if set
+    std::function<void()> workerStart;  // runs first on every worker
+
+    bool popFrom(size_t w, size_t p, bool back, Task& out) {
+        Worker& wk = *workers[w];
+        std::lock_guard<SpinLock> g(wk.lock);
+        auto& q = wk.queues[p];
+        if (q.empty())
+            return false;
+        if (back) {
+            out = std::move(q.back());
+            q.pop_back();
+        } else {
+            out = std::move(q.front());
+            q.pop_front();
+        }
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // `home` is the caller's worker index, or workers.size() for outsiders.
+    bool take(size_t home, Task& out, bool& stole) {
+        size_t n = workers.size();
+        size_t start = nextVictim.fetch_add(1, std::memory_order_relaxed);
+        for (size_t p = 0; p < kPriorities; ++p) {
+            if (home < n && popFrom(home, p, true, out)) {
+                stole = false;
+                return true;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                size_t v = (start + i) % n;
+                if (v != home && popFrom(v, p, false, out)) {
+                    stole = home < n;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    static void pinTo(int cpu) {
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+    }
+
+    void pin(size_t index) {
+        if (!cpuList.empty()) {
+            pinTo(cpuList[index % cpuList.size()]);
+            return;
+        }
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return;
+        size_t cpus = CPU_COUNT(&allowed), want = index % (cpus ? cpus : 1);
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (!CPU_ISSET(c, &allowed) || want--)
+                continue;
+            pinTo(c);
+            return;
+        }
+    }
+
+    void workerLoop(size_t index, bool pinned) {
+        current() = {this, index};
+        if (pinned)
+            pin(index);
+        if (workerStart)
+            workerStart();
+        Task t;
+        bool stole = false;
+        while (true) {
+            // Short spin before sleeping: fork/join loops re-spawn quickly.
+            bool got = false;
+            for (int spin = 0; spin < 64 && !got; ++spin) {
+                got = take(index, t, stole);
+                if (!got && queued.load(std::memory_order_relaxed) == 0)
+                    std::this_thread::yield();
+            }
+            if (got) {
+                t();
+                t = nullptr;
+                if (stole)
+                    workers[index]->stolen.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            sleeping.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lk(sleepMu);
+                wake.wait(lk, [&] { return stopping || queued.load() > 0; });
+            }
+            sleeping.fetch_sub(1);
+            if (stopping && queued.load() == 0)
+                return;
+        }
+    }
+
+public:
+    // threads == 0 sizes the pool to the cores this process may run on.
+    explicit Executor(size_t threads = 0, bool pinWorkers = false) {
+        if (threads == 0) {
+            cpu_set_t allowed;
+            threads = sched_getaffinity(0, sizeof(allowed), &allowed) == 0
+                          ? CPU_COUNT(&allowed)
+                          : std::thread::hardware_concurrency();
+            threads = threads ? threads : 1;
+        }
+        for (size_t i = 0; i < threads; ++i)
+            workers.push_back(std::make_unique<Worker>());
+        for (size_t i = 0; i < threads; ++i)
+            this->threads.emplace_back([this, i, pinWorkers] { workerLoop(i, pinWorkers); });
+    }
+
+    // One worker pinned to each listed CPU; `onStart` runs on every worker
+    // before it takes work (e.g. to set a NUMA memory policy).
+    Executor(std::vector<int> cpus, std::function<void()> onStart)
+        : cpuList(std::move(cpus)), workerStart(std::move(onStart)) {
+        if (cpuList.empty())
+            cpuList.push_back(sched_getcpu() >= 0 ? sched_getcpu() : 0);
+        for (size_t i = 0; i < cpuList.size(); ++i)
+            workers.push_back(std::make_unique<Worker>());
+        for (size_t i = 0; i < cpuList.size(); ++i)
+            threads.emplace_back([this, i] { workerLoop(i, true); });
+    }
+
+    // Runs everything already queued, then joins.
+    ~Executor() {
+        {
+            std::lock_guard<std::mutex> g(sleepMu);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // Index of the calling worker, or -1 off-pool.
+    int currentWorker() const {
+        const Slot& s = current();
+        return s.owner == this ? (int)s.index : -1;
+    }
+
+    // `affinity` >= 0 queues on that worker (mod pool size), so repeated
+    // passes over the same shard land on the same core. Otherwise a worker
+    // keeps its own spawns and outside callers spread round-robin.
+    void spawn(Task t, Priority p = Priority::Normal, int affinity = -1) {
+        size_t n = workers.size();
+        size_t w;
+        if (affinity >= 0)
+            w = (size_t)affinity % n;
+        else if (currentWorker() >= 0)
+            w = (size_t)currentWorker();
+        else
+            w = nextVictim.fetch_add(1, std::memory_order_relaxed) % n;
+        queued.fetch_add(1);  // before the push, so it never undercounts
+        {
+            std::lock_guard<SpinLock> g(workers[w]->lock);
+            workers[w]->queues[(size_t)p].push_back(std::move(t));
+        }
+        spawned.fetch_add(1, std::memory_order_relaxed);
+        if (sleeping.load() > 0) {
+            std::lock_guard<std::mutex> g(sleepMu);
+            wake.notify_one();
+        }
+    }
+
+    // Runs one queued task on the calling thread; used by waiters so a
+    // blocked join helps instead of holding a core idle.
+    bool runOne() {
+        int me = currentWorker();
+        size_t home = me >= 0 ? (size_t)me : workers.size();
+        Task t;
+        bool stole = false;
+        if (!take(home, t, stole))
+            return false;
+        t();
+        return true;
+    }
+
+    uint64_t tasksSpawned() const { return spawned.load(std::memory_order_relaxed); }
+
+    uint64_t tasksStolen() const {
+        uint64_t s = 0;
+        for (auto& w : workers)
+            s += w->stolen.load(std::memory_order_relaxed);
+        return s;
+    }
+};
+
+// The process-wide pool. Created on first use: a program that forks
+// workers must do so before touching it.
+inline Executor& defaultExecutor() {
+    static Executor ex;
+    return ex;
+}
+
+// Fork/join scope: wait() (and the destructor) help run queued tasks until
+// everything spawned through the group has finished.
+class TaskGroup {
+private:
+    Executor& ex;
+    std::atomic<size_t> pending{0};
+
+public:
+    explicit TaskGroup(Executor& e = defaultExecutor()) : ex(e) {}
+    ~TaskGroup() { wait(); }
+
+    void spawn(Task t, Priority p = Priority::Normal, int affinity = -1) {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        ex.spawn([this, t = std::move(t)] {
+            t();
+            pending.fetch_sub(1, std::memory_order_release);
+        }, p, affinity);
+    }
+
+    void wait() {
+        while (pending.load(std::memory_order_acquire) > 0)
+            if (!ex.runOne())
+                std::this_thread::yield();
+    }
+};
+
+// body(lo, hi) over [begin, end) in chunks of at least `grain`. Chunk i
+// is hinted to worker i, and the caller runs the last chunk itself.
+template <class Body>
+void parallel_for(Executor& ex, size_t begin, size_t end, size_t grain, Body body,
+                  Priority p = Priority::Normal) {
+    if (end <= begin)
+        return;
+    size_t n = end - begin;
+    grain = grain ? grain : 1;
+    size_t chunks = std::min((n + grain - 1) / grain, ex.size() * 4);
+    if (chunks <= 1) {
+        body(begin, end);
+        return;
+    }
+    size_t step = (n + chunks - 1) / chunks;
+    TaskGroup group(ex);
+    size_t lo = begin;
+    for (size_t c = 0; lo + step < end; ++c, lo += step)
+        group.spawn([&body, lo, step] { body(lo, lo + step); }, p, (int)c);
+    body(lo, end);
+    group.wait();
+}
+
+// map(lo, hi) -> T per chunk, folded left to right with combine(a, b), so
+// the result does not depend on which worker ran which chunk.
+template <class T, class Map, class Combine>
+T parallel_reduce(Executor& ex, size_t begin, size_t end, size_t grain, T identity,
+                  Map map, Combine combine, Priority p = Priority::Normal) {
+    if (end <= begin)
+        return identity;
+    size_t n = end - begin;
+    grain = grain ? grain : 1;
+    size_t chunks = std::min((n + grain - 1) / grain, ex.size() * 4);
+    if (chunks <= 1)
+        return combine(identity, map(begin, end));
+    size_t step = (n + chunks - 1) / chunks;
+    std::vector<T> partial((n + step - 1) / step, identity);
+    parallel_for(ex, 0, partial.size(), 1, [&](size_t c0, size_t c1) {
+        for (size_t c = c0; c < c1; ++c) {
+            size_t lo = begin + c * step;
+            partial[c] = map(lo, std::min(end, lo + step));
+        }
+    }, p);
+    T acc = identity;
+    for (auto& v : partial)
+        acc = combine(acc, v);
+    return acc;
+}
+
+}  // namespace exec
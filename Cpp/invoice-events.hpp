@@ -0,0 +1,449 @@
+// invoice-events.hpp
+// Invoice-issued events passed from billing (01) to the notification
+// pipeline (03) through an append-only spool file. Billing appends and
+// syncs once per batch; the pipeline reads from a persisted cursor and
+// commits it only after delivery, so a crash re-delivers instead of
+// losing invoices (event ids come from invoice numbers, so deliveries
+// recorded in a DeliveredLog are not repeated).
+//
+// Record: magic u32 | payload length u32 | FNV-1a of payload u32 | payload
+// Payload: id u64 | email length u16 | email | content
+//
+// A torn tail left by a crashed writer is cut off when the log is next
+// opened for writing; a reader skips a corrupt record once an intact one
+// follows it.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include "io-reactor.hpp"
+
+namespace events {
+
+struct InvoiceIssued {
+    uint64_t id{0};
+    std::string email;
+    std::string content;
+};
+
+// Keyed on the invoice number billing assigned, so a retried invoice
+// collapses downstream while a recurring one with the same amount and
+// recipient does not.
+inline uint64_t invoiceEventId(const std::string& invoiceNo) {
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : invoiceNo)
+        h = (h ^ c) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+namespace detail {
+
+constexpr uint32_t kMagic = 0x31564e49;  // "INV1"
+constexpr size_t kHeader = 12;
+constexpr uint32_t kMaxPayload = 16u << 20;  // longer lengths are corruption
+
+inline uint32_t checksum(const char* p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ (unsigned char)p[i]) * 16777619u;
+    return h;
+}
+
+inline void put(std::string& out, const void* p, size_t n) { out.append((const char*)p, n); }
+
+enum class Parse { Ok, Short, Bad };
+
+// Checks the record at p; on Ok, `size` is its length including the header.
+inline Parse parse(const char* p, size_t avail, size_t& size) {
+    if (avail < kHeader)
+        return Parse::Short;
+    uint32_t magic, len, sum;
+    memcpy(&magic, p, 4);
+    memcpy(&len, p + 4, 4);
+    memcpy(&sum, p + 8, 4);
+    if (magic != kMagic || len < 10 || len > kMaxPayload)
+        return Parse::Bad;
+    if (avail < kHeader + len)
+        return Parse::Short;
+    uint16_t emailLen;
+    memcpy(&emailLen, p + kHeader + 8, 2);
+    if (checksum(p + kHeader, len) != sum || 10u + emailLen > len)
+        return Parse::Bad;
+    size = kHeader + len;
+    return Parse::Ok;
+}
+
+// First intact record starting at or after `from`, scanning for its magic.
+inline bool findRecord(int fd, uint64_t from, uint64_t& at, size_t& size) {
+    std::string win;
+    uint64_t winStart = from;
+    char chunk[1 << 16];
+    while (true) {
+        ssize_t r = pread(fd, chunk, sizeof(chunk), (off_t)(winStart + win.size()));
+        bool eof = r <= 0;
+        if (!eof)
+            win.append(chunk, (size_t)r);
+        size_t pos = 0;
+        bool needMore = false;
+        while ((pos = win.find((const char*)&kMagic, pos, 4)) != std::string::npos) {
+            Parse p = parse(win.data() + pos, win.size() - pos, size);
+            if (p == Parse::Ok) {
+                at = winStart + pos;
+                return true;
+            }
+            if (p == Parse::Short && !eof) {
+                needMore = true;
+                break;
+            }
+            ++pos;
+        }
+        if (eof)
+            return false;
+        // Keep a candidate waiting for more bytes, or a magic split across reads.
+        size_t keep = needMore ? pos : (win.size() > 3 ? win.size() - 3 : 0);
+        win.erase(0, keep);
+        winStart += keep;
+    }
+}
+
+// End of the last intact record, looking back from the end of the file in
+// growing windows so opening a long spool stays cheap.
+inline uint64_t intactEnd(int fd) {
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0)
+        return 0;
+    for (uint64_t window = 1 << 20;; window *= 2) {
+        uint64_t from = (uint64_t)size > window ? (uint64_t)size - window : 0, end = 0, at;
+        size_t len;
+        while (findRecord(fd, from, at, len))
+            from = end = at + len;
+        if (end || from == 0)
+            return end;
+    }
+}
+
+}  // namespace detail
+
+// Writes go through `reactor` when one is given (the billing program's
+// shared I/O reactor), plain write(2) otherwise.
+class InvoiceEventLog {
+private:
+    int fd{-1};
+    io::IoReactor* reactor{nullptr};
+    std::string pending;
+    size_t appended{0};
+
+    bool writeAll(const std::string& data) {
+        size_t off = 0;
+        if (!reactor) {
+            while (off < data.size()) {
+                ssize_t w = ::write(fd, data.data() + off, data.size() - off);
+                if (w <= 0)
+                    return false;
+                off += (size_t)w;
+            }
+            return true;
+        }
+        bool failed = false;
+        while (off < data.size() && !failed) {
+            bool done = false;
+            reactor->write(fd, data.data() + off, data.size() - off, -1, [&](int r) {
+                if (r <= 0)
+                    failed = true;
+                else
+                    off += (size_t)r;
+                done = true;
+            });
+            reactor->runUntil([&] { return done; });
+            failed = failed || !done;
+        }
+        return !failed;
+    }
+
+public:
+    explicit InvoiceEventLog(const std::string& path, io::IoReactor* r = nullptr)
+        : reactor(r) {
+        fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return;
+        // A write torn by a crash would otherwise sit between the last
+        // good record and everything appended from now on.
+        uint64_t end = detail::intactEnd(fd);
+        if ((uint64_t)lseek(fd, 0, SEEK_END) > end && ftruncate(fd, (off_t)end) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    ~InvoiceEventLog() {
+        flush();
+        if (fd >= 0)
+            close(fd);
+    }
+    InvoiceEventLog(const InvoiceEventLog&) = delete;
+    InvoiceEventLog& operator=(const InvoiceEventLog&) = delete;
+
+    bool ok() const { return fd >= 0; }
+
+    // Buffered until flush(). False if the event is too large to record.
+    bool append(const InvoiceIssued& e) {
+        if (e.email.size() > UINT16_MAX || 10 + e.email.size() + e.content.size() > detail::kMaxPayload)
+            return false;
+        std::string payload;
+        uint16_t emailLen = (uint16_t)e.email.size();
+        detail::put(payload, &e.id, 8);
+        detail::put(payload, &emailLen, 2);
+        payload.append(e.email, 0, emailLen);
+        payload += e.content;
+
+        uint32_t len = (uint32_t)payload.size();
+        uint32_t sum = detail::checksum(payload.data(), payload.size());
+        detail::put(pending, &detail::kMagic, 4);
+        detail::put(pending, &len, 4);
+        detail::put(pending, &sum, 4);
+        pending += payload;
+        ++appended;
+        return true;
+    }
+
+    // One write and one fdatasync for everything appended since the last
+    // flush. Returns false if the events may not be durable.
+    bool flush() {
+        if (fd < 0 || pending.empty())
+            return fd >= 0;
+        if (!writeAll(pending))
+            return false;
+        pending.clear();
+        return fdatasync(fd) == 0;
+    }
+
+    size_t appendedCount() const { return appended; }
+};
+
+class InvoiceEventReader {
+private:
+    int fd{-1};
+    std::string cursorPath;
+    uint64_t committed{0};  // durable cursor
+    uint64_t offset{0};     // next unread record
+    std::string buf;        // file bytes from bufStart
+    uint64_t bufStart{0};
+    uint64_t corrupt{0};
+    uint64_t skipped{0};    // bytes of corrupt records passed over
+
+    // Makes [offset, offset + n) available in buf; false at end of file.
+    bool fill(size_t n) {
+        if (offset < bufStart || offset > bufStart + buf.size()) {
+            buf.clear();
+            bufStart = offset;
+        }
+        buf.erase(0, offset - bufStart);
+        bufStart = offset;
+        char chunk[1 << 16];
+        while (buf.size() < n) {
+            ssize_t r = pread(fd, chunk, sizeof(chunk), (off_t)(bufStart + buf.size()));
+            if (r <= 0)
+                return false;
+            buf.append(chunk, (size_t)r);
+        }
+        return true;
+    }
+
+public:
+    InvoiceEventReader(const std::string& spoolPath, const std::string& cursorFile)
+        : cursorPath(cursorFile) {
+        fd = open(spoolPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (FILE* f = fopen(cursorPath.c_str(), "r")) {
+            unsigned long long c = 0;
+            if (fscanf(f, "%llu", &c) == 1)
+                committed = c;
+            fclose(f);
+        }
+        offset = bufStart = committed;
+    }
+    ~InvoiceEventReader() {
+        if (fd >= 0)
+            close(fd);
+    }
+    InvoiceEventReader(const InvoiceEventReader&) = delete;
+    InvoiceEventReader& operator=(const InvoiceEventReader&) = delete;
+
+    bool ok() const { return fd >= 0; }
+
+    // Next complete record after the cursor. An incomplete tail reads as
+    // "nothing yet" and is retried on the next call; a corrupt record is
+    // skipped once an intact one has been written after it.
+    bool next(InvoiceIssued& e) {
+        if (fd < 0)
+            return false;
+        size_t need = detail::kHeader, size = 0;
+        while (true) {
+            bool full = fill(need);
+            const char* h = buf.data() + (offset - bufStart);
+            detail::Parse r = detail::parse(h, buf.size() - (offset - bufStart), size);
+            if (r == detail::Parse::Ok)
+                break;
+            if (r == detail::Parse::Short && full) {
+                uint32_t len;  // the header is in; read the whole record
+                memcpy(&len, h + 4, 4);
+                need = detail::kHeader + len;
+                continue;
+            }
+            // Short at the end of the file is a record still being written
+            // (or a torn tail); anything followed by an intact record,
+            // including a garbled length, is corruption.
+            uint64_t at;
+            if (!detail::findRecord(fd, offset + 1, at, size))
+                return false;
+            ++corrupt;
+            skipped += at - offset;
+            offset = at;
+            need = detail::kHeader;
+        }
+        const char* p = buf.data() + (offset - bufStart) + detail::kHeader;
+        uint16_t emailLen;
+        memcpy(&e.id, p, 8);
+        memcpy(&emailLen, p + 8, 2);
+        e.email.assign(p + 10, emailLen);
+        e.content.assign(p + 10 + emailLen, size - detail::kHeader - 10 - emailLen);
+        offset += size;
+        return true;
+    }
+
+    // Persists the cursor up to everything returned by next().
+    bool commit() {
+        if (offset == committed)
+            return true;
+        std::string tmp = cursorPath + ".tmp";
+        int cfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (cfd < 0)
+            return false;
+        std::string text = std::to_string(offset) + "\n";
+        bool ok = ::write(cfd, text.data(), text.size()) == (ssize_t)text.size() &&
+                  fdatasync(cfd) == 0;
+        close(cfd);
+        if (!ok || rename(tmp.c_str(), cursorPath.c_str()) != 0)
+            return false;
+        committed = offset;
+        return true;
+    }
+
+    // Forgets events read since the last commit, so they are read again.
+    void rewind() { offset = committed; }
+
+    uint64_t position() const { return offset; }
+    uint64_t corruptRecords() const { return corrupt; }
+    uint64_t skippedBytes() const { return skipped; }
+};
+
+
+// Event ids delivered within the last `windowMs`, kept on disk so a
+// restarted relay does not send them again. Entries are fixed 16-byte
+// records (wall-clock ms i64 | id u64); a torn trailing record is dropped
+// on open, and the file is rewritten once it is mostly expired entries.
+class DeliveredLog {
+private:
+    int fd{-1};
+    std::string path;
+    int64_t windowMs;
+    std::deque<std::pair<int64_t, uint64_t>> live;  // oldest first
+    std::string pending;
+    size_t onDisk{0};
+
+    void expire(int64_t nowMs) {
+        while (!live.empty() && live.front().first <= nowMs - windowMs)
+            live.pop_front();
+    }
+
+    bool rewrite() {
+        std::string tmp = path + ".tmp", data;
+        for (auto& e : live) {
+            detail::put(data, &e.first, 8);
+            detail::put(data, &e.second, 8);
+        }
+        int nfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (nfd < 0)
+            return false;
+        bool ok = ::write(nfd, data.data(), data.size()) == (ssize_t)data.size() &&
+                  fdatasync(nfd) == 0;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            close(nfd);
+            return false;
+        }
+        close(fd);
+        fd = nfd;
+        onDisk = live.size();
+        return lseek(fd, 0, SEEK_END) >= 0;
+    }
+
+public:
+    DeliveredLog(const std::string& file, int64_t window, int64_t nowMs)
+        : path(file), windowMs(window) {
+        fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return;
+        char rec[16];
+        for (off_t at = 0; pread(fd, rec, 16, at) == 16; at += 16, ++onDisk) {
+            std::pair<int64_t, uint64_t> e;
+            memcpy(&e.first, rec, 8);
+            memcpy(&e.second, rec + 8, 8);
+            live.push_back(e);
+        }
+        if (ftruncate(fd, (off_t)onDisk * 16) != 0) {
+            close(fd);
+            fd = -1;
+            return;
+        }
+        expire(nowMs);
+    }
+    ~DeliveredLog() {
+        if (fd >= 0)
+            close(fd);
+    }
+    DeliveredLog(const DeliveredLog&) = delete;
+    DeliveredLog& operator=(const DeliveredLog&) = delete;
+
+    bool ok() const { return fd >= 0; }
+
+    // Unexpired (ms, id) entries, oldest first, for seeding a dedup set.
+    const std::deque<std::pair<int64_t, uint64_t>>& entries() const { return live; }
+
+    // Buffered until sync().
+    void add(int64_t nowMs, uint64_t id) {
+        live.push_back({nowMs, id});
+        detail::put(pending, &nowMs, 8);
+        detail::put(pending, &id, 8);
+    }
+
+    // Makes everything added durable; call before committing the cursor.
+    bool sync(int64_t nowMs) {
+        if (fd < 0)
+            return false;
+        expire(nowMs);
+        if (onDisk + pending.size() / 16 > 2 * live.size() + 4096) {
+            pending.clear();
+            return rewrite();
+        }
+        if (pending.empty())
+            return true;
+        ssize_t w = ::write(fd, pending.data(), pending.size());
+        if (w != (ssize_t)pending.size()) {
+            if (w > 0 && ftruncate(fd, (off_t)onDisk * 16) != 0) {
+                close(fd);  // a partial record would misalign everything after it
+                fd = -1;
+            }
+            return false;
+        }
+        onDisk += pending.size() / 16;
+        pending.clear();
+        return fdatasync(fd) == 0;
+    }
+};
+
+}  // namespace events
@@ -0,0 +1,672 @@
+// io-reactor.hpp
+// Shared completion-based I/O reactor for the assignment programs.
+// io_uring (raw syscalls, registered buffers, batched submission) with an
+// epoll fallback for kernels or sandboxes where io_uring is unavailable.
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace io {
+
+// Bytes transferred, 0 on EOF, or -errno.
+using Callback = std::function<void(int result)>;
+
+// Slice of the reactor's pre-registered buffer arena.
+struct FixedBuffer {
+    int index{-1};
+    char* data{nullptr};
+    size_t size{0};
+};
+
+class IoReactor {
+public:
+    virtual ~IoReactor() = default;
+
+    virtual const char* backend() const = 0;
+
+    // `offset` < 0 means a stream fd (socket/pipe) at its current position.
+    virtual void read(int fd, void* buf, size_t len, int64_t offset, Callback cb) = 0;
+    virtual void write(int fd, const void* buf, size_t len, int64_t offset, Callback cb) = 0;
+
+    // Same as read/write on a registered buffer; io_uring skips the
+    // per-op page pinning for these.
+    virtual void readFixed(int fd, const FixedBuffer& b, size_t len, int64_t offset,
+                           Callback cb) {
+        read(fd, b.data, len, offset, std::move(cb));
+    }
+    virtual void writeFixed(int fd, const FixedBuffer& b, size_t len, int64_t offset,
+                            Callback cb) {
+        write(fd, b.data, len, offset, std::move(cb));
+    }
+
+    // Submits everything queued since the last call and runs callbacks for
+    // finished operations; blocks for at least one when `wait` is set and
+    // something is in flight. Returns the number of callbacks run.
+    virtual size_t poll(bool wait) = 0;
+
+    // Operations queued or in flight.
+    virtual size_t pending() const = 0;
+
+    void runUntil(const std::function<bool()>& done) {
+        while (!done() && pending() > 0)
+            poll(true);
+    }
+
+    void runUntilIdle() {
+        while (pending() > 0)
+            poll(true);
+    }
+
+    bool acquire(FixedBuffer& b) {
+        if (freeBuffers.empty())
+            return false;
+        b.index = freeBuffers.back();
+        freeBuffers.pop_back();
+        b.data = arena + (size_t)b.index * bufferSize;
+        b.size = bufferSize;
+        return true;
+    }
+
+    void release(const FixedBuffer& b) {
+        if (b.index >= 0)
+            freeBuffers.push_back(b.index);
+    }
+
+    uint64_t syscalls() const { return syscallCount; }
+    uint64_t operations() const { return operationCount; }
+
+protected:
+    char* arena{nullptr};
+    size_t bufferSize{0};
+    size_t bufferCount{0};
+    std::vector<int> freeBuffers;
+    uint64_t syscallCount{0};
+    uint64_t operationCount{0};
+
+    void allocateBuffers(size_t count, size_t size) {
+        bufferCount = count;
+        bufferSize = size;
+        void* mem = mmap(nullptr, count * size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return;
+        arena = (char*)mem;
+        for (size_t i = count; i-- > 0;)
+            freeBuffers.push_back((int)i);
+    }
+
+    void freeArena() {
+        if (arena)
+            munmap(arena, bufferCount * bufferSize);
+    }
+};
+
+// ------------------------ io_uring backend ------------------------
+
+class UringReactor : public IoReactor {
+private:
+    int ringFd{-1};
+    unsigned entries{0};
+    void* sqMap{nullptr};
+    void* cqMap{nullptr};
+    size_t sqMapSize{0};
+    size_t cqMapSize{0};
+    io_uring_sqe* sqes{nullptr};
+    unsigned* sqHead{nullptr};
+    unsigned* sqTail{nullptr};
+    unsigned* sqMask{nullptr};
+    unsigned* sqArray{nullptr};
+    unsigned* cqHead{nullptr};
+    unsigned* cqTail{nullptr};
+    unsigned* cqMask{nullptr};
+    io_uring_cqe* cqes{nullptr};
+    unsigned cqEntries{0};
+    bool registered{true};  // buffer arena registered with the ring
+
+    unsigned unsubmitted{0};
+    size_t inflight{0};
+    std::vector<Callback> callbacks;  // indexed by sqe user_data
+    std::vector<uint32_t> freeSlots;
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        int r;
+        do {
+            ++syscallCount;
+            r = (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags,
+                             nullptr, 0);
+        } while (r < 0 && errno == EINTR);
+        return r;
+    }
+
+    void submitQueued(unsigned minComplete) {
+        unsigned flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+        if (unsubmitted == 0 && minComplete == 0)
+            return;
+        int r = enter(unsubmitted, minComplete, flags);
+        if (r > 0)
+            unsubmitted -= std::min<unsigned>(unsubmitted, (unsigned)r);
+    }
+
+    size_t reap() {
+        size_t done = 0;
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & *cqMask];
+            __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+            uint32_t slot = (uint32_t)cqe.user_data;
+            Callback cb = std::move(callbacks[slot]);
+            freeSlots.push_back(slot);
+            --inflight;
+            ++done;
+            if (cb)
+                cb(cqe.res);
+        }
+        return done;
+    }
+
+    void queue(uint8_t opcode, int fd, void* buf, size_t len, int64_t offset,
+               int bufIndex, Callback cb) {
+        // Never let completions outnumber CQ slots.
+        while (inflight >= cqEntries) {
+            submitQueued(1);
+            reap();
+        }
+        unsigned tail = *sqTail;
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries) {
+            submitQueued(0);
+            tail = *sqTail;
+        }
+
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            callbacks[slot] = std::move(cb);
+        } else {
+            slot = (uint32_t)callbacks.size();
+            callbacks.push_back(std::move(cb));
+        }
+
+        unsigned idx = tail & *sqMask;
+        io_uring_sqe* sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)len;
+        sqe->off = offset < 0 ? (uint64_t)-1 : (uint64_t)offset;
+        if (bufIndex >= 0)
+            sqe->buf_index = (uint16_t)bufIndex;
+        sqe->user_data = slot;
+        sqArray[idx] = idx;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+        ++inflight;
+        ++operationCount;
+    }
+
+public:
+    // Check ok() afterwards; the constructor leaves the ring unusable when
+    // io_uring is not permitted here.
+    explicit UringReactor(unsigned ringEntries = 256, size_t buffers = 64,
+                          size_t bufferBytes = 64 * 1024) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ringFd = (int)syscall(__NR_io_uring_setup, ringEntries, &p);
+        if (ringFd < 0)
+            return;
+        entries = p.sq_entries;
+        cqEntries = p.cq_entries;
+
+        sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqMap = single ? sqMap
+                       : mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        void* sqeMap = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                            IORING_OFF_SQES);
+        if (sqMap == MAP_FAILED || cqMap == MAP_FAILED || sqeMap == MAP_FAILED) {
+            close(ringFd);
+            ringFd = -1;
+            return;
+        }
+        sqes = (io_uring_sqe*)sqeMap;
+
+        char* sq = (char*)sqMap;
+        sqHead = (unsigned*)(sq + p.sq_off.head);
+        sqTail = (unsigned*)(sq + p.sq_off.tail);
+        sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sqArray = (unsigned*)(sq + p.sq_off.array);
+        char* cq = (char*)cqMap;
+        cqHead = (unsigned*)(cq + p.cq_off.head);
+        cqTail = (unsigned*)(cq + p.cq_off.tail);
+        cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+        allocateBuffers(buffers, bufferBytes);
+        std::vector<iovec> iov(bufferCount);
+        for (size_t i = 0; i < bufferCount; ++i)
+            iov[i] = {arena + i * bufferSize, bufferSize};
+        ++syscallCount;
+        if (arena && syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS,
+                             iov.data(), (unsigned)iov.size()) != 0) {
+            // Unregistered buffers still work through plain READ/WRITE.
+            freeArena();
+            arena = nullptr;
+            freeBuffers.clear();
+            allocateBuffers(buffers, bufferBytes);
+            registered = false;
+        }
+    }
+
+    ~UringReactor() override {
+        if (ringFd >= 0) {
+            munmap(sqes, entries * sizeof(io_uring_sqe));
+            if (cqMap != sqMap)
+                munmap(cqMap, cqMapSize);
+            munmap(sqMap, sqMapSize);
+            close(ringFd);
+        }
+        freeArena();
+    }
+
+    bool ok() const { return ringFd >= 0; }
+    const char* backend() const override { return "io_uring"; }
+
+    void read(int fd, void* buf, size_t len, int64_t offset, Callback cb) override {
+        queue(IORING_OP_READ, fd, buf, len, offset, -1, std::move(cb));
+    }
+
+    void write(int fd, const void* buf, size_t len, int64_t offset, Callback cb) override {
+        queue(IORING_OP_WRITE, fd, (void*)buf, len, offset, -1, std::move(cb));
+    }
+
+    void readFixed(int fd, const FixedBuffer& b, size_t len, int64_t offset,
+                   Callback cb) override {
+        if (!registered)
+            return read(fd, b.data, len, offset, std::move(cb));
+        queue(IORING_OP_READ_FIXED, fd, b.data, len, offset, b.index, std::move(cb));
+    }
+
+    void writeFixed(int fd, const FixedBuffer& b, size_t len, int64_t offset,
+                    Callback cb) override {
+        if (!registered)
+            return write(fd, b.data, len, offset, std::move(cb));
+        queue(IORING_OP_WRITE_FIXED, fd, b.data, len, offset, b.index, std::move(cb));
+    }
+
+    size_t poll(bool wait) override {
+        // Completions already posted need no syscall at all.
+        size_t done = reap();
+        if (unsubmitted > 0 || (wait && done == 0 && inflight > 0))
+            submitQueued(wait && done == 0 && inflight > 0 ? 1 : 0);
+        return done + reap();
+    }
+
+    size_t pending() const override { return inflight; }
+};
+
+// ------------------------ epoll backend ------------------------
+
+// Readiness-based emulation of the same completion API: each op is tried
+// directly, parked on EAGAIN, and retried when epoll reports the fd ready.
+// Regular files are always "ready" and complete on first attempt.
+class EpollReactor : public IoReactor {
+private:
+    struct Op {
+        bool isWrite;
+        int fd;
+        char* buf;
+        size_t len;
+        int64_t offset;
+        Callback cb;
+    };
+
+    struct Parked {
+        std::deque<Op> reads;
+        std::deque<Op> writes;
+        uint32_t events{0};
+    };
+
+    int ep{-1};
+    std::deque<Op> fresh;
+    std::unordered_map<int, Parked> parked;
+    size_t parkedCount{0};
+
+    int attempt(Op& op) {
+        ++syscallCount;
+        ssize_t r;
+        if (op.isWrite)
+            r = op.offset < 0 ? ::write(op.fd, op.buf, op.len)
+                              : ::pwrite(op.fd, op.buf, op.len, op.offset);
+        else
+            r = op.offset < 0 ? ::read(op.fd, op.buf, op.len)
+                              : ::pread(op.fd, op.buf, op.len, op.offset);
+        return r < 0 ? -errno : (int)r;
+    }
+
+    void updateInterest(int fd, Parked& p) {
+        uint32_t want = (p.reads.empty() ? 0u : uint32_t(EPOLLIN)) |
+                        (p.writes.empty() ? 0u : uint32_t(EPOLLOUT));
+        if (want == p.events)
+            return;
+        epoll_event ev{};
+        ev.events = want;
+        ev.data.fd = fd;
+        int op = p.events == 0 ? EPOLL_CTL_ADD : want == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+        ++syscallCount;
+        epoll_ctl(ep, op, fd, &ev);
+        p.events = want;
+    }
+
+    // Runs ops from the front of `q` until one would block.
+    size_t drain(std::deque<Op>& q) {
+        size_t done = 0;
+        while (!q.empty()) {
+            int r = attempt(q.front());
+            if (r == -EAGAIN || r == -EWOULDBLOCK)
+                break;
+            Op op = std::move(q.front());
+            q.pop_front();
+            --parkedCount;
+            ++done;
+            op.cb(r);
+        }
+        return done;
+    }
+
+    void queue(bool isWrite, int fd, void* buf, size_t len, int64_t offset, Callback cb) {
+        fresh.push_back({isWrite, fd, (char*)buf, len, offset, std::move(cb)});
+        ++operationCount;
+    }
+
+public:
+    explicit EpollReactor(size_t buffers = 64, size_t bufferBytes = 64 * 1024) {
+        ep = epoll_create1(EPOLL_CLOEXEC);
+        allocateBuffers(buffers, bufferBytes);
+    }
+
+    ~EpollReactor() override {
+        if (ep >= 0)
+            close(ep);
+        freeArena();
+    }
+
+    const char* backend() const override { return "epoll"; }
+
+    void read(int fd, void* buf, size_t len, int64_t offset, Callback cb) override {
+        queue(false, fd, buf, len, offset, std::move(cb));
+    }
+
+    void write(int fd, const void* buf, size_t len, int64_t offset, Callback cb) override {
+        queue(true, fd, (void*)buf, len, offset, std::move(cb));
+    }
+
+    size_t poll(bool wait) override {
+        size_t done = 0;
+        std::deque<Op> batch;
+        batch.swap(fresh);
+        for (auto& op : batch) {
+            int fd = op.fd;
+            Parked& p = parked[fd];
+            std::deque<Op>& q = op.isWrite ? p.writes : p.reads;
+            if (q.empty()) {  // keep per-fd order: only try when nothing is ahead
+                int r = attempt(op);
+                if (r != -EAGAIN && r != -EWOULDBLOCK) {
+                    ++done;
+                    op.cb(r);
+                    continue;
+                }
+            }
+            q.push_back(std::move(op));
+            ++parkedCount;
+            updateInterest(fd, p);
+        }
+
+        if (parkedCount == 0)
+            return done;
+        epoll_event evs[64];
+        ++syscallCount;
+        int n = epoll_wait(ep, evs, 64, (wait && done == 0 && fresh.empty()) ? -1 : 0);
+        for (int i = 0; i < n; ++i) {
+            int fd = evs[i].data.fd;
+            Parked& p = parked[fd];
+            if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                done += drain(p.reads);
+            if (evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                done += drain(p.writes);
+            updateInterest(fd, p);
+        }
+        return done;
+    }
+
+    size_t pending() const override { return fresh.size() + parkedCount; }
+};
+
+// io_uring when the kernel allows it, epoll otherwise.
+inline std::unique_ptr<IoReactor> makeReactor(bool preferUring = true) {
+    if (preferUring) {
+        auto u = std::make_unique<UringReactor>();
+        if (u->ok())
+            return u;
+    }
+    return std::make_unique<EpollReactor>();
+}
+
+// ------------------------ Line protocol channel ------------------------
+
+// How replies are delimited: one "\r\n"-terminated line each, or SMTP
+// replies, where "250-..." lines continue up to a final "250 ..." line.
+enum class Framing { Line, Smtp };
+
+// Pipelined request/response over a stream fd: requests queued between
+// polls go out in one write, replies are matched to requests in order.
+// A multi-line SMTP reply reaches its callback as one string, lines
+// joined by "\n". Used by the SMTP and SMS clients.
+class LineChannel {
+private:
+    using Reply = std::function<void(const std::string&)>;
+
+    IoReactor& reactor;
+    int fd;
+    Framing framing;
+    std::string reply;  // SMTP lines of the reply being assembled
+    std::string outq;
+    std::string writing;
+    size_t written{0};
+    bool writeBusy{false};
+    bool readBusy{false};
+    bool closed{false};
+    std::deque<Reply> waiters;
+    std::string inbuf;
+    char rbuf[16 * 1024];
+
+    void flush() {
+        if (writeBusy || outq.empty() || closed)
+            return;
+        writeBusy = true;
+        writing.swap(outq);
+        outq.clear();
+        written = 0;
+        writeMore();
+    }
+
+    void writeMore() {
+        reactor.write(fd, writing.data() + written, writing.size() - written, -1,
+                      [this](int r) {
+                          if (r <= 0) {
+                              fail();
+                              return;
+                          }
+                          written += (size_t)r;
+                          if (written < writing.size())
+                              return writeMore();
+                          writeBusy = false;
+                          flush();
+                      });
+    }
+
+    void readMore() {
+        if (readBusy || waiters.empty() || closed)
+            return;
+        readBusy = true;
+        reactor.read(fd, rbuf, sizeof(rbuf), -1, [this](int r) {
+            readBusy = false;
+            if (r <= 0) {
+                fail();
+                return;
+            }
+            inbuf.append(rbuf, (size_t)r);
+            size_t start = 0;
+            for (size_t nl; (nl = inbuf.find('\n', start)) != std::string::npos;
+                 start = nl + 1) {
+                size_t end = (nl > start && inbuf[nl - 1] == '\r') ? nl - 1 : nl;
+                if (waiters.empty())
+                    break;
+                if (!reply.empty())
+                    reply += '\n';
+                reply.append(inbuf, start, end - start);
+                if (framing == Framing::Smtp && end - start >= 4 && inbuf[start + 3] == '-')
+                    continue;  // more lines of this reply follow
+                Reply cb = std::move(waiters.front());
+                waiters.pop_front();
+                std::string full;
+                full.swap(reply);
+                cb(full);
+            }
+            inbuf.erase(0, start);
+            readMore();
+        });
+    }
+
+    void fail() {
+        closed = true;
+        reply.clear();
+        while (!waiters.empty()) {
+            Reply cb = std::move(waiters.front());
+            waiters.pop_front();
+            cb("");
+        }
+    }
+
+public:
+    LineChannel(IoReactor& r, int streamFd, Framing f = Framing::Line)
+        : reactor(r), fd(streamFd), framing(f) {}
+
+    // Waits for a reply nobody asked for, e.g. a server greeting.
+    void expect(Reply onReply) {
+        waiters.push_back(std::move(onReply));
+        readMore();
+    }
+
+    // Sends a line that expects exactly one reply.
+    void request(const std::string& line, Reply onReply) {
+        outq += line;
+        outq += "\r\n";
+        waiters.push_back(std::move(onReply));
+        flush();
+        readMore();
+    }
+
+    // Sends a line that gets no reply of its own (e.g. message body).
+    void send(const std::string& line) {
+        outq += line;
+        outq += "\r\n";
+        flush();
+    }
+
+    bool idle() const { return waiters.empty() && !writeBusy && outq.empty(); }
+};
+
+// In-process stand-in for a line-based server (SMTP relay, SMS gateway)
+// on the other end of a socketpair. `handler` returns the reply (lines
+// separated by "\r\n"), or "" when the line gets none; `greeting`, if
+// any, is sent as soon as the client connects.
+class LoopbackLineServer {
+private:
+    IoReactor& reactor;
+    int fd;
+    std::function<std::string(const std::string&)> handler;
+    std::string inbuf;
+    std::string outq;
+    std::string writing;
+    bool writeBusy{false};
+    char rbuf[16 * 1024];
+
+    void readMore() {
+        reactor.read(fd, rbuf, sizeof(rbuf), -1, [this](int r) {
+            if (r <= 0)
+                return;  // client closed
+            inbuf.append(rbuf, (size_t)r);
+            size_t start = 0;
+            for (size_t nl; (nl = inbuf.find('\n', start)) != std::string::npos;
+                 start = nl + 1) {
+                size_t end = (nl > start && inbuf[nl - 1] == '\r') ? nl - 1 : nl;
+                std::string reply = handler(inbuf.substr(start, end - start));
+                if (!reply.empty())
+                    outq += reply + "\r\n";
+            }
+            inbuf.erase(0, start);
+            flush();
+            readMore();
+        });
+    }
+
+    void flush() {
+        if (writeBusy || outq.empty())
+            return;
+        writeBusy = true;
+        writing.swap(outq);
+        outq.clear();
+        reactor.write(fd, writing.data(), writing.size(), -1, [this](int r) {
+            writeBusy = false;
+            if (r > 0 && (size_t)r < writing.size())
+                outq.insert(0, writing, (size_t)r, std::string::npos);
+            if (r > 0)
+                flush();
+        });
+    }
+
+public:
+    LoopbackLineServer(IoReactor& r, int serverFd,
+                       std::function<std::string(const std::string&)> h,
+                       const std::string& greeting = "")
+        : reactor(r), fd(serverFd), handler(std::move(h)) {
+        if (!greeting.empty()) {
+            outq = greeting + "\r\n";
+            flush();
+        }
+        readMore();
+    }
+};
+
+// Non-blocking, close-on-exec socketpair for a client and its stand-in.
+inline bool loopbackPair(int fds[2]) {
+    return socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) == 0;
+}
+
+}  // namespace io
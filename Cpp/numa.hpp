@@ -0,0 +1,215 @@
+// numa.hpp
+// NUMA placement for batch runs on multi-socket hosts. Topology comes from
+// sysfs and memory policy from the raw syscalls, so there is no libnuma
+// dependency. A NodeExecutors pool gives every node its own executor with
+// workers pinned to that node's CPUs and preferring its memory, so data a
+// node's workers build (its shard of a batch) lands on that node:
+//
+//   numa::NodeExecutors nodes;
+//   auto shards = numa::scatter(nodes, jobs);  // node-local copies
+//   nodes.eachNode([&](size_t n) { render(shards[n], nodes.executor(n)); });
+//
+// On single-node machines (or without sysfs) this degrades to one node
+// holding every CPU the process may use.
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "executor.hpp"
+
+namespace numa {
+
+// From <linux/mempolicy.h>.
+constexpr int kMpolPreferred = 1;
+constexpr int kMpolBind = 2;
+constexpr unsigned kMpolFNode = 1 << 0;
+constexpr unsigned kMpolFAddr = 1 << 1;
+constexpr unsigned kMpolMfMove = 1 << 1;
+constexpr size_t kMaxNodes = 1024;
+
+struct Node {
+    int id{0};
+    std::vector<int> cpus;  // only those this process may run on
+};
+
+// "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+inline std::vector<int> parseCpuList(const std::string& s) {
+    std::vector<int> out;
+    size_t i = 0;
+    while (i < s.size()) {
+        char* end;
+        long lo = strtol(s.c_str() + i, &end, 10), hi = lo;
+        if (end == s.c_str() + i)
+            break;
+        i = end - s.c_str();
+        if (i < s.size() && s[i] == '-') {
+            hi = strtol(s.c_str() + i + 1, &end, 10);
+            i = end - s.c_str();
+        }
+        for (long c = lo; c <= hi; ++c)
+            out.push_back((int)c);
+        while (i < s.size() && (s[i] == ',' || s[i] == '\n'))
+            ++i;
+    }
+    return out;
+}
+
+inline std::string readSysfs(const std::string& path) {
+    std::string out;
+    if (FILE* f = fopen(path.c_str(), "r")) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            out.append(buf, n);
+        fclose(f);
+    }
+    return out;
+}
+
+// Nodes with at least one CPU in our affinity mask, in id order.
+inline std::vector<Node> topology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        CPU_SET(0, &allowed);
+
+    std::vector<Node> nodes;
+    const std::string base = "/sys/devices/system/node/";
+    for (int id : parseCpuList(readSysfs(base + "online"))) {
+        Node n{id, {}};
+        for (int c : parseCpuList(readSysfs(base + "node" + std::to_string(id) + "/cpulist")))
+            if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+                n.cpus.push_back(c);
+        if (!n.cpus.empty())
+            nodes.push_back(std::move(n));
+    }
+    if (nodes.empty()) {
+        Node all{0, {}};
+        for (int c = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &allowed))
+                all.cpus.push_back(c);
+        nodes.push_back(std::move(all));
+    }
+    return nodes;
+}
+
+struct NodeMask {
+    unsigned long bits[kMaxNodes / (8 * sizeof(unsigned long))]{};
+    explicit NodeMask(int node) {
+        bits[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    }
+};
+
+// New pages touched by the calling thread come from `node` while it has
+// free memory (set_mempolicy MPOL_PREFERRED).
+inline bool preferNode(int node) {
+    if (node < 0 || (size_t)node >= kMaxNodes)
+        return false;
+    NodeMask m(node);
+    return syscall(SYS_set_mempolicy, kMpolPreferred, m.bits, kMaxNodes + 1) == 0;
+}
+
+// Binds [p, p + len) to `node`, moving pages already touched elsewhere.
+inline bool bindToNode(void* p, size_t len, int node) {
+    if (node < 0 || (size_t)node >= kMaxNodes || len == 0)
+        return false;
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t lo = (uintptr_t)p & ~(page - 1), hi = (uintptr_t)p + len;
+    NodeMask m(node);
+    return syscall(SYS_mbind, lo, hi - lo, kMpolBind, m.bits, kMaxNodes + 1, kMpolMfMove) == 0;
+}
+
+// Node holding the (already touched) page at `p`, or -1.
+inline int nodeOf(const void* p) {
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p, kMpolFNode | kMpolFAddr) != 0)
+        return -1;
+    return node;
+}
+
+// One executor per node, workers pinned to the node's CPUs and preferring
+// its memory.
+class NodeExecutors {
+private:
+    std::vector<Node> nodes;
+    std::vector<std::unique_ptr<exec::Executor>> pools;
+
+public:
+    // maxNodes == 0 uses every node; 1 confines the run to the first socket.
+    explicit NodeExecutors(size_t maxNodes = 0) : nodes(topology()) {
+        if (maxNodes && nodes.size() > maxNodes)
+            nodes.resize(maxNodes);
+        for (auto& n : nodes) {
+            int id = n.id;
+            pools.push_back(
+                std::make_unique<exec::Executor>(n.cpus, [id] { preferNode(id); }));
+        }
+    }
+
+    size_t size() const { return nodes.size(); }
+    const Node& node(size_t i) const { return nodes[i]; }
+    exec::Executor& executor(size_t i) { return *pools[i]; }
+
+    size_t workers() const {
+        size_t w = 0;
+        for (auto& p : pools)
+            w += p->size();
+        return w;
+    }
+
+    // [begin, end) of `n` items per node, sized by the node's worker count.
+    std::vector<std::pair<size_t, size_t>> ranges(size_t n) const {
+        std::vector<std::pair<size_t, size_t>> out;
+        size_t total = workers(), lo = 0, seen = 0;
+        for (auto& p : pools) {
+            seen += p->size();
+            size_t hi = n * seen / total;
+            out.push_back({lo, hi});
+            lo = hi;
+        }
+        return out;
+    }
+
+    // Runs fn(i) for every node i on one of that node's workers, all nodes
+    // at once, and waits for all of them.
+    template <class Fn>
+    void eachNode(Fn fn) {
+        std::mutex mu;
+        std::condition_variable done;
+        size_t left = pools.size();
+        for (size_t i = 0; i < pools.size(); ++i)
+            pools[i]->spawn([&, i] {
+                fn(i);
+                std::lock_guard<std::mutex> g(mu);
+                if (--left == 0)
+                    done.notify_one();
+            });
+        std::unique_lock<std::mutex> g(mu);
+        done.wait(g, [&] { return left == 0; });
+    }
+};
+
+// Splits `items` into one contiguous shard per node, each copied by a
+// worker on its node so the shard (and everything it owns) is node-local.
+template <class T>
+std::vector<std::vector<T>> scatter(NodeExecutors& nodes, const std::vector<T>& items) {
+    auto r = nodes.ranges(items.size());
+    std::vector<std::vector<T>> shards(nodes.size());
+    nodes.eachNode([&](size_t n) {
+        shards[n].assign(items.begin() + r[n].first, items.begin() + r[n].second);
+    });
+    return shards;
+}
+
+}  // namespace numa
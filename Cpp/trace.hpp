@@ -0,0 +1,199 @@
+// trace.hpp
+// Scoped trace spans shared by the assignment programs. Off by default;
+// a trace::Session turns recording on and writes Chrome trace JSON
+// (loadable in chrome://tracing and ui.perfetto.dev) when it ends.
+//
+//   trace::Session tracing(getenv("TRACE_OUT"));
+//   ...
+//   TRACE_SPAN("InvoiceService::process", "invoice");
+//
+// Each thread appends to its own buffer with no locks or shared writes;
+// timestamps are raw TSC ticks, converted to time only when dumping.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace trace {
+
+// Span names and categories must be string literals (or otherwise live
+// until the dump): only the pointer is stored.
+struct Event {
+    const char* name;
+    const char* cat;
+    uint64_t start;
+    uint64_t end;
+};
+
+struct ThreadBuffer {
+    static constexpr size_t kCapacity = 1 << 16;
+
+    long tid{0};
+    std::atomic<size_t> count{0};  // events [0, count) are complete
+    uint64_t dropped{0};
+    std::unique_ptr<Event[]> events{new Event[kCapacity]};
+};
+
+inline std::atomic<bool> gEnabled{false};
+inline thread_local ThreadBuffer* tlsBuffer = nullptr;
+
+inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+// Buffers outlive their threads so spans from finished workers still
+// make it into the dump.
+struct Registry {
+    std::mutex mu;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    uint64_t tick0{0};
+    std::chrono::steady_clock::time_point time0;
+};
+
+inline Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+inline ThreadBuffer* attach() {
+    auto b = std::make_unique<ThreadBuffer>();
+    b->tid = syscall(SYS_gettid);
+    tlsBuffer = b.get();
+    Registry& r = registry();
+    std::lock_guard<std::mutex> g(r.mu);
+    r.buffers.push_back(std::move(b));
+    return tlsBuffer;
+}
+
+inline void record(const char* name, const char* cat, uint64_t start, uint64_t end) {
+    ThreadBuffer* b = tlsBuffer ? tlsBuffer : attach();
+    size_t i = b->count.load(std::memory_order_relaxed);
+    if (i >= ThreadBuffer::kCapacity) {
+        ++b->dropped;
+        return;
+    }
+    b->events[i] = {name, cat, start, end};
+    b->count.store(i + 1, std::memory_order_release);
+}
+
+inline bool enabled() { return gEnabled.load(std::memory_order_relaxed); }
+
+inline void start() {
+    Registry& r = registry();
+    r.tick0 = now();
+    r.time0 = std::chrono::steady_clock::now();
+    gEnabled.store(true, std::memory_order_relaxed);
+}
+
+inline void stop() { gEnabled.store(false, std::memory_order_relaxed); }
+
+// Forgets recorded spans. Only safe while no thread is inside a span.
+inline void reset() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> g(r.mu);
+    for (auto& b : r.buffers) {
+        b->count.store(0, std::memory_order_relaxed);
+        b->dropped = 0;
+    }
+}
+
+class Span {
+private:
+    const char* name;
+    const char* cat;
+    uint64_t begin;
+
+public:
+    explicit Span(const char* n, const char* c = "app")
+        : name(n), cat(c), begin(enabled() ? now() : 0) {}
+    ~Span() {
+        if (begin)
+            record(name, cat, begin, now());
+    }
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(...) ::trace::Span TRACE_CONCAT(traceSpan_, __LINE__)(__VA_ARGS__)
+
+// Returns the number of spans written, or -1 if the file can't be opened.
+inline long writeChromeJson(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f)
+        return -1;
+    Registry& r = registry();
+    double elapsedNs = std::chrono::duration<double, std::nano>(
+                           std::chrono::steady_clock::now() - r.time0)
+                           .count();
+    uint64_t ticks = now() - r.tick0;
+    double usPerTick = ticks ? elapsedNs / ticks / 1000.0 : 0.001;
+    long pid = getpid(), written = 0;
+    uint64_t dropped = 0;
+
+    fputs("{\"traceEvents\":[\n", f);
+    std::lock_guard<std::mutex> g(r.mu);
+    for (auto& b : r.buffers) {
+        size_t n = b->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) {
+            const Event& e = b->events[i];
+            if (e.start < r.tick0)
+                continue;  // from before this session
+            fprintf(f,
+                    "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"pid\":%ld,\"tid\":%ld}",
+                    written ? ",\n" : "", e.name, e.cat, (e.start - r.tick0) * usPerTick,
+                    (e.end - e.start) * usPerTick, pid, b->tid);
+            ++written;
+        }
+        dropped += b->dropped;
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%llu}}\n",
+            (unsigned long long)dropped);
+    fclose(f);
+    return written;
+}
+
+// Records for its lifetime when given an output path, then dumps there.
+class Session {
+private:
+    std::string path;
+
+public:
+    explicit Session(const char* out) : path(out ? out : "") {
+        if (!path.empty())
+            start();
+    }
+    ~Session() {
+        if (path.empty())
+            return;
+        stop();
+        long n = writeChromeJson(path);
+        if (n < 0)
+            fprintf(stderr, "[Trace] cannot write %s\n", path.c_str());
+        else
+            fprintf(stderr, "[Trace] %ld spans -> %s\n", n, path.c_str());
+    }
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+};
+
+}  // namespace trace